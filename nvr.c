@@ -36,28 +36,242 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <time.h>
 
 /* ================================================================
- * Port I/O Primitives
+ * Build Profiles and Feature Switches
  * ================================================================ */
 
-static unsigned char inb(unsigned short port)
+/*
+ * "make PROFILE=minimal|config|full" sets NVR_PROFILE; each switch
+ * below can still be forced with -DNVR_xxx=0 or 1.
+ *
+ *   minimal  clock, raw CMOS, checksum and image save/load/compare;
+ *            terse help (the boot-floppy build)
+ *   config   + configuration display and setters, full help text
+ *   full     + hardware diagnostics, speaker, mouse, watch/monitor,
+ *            emulated backend
+ */
+#define NVR_PROFILE_MINIMAL 1
+#define NVR_PROFILE_CONFIG  2
+#define NVR_PROFILE_FULL    3
+
+#ifndef NVR_PROFILE
+#define NVR_PROFILE NVR_PROFILE_FULL
+#endif
+
+#ifndef NVR_CONFIG              /* show_* decoders, setters, alarm, battery */
+#define NVR_CONFIG  (NVR_PROFILE >= NVR_PROFILE_CONFIG)
+#endif
+#ifndef NVR_HELP                /* descriptive usage text */
+#define NVR_HELP    (NVR_PROFILE >= NVR_PROFILE_CONFIG)
+#endif
+#ifndef NVR_HW                  /* ports, PIC/DMA/PIT, probe, trace, inb/outb,
+                                   profile-timer */
+#define NVR_HW      (NVR_PROFILE >= NVR_PROFILE_FULL)
+#endif
+#ifndef NVR_SOUND               /* speaker-test, beep */
+#define NVR_SOUND   (NVR_PROFILE >= NVR_PROFILE_FULL)
+#endif
+#ifndef NVR_MOUSE               /* mouse, mouse-test, mouse-reset */
+#define NVR_MOUSE   (NVR_PROFILE >= NVR_PROFILE_FULL)
+#endif
+#ifndef NVR_WATCH               /* watch, monitor */
+#define NVR_WATCH   (NVR_PROFILE >= NVR_PROFILE_FULL)
+#endif
+#ifndef NVR_EMU                 /* -b emu / file:PATH backends */
+#define NVR_EMU     (NVR_PROFILE >= NVR_PROFILE_FULL)
+#endif
+#ifndef NVR_TINY_PRINTF         /* own printf: no C library formatter */
+#define NVR_TINY_PRINTF (NVR_PROFILE == NVR_PROFILE_MINIMAL)
+#endif
+
+/* Command run when none is given */
+#if NVR_CONFIG
+#define NVR_DEFAULT_CMD "show"
+#else
+#define NVR_DEFAULT_CMD "time"
+#endif
+
+/* The PIT timebase and delays are only needed by these */
+#define NVR_TIMING  (NVR_SOUND || NVR_MOUSE || NVR_HW || NVR_WATCH)
+
+#if NVR_TINY_PRINTF
+#include <stdarg.h>
+
+/* See "Minimal printf"; the names are swapped in for the whole file */
+static int nvr_printf(const char *fmt, ...)
+    __attribute__((format(__printf__, 1, 2)));
+static int nvr_fprintf(FILE *fp, const char *fmt, ...)
+    __attribute__((format(__printf__, 2, 3)));
+static int nvr_sprintf(char *dst, const char *fmt, ...)
+    __attribute__((format(__printf__, 2, 3)));
+
+#define printf  nvr_printf
+#define fprintf nvr_fprintf
+#define sprintf nvr_sprintf
+#endif
+
+/* ================================================================
+ * Port I/O Primitives and Backends
+ * ================================================================ */
+
+/*
+ * All hardware access goes through inb()/outb(), which dispatch to the
+ * selected backend: "ports" is the real bus, "emu" and "file:PATH" are
+ * the in-memory PC1640 model (see "Emulated Hardware Backend").
+ */
+struct io_backend {
+    const char *name;
+    unsigned char (*in)(unsigned short port);
+    void (*out)(unsigned char val, unsigned short port);
+    /* Optional CMOS block transfers; NULL falls back to in()/out() */
+    void (*cmos_in)(unsigned char start, unsigned char *buf, unsigned char n);
+    void (*cmos_out)(unsigned char start, const unsigned char *buf,
+                     unsigned char n);
+};
+
+static unsigned char bus_inb(unsigned short port)
 {
     unsigned char val;
     __asm__ volatile ("inb %%dx, %%al" : "=a" (val) : "d" (port));
     return val;
 }
 
-static void outb(unsigned char val, unsigned short port)
+static void bus_outb(unsigned char val, unsigned short port)
 {
     __asm__ volatile ("outb %%al, %%dx" : : "a" (val), "d" (port));
 }
 
+#if defined(__ia16__)
+/*
+ * CMOS burst loops for the real bus.  The index rides in AH and both
+ * port numbers are immediates, so each byte is one index OUT and one
+ * data IN/OUT with no port 0x80 write between them: at 8MHz the MOV
+ * and the ISA cycle itself already exceed the MC146818's address-to-
+ * data setup time.  Interrupts are masked for each pair only (see
+ * irq_save()).  n must be at least 1.
+ */
+static void bus_cmos_in(unsigned char start, unsigned char *buf, unsigned char n)
+{
+    unsigned short ax = (unsigned short)start << 8;
+
+    __asm__ volatile ("1:\n\t"
+                      "pushf\n\t"
+                      "cli\n\t"
+                      "movb %%ah, %%al\n\t"
+                      "outb %%al, $0x70\n\t"
+                      "inb $0x71, %%al\n\t"
+                      "popf\n\t"
+                      "movb %%al, (%1)\n\t"
+                      "incb %%ah\n\t"
+                      "inc %1\n\t"
+                      "decb %2\n\t"
+                      "jnz 1b"
+                      : "+a" (ax), "+D" (buf), "+c" (n) : : "memory");
+}
+
+static void bus_cmos_out(unsigned char start, const unsigned char *buf,
+                         unsigned char n)
+{
+    unsigned short ax = (unsigned short)start << 8;
+
+    __asm__ volatile ("1:\n\t"
+                      "pushf\n\t"
+                      "cli\n\t"
+                      "movb %%ah, %%al\n\t"
+                      "outb %%al, $0x70\n\t"
+                      "movb (%1), %%al\n\t"
+                      "outb %%al, $0x71\n\t"
+                      "popf\n\t"
+                      "incb %%ah\n\t"
+                      "inc %1\n\t"
+                      "decb %2\n\t"
+                      "jnz 1b"
+                      : "+a" (ax), "+S" (buf), "+c" (n) : : "memory");
+}
+
+static const struct io_backend io_ports = {
+    "ports", bus_inb, bus_outb, bus_cmos_in, bus_cmos_out
+};
+#else
+static const struct io_backend io_ports = { "ports", bus_inb, bus_outb, NULL, NULL };
+#endif
+static const struct io_backend *io = &io_ports;
+
+/*
+ * Always-on access counters, reported by --stats.  Motherboard ports
+ * (below 0x100) are counted individually; the rest share one bucket.
+ */
+static unsigned long io_reads[256], io_writes[256];
+
+static struct {
+    unsigned long hi_reads, hi_writes;  /* ports >= 0x100 */
+    unsigned long delays;               /* io_delay() calls */
+    unsigned long uip_waits;            /* rtc_wait_uip() calls */
+    unsigned long uip_spins;            /* polls that saw UIP set */
+    unsigned long uip_timeouts;
+    unsigned int uip_max_spins;         /* longest single wait, in polls */
+    unsigned short uip_max_ticks;       /* ... and in PIT ticks (--stats) */
+    unsigned long clock_retries;        /* rtc_read_clock() re-reads */
+    unsigned long clock_failures;
+} io_stats;
+
+static unsigned char inb(unsigned short port)
+{
+    if (port < 256)
+        io_reads[port]++;
+    else
+        io_stats.hi_reads++;
+    return io->in(port);
+}
+
+static void outb(unsigned char val, unsigned short port)
+{
+    if (port < 256)
+        io_writes[port]++;
+    else
+        io_stats.hi_writes++;
+    io->out(val, port);
+}
+
 /* Short delay for I/O bus settling (~1us on 8MHz 8086) */
 static void io_delay(void)
 {
-    __asm__ volatile ("outb %%al, $0x80" : : "a" (0));
+    io_stats.delays++;
+    io->out(0, 0x80);
+}
+
+/*
+ * Mask interrupts around an access that must not be split, such as a
+ * 0x70 index write and its 0x71 data access: a task switch or a kernel
+ * RTC handler in between would move the index.  ELKS user code may
+ * execute CLI; the saved FLAGS restore whatever state we came in with.
+ * Elsewhere (Linux native) these are no-ops.
+ */
+#if defined(__ia16__)
+static unsigned short irq_save(void)
+{
+    unsigned short flags;
+    __asm__ volatile ("pushf\n\tpop %0\n\tcli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+static void irq_restore(unsigned short flags)
+{
+    __asm__ volatile ("push %0\n\tpopf" : : "r" (flags) : "memory", "cc");
 }
+#else
+#define irq_save()          0
+#define irq_restore(flags)  ((void)(flags))
+#endif
 
 /* ================================================================
  * MC146818 RTC/CMOS Access (ports 0x70/0x71)
@@ -152,6 +366,7 @@ static void io_delay(void)
 #define PORT_PIC_CMD        0x20   /* 8259A PIC command */
 #define PORT_PIC_DATA       0x21   /* 8259A PIC data (IMR) */
 #define PORT_NMI_MASK       0xA0   /* NMI mask register */
+#define PORT_PIT_CH0        0x40   /* 8253 PIT channel 0 count */
 #define PORT_PIT_CH2        0x42   /* 8253 PIT channel 2 count */
 #define PORT_PIT_MODE       0x43   /* 8253 PIT mode control */
 #define PORT_DMA_STAT       0x08   /* 8237A DMA status */
@@ -199,1810 +414,5839 @@ static int debug_level = 0;
 } while(0)
 
 /* ================================================================
- * CMOS Read/Write with PC1640 Masking
+ * Buffered Output
  * ================================================================ */
 
-static unsigned char cmos_read(unsigned char addr)
+/*
+ * Small formatter for the table-heavy display routines: text collects
+ * in one static buffer and leaves with a single write(), and the hex
+ * and decimal emitters do no format parsing.  A routine either uses
+ * these or printf() throughout, and ends with out_flush(); out_flush()
+ * drains stdio first so the two streams stay in order.
+ */
+#define OUT_BUF_SIZE    512
+
+static char out_buf[OUT_BUF_SIZE];
+static unsigned int out_len = 0;
+
+static void out_flush(void)
 {
-    unsigned char val;
-    addr &= 0x3F;  /* PC1640: 64-byte CMOS only */
-    outb(addr, CMOS_ADDR_PORT);
-    io_delay();
-    val = inb(CMOS_DATA_PORT);
-    DBG(3, "cmos_read(0x%02X) = 0x%02X\n", addr, val);
-    return val;
+    fflush(stdout);
+    if (out_len && write(1, out_buf, out_len) < 0)
+        perror("write");
+    out_len = 0;
 }
 
-static void cmos_write(unsigned char addr, unsigned char val)
+static void out_char(char c)
 {
-    addr &= 0x3F;
-    DBG(3, "cmos_write(0x%02X, 0x%02X)\n", addr, val);
-    outb(addr, CMOS_ADDR_PORT);
-    io_delay();
-    outb(val, CMOS_DATA_PORT);
-    io_delay();
+    if (out_len == OUT_BUF_SIZE)
+        out_flush();
+    out_buf[out_len++] = c;
 }
 
-/* ================================================================
- * BCD Conversion Helpers
- * ================================================================ */
+static void out_str(const char *s)
+{
+    while (*s)
+        out_char(*s++);
+}
 
-static unsigned char bcd_to_bin(unsigned char bcd)
+/* Upper-case hex, zero-padded to 'digits' */
+static void out_hex(unsigned int v, int digits)
 {
-    return ((bcd >> 4) * 10) + (bcd & 0x0F);
+    static const char hex[] = "0123456789ABCDEF";
+
+    while (digits-- > 0)
+        out_char(hex[(v >> (digits * 4)) & 0x0F]);
 }
 
-static unsigned char bin_to_bcd(unsigned char bin)
+/* Decimal, right-aligned in 'width' (space-padded, or '0' if zero) */
+static void out_dec_pad(long v, int width, char pad)
 {
-    return ((bin / 10) << 4) | (bin % 10);
+    char tmp[12];
+    int n = 0, neg = v < 0;
+    unsigned long u = neg ? -(unsigned long)v : (unsigned long)v;
+
+    do {
+        tmp[n++] = '0' + (char)(u % 10);
+        u /= 10;
+    } while (u);
+    if (neg)
+        tmp[n++] = '-';
+    while (width-- > n)
+        out_char(pad);
+    while (n)
+        out_char(tmp[--n]);
 }
 
-static int rtc_is_bcd(void)
+static void out_dec(long v, int width)
 {
-    return !(cmos_read(RTC_REG_B) & RTC_B_DM);
+    out_dec_pad(v, width, ' ');
 }
 
-static unsigned char rtc_to_bin(unsigned char val)
+/* "0xNN" */
+static void out_byte(unsigned char v)
 {
-    return rtc_is_bcd() ? bcd_to_bin(val) : val;
+    out_str("0x");
+    out_hex(v, 2);
 }
 
-static unsigned char bin_to_rtc(unsigned char val)
+#if NVR_CONFIG || NVR_HW
+/* "<label>0xNN\n", the common register line */
+static void out_reg(const char *label, unsigned char v)
 {
-    return rtc_is_bcd() ? bin_to_bcd(val) : val;
+    out_str(label);
+    out_byte(v);
+    out_char('\n');
 }
 
-/* Wait for RTC update cycle to complete */
-static void rtc_wait_uip(void)
+/* "<label>YES|no\n" style flag line */
+static void out_flag(const char *label, int set, const char *on, const char *off)
 {
-    int timeout = 10000;
-    while ((cmos_read(RTC_REG_A) & RTC_A_UIP) && --timeout > 0)
-        ;
-    if (timeout == 0)
-        DBG(1, "WARNING: RTC UIP timeout\n");
+    out_str(label);
+    out_str(set ? on : off);
+    out_char('\n');
 }
+#endif
+
+#if NVR_TINY_PRINTF
 
 /* ================================================================
- * Amstrad System Status Access
+ * Minimal printf
  * ================================================================ */
 
 /*
- * Read system status 2 via port 0x62 with nibble protocol.
- * From BIOS ROM disassembly at 0x0465-0x047B.
- *
- * PB bit 2 = 0: read high nibble (bits 7-4 of latch, returned as bits 3-0)
- * PB bit 2 = 1: read low nibble (bits 3-0 of latch, returned as bits 3-0)
+ * With NVR_TINY_PRINTF (on in the minimal profile) printf, fprintf and
+ * sprintf are this formatter, so the C library's is never linked.  It
+ * knows what this file uses: flags '-' and '0', a width, ".N" or ".*"
+ * on strings, 'l', and %d %u %x %X %c %s %%.  stdout text joins the
+ * out_* buffer (main() flushes it at exit), other streams get it in
+ * PF_BUF_SIZE chunks through fwrite().
  */
-static unsigned char amstrad_read_sysstat2(void)
-{
-    unsigned char pb, hi, lo;
-
-    pb = inb(PORT_PB);
-    outb(pb & ~PB_NIBBLE_SEL, PORT_PB);
-    io_delay();
-    hi = inb(PORT_STATUS2) & 0x0F;
+#define PF_BUF_SIZE     64
 
-    outb(pb | PB_NIBBLE_SEL, PORT_PB);
-    io_delay();
-    lo = inb(PORT_STATUS2) & 0x0F;
+static char pf_buf[PF_BUF_SIZE];
+static unsigned int pf_len;
+static FILE *pf_fp;
+static char *pf_dst;
 
-    outb(pb, PORT_PB);  /* restore */
+static void pf_put_file(char c)
+{
+    if (pf_len == PF_BUF_SIZE) {
+        fwrite(pf_buf, 1, pf_len, pf_fp);
+        pf_len = 0;
+    }
+    pf_buf[pf_len++] = c;
+}
 
-    DBG(2, "sysstat2: hi=0x%X lo=0x%X => 0x%02X\n", hi, lo, (hi << 4) | lo);
-    return (hi << 4) | lo;
+static void pf_put_str(char c)
+{
+    *pf_dst++ = c;
 }
 
-/*
- * Read system status 1 via port 0x60 with PB bit 7.
- * From BIOS ROM at 0x03F3-0x040F.
- */
-static unsigned char amstrad_read_sysstat1(void)
+static void pf_format(void (*put)(char), const char *f, va_list ap)
 {
-    unsigned char pb, val;
+    static const char digits[] = "0123456789abcdef";
+    char tmp[12], *p;
+    const char *str;
+    unsigned long u;
+    int left, zero, width, prec, lng, neg, base, n, pad;
+
+    for (; *f; f++) {
+        if (*f != '%') {
+            put(*f);
+            continue;
+        }
+        left = zero = width = lng = neg = base = 0;
+        prec = -1;
+        if (*++f == '-')
+            left = 1, f++;
+        if (*f == '0')
+            zero = 1, f++;
+        while (*f >= '0' && *f <= '9')
+            width = width * 10 + *f++ - '0';
+        if (*f == '.') {
+            if (*++f == '*') {
+                prec = va_arg(ap, int);
+                f++;
+            } else {
+                for (prec = 0; *f >= '0' && *f <= '9'; f++)
+                    prec = prec * 10 + *f - '0';
+            }
+        }
+        if (*f == 'l')
+            lng = 1, f++;
+
+        switch (*f) {
+        case 'd':
+        case 'i': {
+            long v = lng ? va_arg(ap, long) : va_arg(ap, int);
+            neg = v < 0;
+            u = neg ? -(unsigned long)v : (unsigned long)v;
+            base = 10;
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+            u = lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            base = (*f == 'u') ? 10 : 16;
+            break;
+        case 'c':
+            tmp[0] = (char)va_arg(ap, int);
+            str = tmp;
+            n = 1;
+            break;
+        case 's':
+            str = va_arg(ap, const char *);
+            for (n = 0; str[n] && (prec < 0 || n < prec); n++)
+                ;
+            break;
+        case '\0':
+            return;
+        default:                /* "%%" and anything unknown */
+            put(*f);
+            continue;
+        }
 
-    pb = inb(PORT_PB);
-    outb(pb | PB_STATUS_MODE, PORT_PB);
-    io_delay();
-    val = inb(PORT_KBD_DATA);
-    outb(pb, PORT_PB);
+        if (base) {
+            p = tmp + sizeof(tmp);
+            do {
+                char c = digits[u % base];
+                *--p = (*f == 'X' && c > '9') ? c - 0x20 : c;
+                u /= base;
+            } while (u);
+            str = p;
+            n = (int)(tmp + sizeof(tmp) - p);
+        } else {
+            zero = 0;
+        }
 
-    DBG(2, "sysstat1: 0x%02X\n", val);
-    return val;
+        pad = width - n - neg;
+        if (neg && zero)
+            put('-');
+        if (!left)
+            for (; pad > 0; pad--)
+                put(zero ? '0' : ' ');
+        if (neg && !zero)
+            put('-');
+        while (n--)
+            put(*str++);
+        for (; pad > 0; pad--)
+            put(' ');
+    }
 }
 
-/* ================================================================
- * CMOS Checksum (bytes 0x10-0x2D)
- * ================================================================ */
-
-static unsigned short cmos_calc_checksum(void)
+static int nvr_printf(const char *fmt, ...)
 {
-    unsigned short sum = 0;
-    int i;
-    for (i = 0x10; i <= 0x2D; i++)
-        sum += cmos_read(i);
-    DBG(2, "Calculated checksum: 0x%04X\n", sum);
-    return sum;
+    va_list ap;
+
+    va_start(ap, fmt);
+    pf_format(out_char, fmt, ap);
+    va_end(ap);
+    return 0;
 }
 
-static int cmos_verify_checksum(void)
+static int nvr_fprintf(FILE *fp, const char *fmt, ...)
 {
-    unsigned short calc, stored;
-    calc = cmos_calc_checksum();
-    stored = ((unsigned short)cmos_read(CMOS_CHECKSUM_HI) << 8) |
-             cmos_read(CMOS_CHECKSUM_LO);
-    DBG(1, "Checksum stored=0x%04X calc=0x%04X\n", stored, calc);
-    return (calc == stored);
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (fp == stdout) {
+        pf_format(out_char, fmt, ap);
+    } else {
+        if (fp == stderr)
+            out_flush();            /* keep stdout text ahead of it */
+        pf_fp = fp;
+        pf_len = 0;
+        pf_format(pf_put_file, fmt, ap);
+        fwrite(pf_buf, 1, pf_len, fp);
+    }
+    va_end(ap);
+    return 0;
 }
 
-static void cmos_update_checksum(void)
+static int nvr_sprintf(char *dst, const char *fmt, ...)
 {
-    unsigned short sum = cmos_calc_checksum();
-    cmos_write(CMOS_CHECKSUM_HI, (sum >> 8) & 0xFF);
-    cmos_write(CMOS_CHECKSUM_LO, sum & 0xFF);
-    DBG(1, "Checksum updated to 0x%04X\n", sum);
+    va_list ap;
+
+    va_start(ap, fmt);
+    pf_dst = dst;
+    pf_format(pf_put_str, fmt, ap);
+    *pf_dst = '\0';
+    va_end(ap);
+    return (int)(pf_dst - dst);
 }
 
+#endif /* NVR_TINY_PRINTF */
+
 /* ================================================================
- * Display: Time & Date
+ * CMOS Read/Write with PC1640 Masking
  * ================================================================ */
 
-static const char *day_names[] = {
-    "???", "Sunday", "Monday", "Tuesday",
-    "Wednesday", "Thursday", "Friday", "Saturday"
-};
+static unsigned char cmos_image[CMOS_SIZE];  /* see cmos_snapshot() */
+static int cmos_image_valid = 0;
 
-static const char *month_names[] = {
-    "???", "January", "February", "March", "April",
-    "May", "June", "July", "August",
-    "September", "October", "November", "December"
-};
+/* Write staging state, see "Staged CMOS Writes" below */
+static unsigned char stage_shadow[CMOS_SIZE];
+static unsigned char stage_orig[CMOS_SIZE];
+static unsigned char stage_loaded[CMOS_SIZE / 8];
+static unsigned char stage_dirty[CMOS_SIZE / 8];
+static int stage_depth = 0;
+static int stage_written = 0;               /* bytes put out by last commit */
+static int cksum_bad = 0;                   /* a verify found the stored sum wrong */
 
-static void show_time(void)
-{
-    unsigned char sec, min, hrs, dow, dom, mon, yr, cen;
-    unsigned char regb;
+#define BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+#define BIT_SET(map, i)   ((map)[(i) >> 3] |= (1 << ((i) & 7)))
 
-    rtc_wait_uip();
+/* Cached Register B, see rtc_mode_select() */
+static unsigned char rtc_regb;
+static int rtc_regb_valid = 0;
 
-    sec = cmos_read(RTC_SECONDS);
-    min = cmos_read(RTC_MINUTES);
-    hrs = cmos_read(RTC_HOURS);
-    dow = cmos_read(RTC_DAY_OF_WEEK);
-    dom = cmos_read(RTC_DAY_OF_MONTH);
-    mon = cmos_read(RTC_MONTH);
-    yr  = cmos_read(RTC_YEAR);
-    cen = cmos_read(CMOS_CENTURY);
-    regb = cmos_read(RTC_REG_B);
+static void rtc_mode_select(unsigned char regb);
 
-    DBG(2, "Raw: sec=%02X min=%02X hrs=%02X dow=%02X dom=%02X "
-           "mon=%02X yr=%02X cen=%02X regB=%02X\n",
-           sec, min, hrs, dow, dom, mon, yr, cen, regb);
+static unsigned char cmos_read(unsigned char addr)
+{
+    unsigned char val;
+    unsigned short flags;
+    addr &= 0x3F;  /* PC1640: 64-byte CMOS only */
+    flags = irq_save();
+    outb(addr, CMOS_ADDR_PORT);
+    io_delay();
+    val = inb(CMOS_DATA_PORT);
+    irq_restore(flags);
+    DBG(3, "cmos_read(0x%02X) = 0x%02X\n", addr, val);
+    return val;
+}
 
-    sec = rtc_to_bin(sec);
-    min = rtc_to_bin(min);
-    dom = rtc_to_bin(dom);
-    mon = rtc_to_bin(mon);
-    yr  = rtc_to_bin(yr);
-    cen = rtc_to_bin(cen);
-    dow = rtc_to_bin(dow);
+/* Put a byte on the bus immediately, bypassing any open transaction */
+static void cmos_write_port(unsigned char addr, unsigned char val)
+{
+    unsigned short flags;
+    addr &= 0x3F;
+    DBG(3, "cmos_write(0x%02X, 0x%02X)\n", addr, val);
+    flags = irq_save();
+    outb(addr, CMOS_ADDR_PORT);
+    io_delay();
+    outb(val, CMOS_DATA_PORT);
+    irq_restore(flags);
+    io_delay();
+    if (cmos_image_valid)
+        cmos_image[addr] = val;
+    if (addr == RTC_REG_B)
+        rtc_mode_select(val);
+}
+
+/*
+ * Burst transfers of n contiguous bytes from start (start + n must not
+ * pass CMOS_SIZE).  Each byte is still an index write plus a data
+ * access, but without the per-byte io_delay() and DBG: the instruction
+ * gap between the two OUTs/INs covers MC146818 setup on the PC1640, so
+ * a write burst settles once at the end.  The backend may supply an
+ * asm loop; counters are kept the same either way.
+ */
+static void cmos_read_burst(unsigned char start, unsigned char *buf, int n)
+{
+    unsigned short flags;
+    int i;
 
-    if (regb & RTC_B_24H) {
-        hrs = rtc_to_bin(hrs);
+    if (n <= 0)
+        return;
+    io_writes[CMOS_ADDR_PORT] += n;
+    io_reads[CMOS_DATA_PORT] += n;
+    if (io->cmos_in) {
+        io->cmos_in(start, buf, (unsigned char)n);
     } else {
-        int pm = hrs & 0x80;
-        hrs &= 0x7F;
-        hrs = rtc_to_bin(hrs);
-        if (pm) { if (hrs < 12) hrs += 12; }
-        else    { if (hrs == 12) hrs = 0;  }
+        for (i = 0; i < n; i++) {
+            flags = irq_save();
+            io->out((start + i) & 0x3F, CMOS_ADDR_PORT);
+            buf[i] = io->in(CMOS_DATA_PORT);
+            irq_restore(flags);
+        }
     }
+    DBG(3, "cmos_read_burst(0x%02X, %d)\n", start, n);
+}
 
-    if (dow > 7) dow = 0;
-    if (mon > 12) mon = 0;
+static void cmos_write_burst(unsigned char start, const unsigned char *buf, int n)
+{
+    unsigned short flags;
+    int i;
 
-    printf("Date: %s %d %s %d%02d\n",
-           day_names[dow], dom, month_names[mon], cen, yr);
-    printf("Time: %02d:%02d:%02d\n", hrs, min, sec);
-    printf("Mode: %s, %s\n",
-           (regb & RTC_B_24H) ? "24-hour" : "12-hour",
-           (regb & RTC_B_DM) ? "Binary" : "BCD");
+    if (n <= 0)
+        return;
+    DBG(3, "cmos_write_burst(0x%02X, %d)\n", start, n);
+    io_writes[CMOS_ADDR_PORT] += n;
+    io_writes[CMOS_DATA_PORT] += n;
+    if (io->cmos_out) {
+        io->cmos_out(start, buf, (unsigned char)n);
+    } else {
+        for (i = 0; i < n; i++) {
+            flags = irq_save();
+            io->out((start + i) & 0x3F, CMOS_ADDR_PORT);
+            io->out(buf[i], CMOS_DATA_PORT);
+            irq_restore(flags);
+        }
+    }
+    io_delay();
+    if (cmos_image_valid)
+        memcpy(cmos_image + start, buf, n);
+    if (start <= RTC_REG_B && start + n > RTC_REG_B)
+        rtc_mode_select(buf[RTC_REG_B - start]);
 }
 
-/* ================================================================
- * Display: RTC Status Registers
- * ================================================================ */
+/* Shadow copy of addr, fetched from the snapshot or chip on first use */
+static unsigned char stage_load(unsigned char addr)
+{
+    if (!BIT_TEST(stage_loaded, addr)) {
+        stage_orig[addr] = cmos_image_valid ? cmos_image[addr]
+                                            : cmos_read(addr);
+        stage_shadow[addr] = stage_orig[addr];
+        BIT_SET(stage_loaded, addr);
+    }
+    return stage_shadow[addr];
+}
 
-/* Periodic interrupt rate table (from MC146818 datasheet) */
-static const char *rate_freq[] = {
-    "None",        /* 0 */
-    "256 Hz",      /* 1 - 3.90625ms */
-    "128 Hz",      /* 2 - 7.8125ms */
-    "8192 Hz",     /* 3 - 122.070us */
-    "4096 Hz",     /* 4 */
-    "2048 Hz",     /* 5 */
-    "1024 Hz",     /* 6 */
-    "512 Hz",      /* 7 */
-    "256 Hz",      /* 8 */
-    "128 Hz",      /* 9 */
-    "64 Hz",       /* 10 */
-    "32 Hz",       /* 11 */
-    "16 Hz",       /* 12 */
-    "8 Hz",        /* 13 */
-    "4 Hz",        /* 14 */
-    "2 Hz"         /* 15 */
-};
+/* Write a CMOS byte: staged while a transaction is open, else direct */
+static void cmos_write(unsigned char addr, unsigned char val)
+{
+    addr &= 0x3F;
+    if (stage_depth == 0) {
+        cmos_write_port(addr, val);
+        return;
+    }
+    stage_load(addr);
+    stage_shadow[addr] = val;
+    BIT_SET(stage_dirty, addr);
+    DBG(3, "cmos_write(0x%02X, 0x%02X) staged\n", addr, val);
+    if (addr == RTC_REG_B)
+        rtc_mode_select(val);
+}
 
-static const char *divider_name[] = {
-    "4.194304 MHz (time base)", /* 0 */
-    "1.048576 MHz",             /* 1 */
-    "32.768 kHz",               /* 2 - standard crystal */
-    "Test: any",                /* 3 */
-    "Test: any",                /* 4 */
-    "Reset / divider held",     /* 5 */
-    "Reset / divider held",     /* 6 */
-    "Reset / divider held"      /* 7 */
-};
+/* Set by --stats; enables the PIT-timed parts of the counters */
+static int stats_enabled = 0;
 
-static void show_rtc_status(void)
+/* Latch and read PIT channel 0 (free-running, counts down at PIT_HZ) */
+static unsigned short pit0_read(void)
 {
-    unsigned char rega, regb, regc, regd;
+    unsigned char lo;
 
-    rega = cmos_read(RTC_REG_A);
-    regb = cmos_read(RTC_REG_B);
-    regc = cmos_read(RTC_REG_C);  /* clears IRQ flags */
-    regd = cmos_read(RTC_REG_D);
-
-    printf("\nRTC Status Registers:\n");
-    printf("  Register A (0x0A): 0x%02X\n", rega);
-    printf("    Update In Progress: %s\n",
-           (rega & RTC_A_UIP) ? "Yes (do not read time)" : "No");
-    printf("    Divider: %d - %s\n",
-           (rega & RTC_A_DV_MASK) >> RTC_A_DV_SHIFT,
-           divider_name[(rega & RTC_A_DV_MASK) >> RTC_A_DV_SHIFT]);
-    printf("    Rate select: %d - %s\n",
-           rega & RTC_A_RS_MASK,
-           rate_freq[rega & RTC_A_RS_MASK]);
-
-    printf("  Register B (0x0B): 0x%02X\n", regb);
-    printf("    SET (halt updates):     %s\n", (regb & RTC_B_SET)  ? "YES" : "no");
-    printf("    Periodic IRQ enable:    %s\n", (regb & RTC_B_PIE)  ? "YES" : "no");
-    printf("    Alarm IRQ enable:       %s\n", (regb & RTC_B_AIE)  ? "YES" : "no");
-    printf("    Update-end IRQ enable:  %s\n", (regb & RTC_B_UIE)  ? "YES" : "no");
-    printf("    Square wave output:     %s\n", (regb & RTC_B_SQWE) ? "YES" : "no");
-    printf("    Data mode:              %s\n", (regb & RTC_B_DM)   ? "Binary" : "BCD");
-    printf("    Hour format:            %s\n", (regb & RTC_B_24H)  ? "24-hour" : "12-hour");
-    printf("    Daylight savings:       %s\n", (regb & RTC_B_DSE)  ? "YES" : "no");
-
-    printf("  Register C (0x0C): 0x%02X  [read clears flags]\n", regc);
-    printf("    IRQ flag (composite):   %s\n", (regc & RTC_C_IRQF) ? "SET" : "clear");
-    printf("    Periodic flag:          %s\n", (regc & RTC_C_PF)   ? "SET" : "clear");
-    printf("    Alarm flag:             %s\n", (regc & RTC_C_AF)   ? "SET" : "clear");
-    printf("    Update-ended flag:      %s\n", (regc & RTC_C_UF)   ? "SET" : "clear");
-
-    printf("  Register D (0x0D): 0x%02X\n", regd);
-    printf("    Battery: %s\n",
-           (regd & RTC_D_VRT) ? "OK (valid RAM & time)"
-                              : "*** DEAD - REPLACE BATTERY ***");
+    io->out(0x00, PORT_PIT_MODE);       /* latch channel 0 */
+    lo = io->in(PORT_PIT_CH0);
+    return lo | ((unsigned short)io->in(PORT_PIT_CH0) << 8);
 }
 
-/* ================================================================
- * Display: Alarm
- * ================================================================ */
+/*
+ * Wait for the falling edge of UIP if an update is in progress.  UIP
+ * rises 244 us before an update and the update itself takes 1984 us,
+ * so a healthy chip never holds it longer than ~2.3 ms; the poll cap
+ * is far beyond that on an 8 MHz 8086.  Timeouts are counted and the
+ * caller carries on.
+ */
+#define RTC_UIP_POLLS   10000
 
-static void show_alarm(void)
+static void rtc_wait_uip(void)
 {
-    unsigned char sec, min, hrs, regb;
-
-    rtc_wait_uip();
-
-    sec = cmos_read(RTC_ALARM_SEC);
-    min = cmos_read(RTC_ALARM_MIN);
-    hrs = cmos_read(RTC_ALARM_HRS);
-    regb = cmos_read(RTC_REG_B);
-
-    printf("\nRTC Alarm:\n");
-
-    /* 0xC0-0xFF in alarm registers means "don't care" (wildcard) */
-    if (sec >= 0xC0 && min >= 0xC0 && hrs >= 0xC0) {
-        printf("  Alarm: Not set (all wildcards)\n");
-    } else {
-        printf("  Alarm time: ");
-        if (hrs >= 0xC0)
-            printf("**");
-        else
-            printf("%02d", rtc_to_bin(hrs));
-        printf(":");
-        if (min >= 0xC0)
-            printf("**");
-        else
-            printf("%02d", rtc_to_bin(min));
-        printf(":");
-        if (sec >= 0xC0)
-            printf("**");
-        else
-            printf("%02d", rtc_to_bin(sec));
-        printf("\n");
-        printf("  (** = wildcard/don't care)\n");
+    unsigned int spins = 0;
+    unsigned short t0 = 0;
+
+    io_stats.uip_waits++;
+    if (stats_enabled)
+        t0 = pit0_read();
+    while (cmos_read(RTC_REG_A) & RTC_A_UIP) {
+        if (++spins == RTC_UIP_POLLS) {
+            io_stats.uip_timeouts++;
+            DBG(1, "WARNING: RTC UIP timeout\n");
+            break;
+        }
+    }
+    io_stats.uip_spins += spins;
+    if (spins > io_stats.uip_max_spins)
+        io_stats.uip_max_spins = spins;
+    if (stats_enabled && spins) {
+        unsigned short dt = t0 - pit0_read();
+        if (dt > io_stats.uip_max_ticks)
+            io_stats.uip_max_ticks = dt;
     }
-
-    printf("  Alarm IRQ: %s\n",
-           (regb & RTC_B_AIE) ? "ENABLED (routes to IRQ 1 on PC1640)"
-                              : "Disabled");
 }
 
-static int set_alarm(const char *timestr)
+/*
+ * Read the ten clock registers (0x00-0x09) as one consistent set.
+ * After UIP is seen clear there are at least 244 us before the next
+ * update may touch them, so they are read back to back; the set is
+ * accepted only if UIP is still clear and the seconds have not moved
+ * afterwards, otherwise it is read again.  Worst case is a handful of
+ * UIP waits, each bounded above.  Returns 0, or -1 if no consistent
+ * read was possible (the last attempt is left in t).
+ */
+#define RTC_READ_TRIES  4
+
+static int rtc_read_clock(unsigned char *t)
 {
-    int hrs, min, sec;
-    unsigned char regb;
+    int tries;
 
-    if (sscanf(timestr, "%d:%d:%d", &hrs, &min, &sec) != 3) {
-        fprintf(stderr, "Error: Alarm format must be HH:MM:SS\n");
-        fprintf(stderr, "  Use -1 for wildcard (e.g. -1:-1:00 = every minute at :00)\n");
-        return 1;
+    for (tries = 0; tries < RTC_READ_TRIES; tries++) {
+        if (tries)
+            io_stats.clock_retries++;
+        rtc_wait_uip();
+        cmos_read_burst(0, t, RTC_YEAR + 1);
+        if (!(cmos_read(RTC_REG_A) & RTC_A_UIP) &&
+            cmos_read(RTC_SECONDS) == t[RTC_SECONDS])
+            return 0;
+        DBG(1, "Clock read straddled an RTC update, retrying\n");
     }
+    io_stats.clock_failures++;
+    fprintf(stderr, "Warning: could not get a consistent RTC time read\n");
+    return -1;
+}
 
-    regb = cmos_read(RTC_REG_B);
-    cmos_write(RTC_REG_B, regb | RTC_B_SET);
-
-    /* -1 means wildcard (don't care) = 0xC0 */
-    cmos_write(RTC_ALARM_SEC, (sec < 0) ? 0xC0 : bin_to_rtc(sec));
-    cmos_write(RTC_ALARM_MIN, (min < 0) ? 0xC0 : bin_to_rtc(min));
-    cmos_write(RTC_ALARM_HRS, (hrs < 0) ? 0xC0 : bin_to_rtc(hrs));
-
-    cmos_write(RTC_REG_B, regb & ~RTC_B_SET);
+/* ================================================================
+ * CMOS Snapshot
+ * ================================================================ */
 
-    printf("Alarm set to %s\n", timestr);
-    printf("Note: Use 'nvr alarm-enable' to arm the alarm IRQ\n");
-    return 0;
+/*
+ * Capture all 64 CMOS bytes into cmos_image in one UIP-safe pass.
+ * While the image is valid every decoder reads it through cmos_get()
+ * instead of going back to the ports, so a full "show" costs a single
+ * sweep of the chip and all fields come from the same instant.
+ * cmos_write() keeps the image coherent with what it puts on the bus.
+ *
+ * The clock registers are taken first by rtc_read_clock(), inside the
+ * post-UIP window; the remaining bytes are not touched by updates.
+ */
+static void cmos_snapshot(void)
+{
+    rtc_read_clock(cmos_image);
+    cmos_read_burst(RTC_YEAR + 1, cmos_image + RTC_YEAR + 1,
+                    CMOS_SIZE - (RTC_YEAR + 1));
+    cmos_image_valid = 1;
+    DBG(2, "CMOS snapshot taken\n");
 }
 
-static void alarm_enable(int enable)
+/*
+ * Read a CMOS byte as the program currently sees it: the staged value
+ * inside a transaction, else the snapshot if one was taken, else the chip.
+ */
+static unsigned char cmos_get(unsigned char addr)
 {
-    unsigned char regb = cmos_read(RTC_REG_B);
+    addr &= 0x3F;
+    if (stage_depth)
+        return stage_load(addr);
+    if (cmos_image_valid)
+        return cmos_image[addr];
+    return cmos_read(addr);
+}
 
-    if (enable)
-        regb |= RTC_B_AIE;
-    else
-        regb &= ~RTC_B_AIE;
+/* Clock registers as the program sees them: staged or snapshot, else live */
+static void rtc_clock_get(unsigned char *t)
+{
+    int i;
 
-    cmos_write(RTC_REG_B, regb);
-    printf("Alarm IRQ %s\n", enable ? "ENABLED" : "disabled");
-    if (enable)
-        printf("  Note: On PC1640 alarm routes to IRQ 1 (shared with keyboard)\n");
+    if (stage_depth || cmos_image_valid) {
+        for (i = 0; i <= RTC_YEAR; i++)
+            t[i] = cmos_get(i);
+    } else {
+        rtc_read_clock(t);
+    }
 }
 
 /* ================================================================
- * Display: Floppy Drives
+ * Staged CMOS Writes
  * ================================================================ */
 
-static const char *floppy_type_str(unsigned char type)
+/*
+ * Setters bracket their work with stage_begin()/stage_commit().  Inside
+ * the bracket cmos_write() only updates a shadow copy and cmos_get()
+ * reads it back, so read-modify-write sequences and the checksum
+ * (adjusted by cmos_update_checksum() from the shadow) cost no extra
+ * port traffic.  Commit then writes just the bytes whose value differs
+ * from what was originally read, with Register B's SET bit held so the
+ * BIOS or an update cycle never sees a half-written configuration.
+ *
+ * Transactions nest: batch mode opens an outer one so that a whole
+ * script lands in a single commit.  Clock bytes 0x00-0x09 that were
+ * written are always committed, since the chip ticks past the value
+ * they were compared against.
+ */
+static void stage_begin(void)
 {
-    switch (type) {
-    case 0: return "Not installed";
-    case 1: return "360 KB 5.25\" DD";
-    case 2: return "1.2 MB 5.25\" HD";
-    case 3: return "720 KB 3.5\" DD";
-    case 4: return "1.44 MB 3.5\" HD";
-    default: return "Unknown";
-    }
+    if (stage_depth++ > 0)
+        return;
+    memset(stage_loaded, 0, sizeof(stage_loaded));
+    memset(stage_dirty, 0, sizeof(stage_dirty));
 }
 
-static void show_floppy(void)
+static int stage_changed(int addr)
 {
-    unsigned char floppy = cmos_read(CMOS_FLOPPY);
-    unsigned char equip = cmos_read(CMOS_EQUIP);
-    int ndrives;
-
-    printf("\nFloppy Drive Configuration:\n");
-    printf("  CMOS byte 0x10: 0x%02X\n", floppy);
-    printf("  Drive A: type %d - %s\n",
-           (floppy >> 4) & 0x0F, floppy_type_str((floppy >> 4) & 0x0F));
-    printf("  Drive B: type %d - %s\n",
-           floppy & 0x0F, floppy_type_str(floppy & 0x0F));
-
-    ndrives = (equip & 0x01) ? ((equip >> 6) & 0x03) + 1 : 0;
-    printf("  Equipment says: %d drive(s) installed\n", ndrives);
-    printf("  Disk-change line: active-low (PC1640 specific)\n");
+    if (!BIT_TEST(stage_dirty, addr) || addr == RTC_REG_C || addr == RTC_REG_D)
+        return 0;
+    return addr <= RTC_YEAR || stage_shadow[addr] != stage_orig[addr];
 }
 
-static int set_floppy(const char *drv, const char *typestr)
+/*
+ * Close a transaction; the outermost one writes the diff and reads the
+ * changed bytes from 0x0E up back (the clock and Registers A-D move on
+ * their own).  Returns 0, or 1 if any of them did not stick.
+ */
+static int stage_commit(void)
 {
-    int type = atoi(typestr);
-    unsigned char floppy;
+    unsigned char regb, final_b, back[CMOS_SIZE];
+    int i, j, n = 0, bad = 0;
 
-    if (type < 0 || type > 4) {
-        fprintf(stderr, "Error: Floppy type must be 0-4:\n");
-        fprintf(stderr, "  0 = Not installed    3 = 720 KB 3.5\" DD\n");
-        fprintf(stderr, "  1 = 360 KB 5.25\" DD  4 = 1.44 MB 3.5\" HD\n");
-        fprintf(stderr, "  2 = 1.2 MB 5.25\" HD\n");
-        return 1;
+    if (stage_depth == 0 || --stage_depth > 0)
+        return 0;
+
+    stage_written = 0;
+    for (i = 0; i < CMOS_SIZE; i++)
+        if (stage_changed(i))
+            n++;
+    if (n == 0) {
+        DBG(1, "Commit: no CMOS bytes changed\n");
+        return 0;
     }
 
-    floppy = cmos_read(CMOS_FLOPPY);
+    regb = BIT_TEST(stage_loaded, RTC_REG_B) ? stage_orig[RTC_REG_B]
+                                              : cmos_read(RTC_REG_B);
+    final_b = BIT_TEST(stage_dirty, RTC_REG_B) ? stage_shadow[RTC_REG_B]
+                                                : regb;
+
+    /* Runs of changed bytes go out as bursts; B brackets them */
+    cmos_write_port(RTC_REG_B, regb | RTC_B_SET);
+    for (i = 0; i < CMOS_SIZE; i = j) {
+        for (j = i; j < CMOS_SIZE && j != RTC_REG_B && stage_changed(j); j++)
+            ;
+        cmos_write_burst(i, stage_shadow + i, j - i);
+        if (j == i)
+            j++;
+    }
+    cmos_write_port(RTC_REG_B, final_b);
 
-    if (drv[0] == 'A' || drv[0] == 'a' || drv[0] == '0') {
-        floppy = (floppy & 0x0F) | (type << 4);
-        printf("Drive A set to: %s\n", floppy_type_str(type));
-    } else if (drv[0] == 'B' || drv[0] == 'b' || drv[0] == '1') {
-        floppy = (floppy & 0xF0) | type;
-        printf("Drive B set to: %s\n", floppy_type_str(type));
-    } else {
-        fprintf(stderr, "Error: Drive must be A or B\n");
-        return 1;
+    stage_written = n;
+    DBG(1, "Commit: %d CMOS byte(s) written\n", n);
+
+    for (i = CMOS_DIAG; i < CMOS_SIZE; i = j) {
+        for (j = i; j < CMOS_SIZE && stage_changed(j); j++)
+            ;
+        cmos_read_burst(i, back + i, j - i);
+        if (j == i)
+            j++;
     }
+    for (i = CMOS_DIAG; i < CMOS_SIZE; i++) {
+        if (stage_changed(i) && back[i] != stage_shadow[i]) {
+            fprintf(stderr, "Error: CMOS[0x%02X] reads back 0x%02X, wrote 0x%02X\n",
+                    i, back[i], stage_shadow[i]);
+            bad++;
+        }
+    }
+    if (!bad && BIT_TEST(stage_dirty, CMOS_CHECKSUM_LO))
+        cksum_bad = 0;      /* the sum just written is a correct one */
+    return bad != 0;
+}
 
-    cmos_write(CMOS_FLOPPY, floppy);
-    cmos_update_checksum();
-    return 0;
+/* Close a transaction; the outermost one drops the staged bytes */
+static void stage_abort(void)
+{
+    if (stage_depth == 0 || --stage_depth > 0)
+        return;
+    rtc_regb_valid = 0;     /* forget a staged Register B mode */
+    DBG(1, "Staged CMOS writes discarded\n");
 }
 
 /* ================================================================
- * Display: Hard Disk Drives
+ * Locking
  * ================================================================ */
 
 /*
- * Standard AT BIOS hard disk type table.
- * The PC1640 BIOS reads CMOS 0x12 to determine drive types.
- * If the nibble is 0x0F, the extended type register is consulted.
- * Type 0 = not installed.
- * The table below covers types 1-15 (the common ones).
+ * Concurrent nvr runs (cron jobs running watch, monitor and setters at
+ * once) are kept apart at two levels.  Every index/data pair runs with
+ * interrupts masked (irq_save()), so another task or the kernel can
+ * never move the 0x70 index between our OUT and the 0x71 access.  On
+ * top of that, commands that write CMOS hold NVR_LOCK_FILE for their
+ * whole run (CMD_LOCK), so read-modify-write transactions and their
+ * checksum updates never interleave.  Readers take no file lock.
+ *
+ * The lock file holds the owner's pid.  It is written under a private
+ * name first and link()ed into place, so the lock never exists without
+ * its pid.  A lock whose pid no longer runs, or an empty one (left by
+ * an older nvr that died between create and write) older than
+ * LOCK_STALE_S, is stale.  To take one over it is first rename()d
+ * aside: only one writer can move a given file.  What was moved is
+ * removed only if it is still the same stale file (inode and mtime)
+ * that was judged; otherwise another breaker's fresh lock was caught
+ * instead and is linked straight back.  If a third writer has taken
+ * the name meanwhile, the moved lock is kept (its owner is live) and
+ * we back off; it is cleaned up once its owner has gone.  Release
+ * only unlinks a lock we still own.
  */
-struct hd_type_entry {
-    unsigned short cyls;
-    unsigned char  heads;
-    unsigned short precomp;
-    unsigned short landing;
-    unsigned char  sectors;
-};
+#ifndef NVR_LOCK_FILE
+#define NVR_LOCK_FILE   "/tmp/nvr.lock"
+#endif
+#define LOCK_WAIT_MS    5000
+#define LOCK_POLL_MS    50
+#define LOCK_STALE_S    3
+#define LOCK_NAME_MAX   (sizeof(NVR_LOCK_FILE) + 12)
+
+static int lock_depth = 0;
+static int lock_held = 0;
+
+/* Pid recorded in lock file path, 0 if empty or unreadable */
+static int lock_read(const char *path, struct stat *st)
+{
+    char buf[16];
+    int fd, n;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, st) < 0)
+        st->st_mtime = time(NULL);
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    return atoi(buf);
+}
 
-static const struct hd_type_entry hd_types[] = {
-    /* type  cyls  hds  precomp  landing  spt */
-    {  306,   4,   128,   305,   17 },  /* 1 - 10MB */
-    {  615,   4,   300,   615,   17 },  /* 2 - 20MB */
-    {  615,   6,   300,   615,   17 },  /* 3 - 30MB */
-    {  940,   8,   512,   940,   17 },  /* 4 - 62MB */
-    {  940,   6,   512,   940,   17 },  /* 5 - 46MB */
-    {  615,   4,    -1,   615,   17 },  /* 6 - 20MB (no precomp) */
-    {  462,   8,   256,   511,   17 },  /* 7 - 30MB */
-    {  733,   5,    -1,   733,   17 },  /* 8 - 30MB */
-    {  900,  15,    -1,   901,   17 },  /* 9 - 112MB */
-    {  820,   3,    -1,   820,   17 },  /* 10 - 20MB */
-    {  855,   5,    -1,   855,   17 },  /* 11 - 35MB */
-    {  855,   7,    -1,   855,   17 },  /* 12 - 49MB */
-    {  306,   8,   128,   319,   17 },  /* 13 - 20MB */
-    {  733,   7,    -1,   733,   17 },  /* 14 - 42MB */
-    {    0,   0,     0,     0,    0 },  /* 15 = extended type, see 0x19/0x1A */
-};
+/* 1 if the lock at path is left over, with its pid in *pid and file in *st */
+static int lock_stale(const char *path, int *pid, struct stat *st)
+{
+    *pid = lock_read(path, st);
+    if (*pid > 0)
+        return kill(*pid, 0) < 0 && errno == ESRCH;
+    return *pid == 0 && time(NULL) - st->st_mtime > LOCK_STALE_S;
+}
 
-static void show_harddisk(void)
+/* Name a lock is moved aside to by lock_break() */
+static void lock_side_name(char *side)
 {
-    unsigned char diskbyte, type0, type1, ext0, ext1;
-
-    diskbyte = cmos_read(CMOS_DISK);
-    type0 = (diskbyte >> 4) & 0x0F;
-    type1 = diskbyte & 0x0F;
-    ext0 = cmos_read(CMOS_DISK0_EXT);
-    ext1 = cmos_read(CMOS_DISK1_EXT);
-
-    printf("\nHard Disk Configuration:\n");
-    printf("  CMOS byte 0x12: 0x%02X\n", diskbyte);
-
-    /* Drive 0 */
-    printf("  Drive 0 (C:): ");
-    if (type0 == 0) {
-        printf("Not installed\n");
-    } else if (type0 == 0x0F) {
-        printf("Extended type %d (from CMOS 0x19)\n", ext0);
-    } else if (type0 <= 14) {
-        printf("Type %d - %d cyl, %d heads, %d spt",
-               type0, hd_types[type0-1].cyls, hd_types[type0-1].heads,
-               hd_types[type0-1].sectors);
-        printf(" (~%lu MB)\n",
-               (unsigned long)hd_types[type0-1].cyls *
-               hd_types[type0-1].heads *
-               hd_types[type0-1].sectors * 512UL / (1024UL * 1024UL));
-    } else {
-        printf("Unknown type %d\n", type0);
-    }
-
-    /* Drive 1 */
-    printf("  Drive 1 (D:): ");
-    if (type1 == 0) {
-        printf("Not installed\n");
-    } else if (type1 == 0x0F) {
-        printf("Extended type %d (from CMOS 0x1A)\n", ext1);
-    } else if (type1 <= 14) {
-        printf("Type %d - %d cyl, %d heads, %d spt",
-               type1, hd_types[type1-1].cyls, hd_types[type1-1].heads,
-               hd_types[type1-1].sectors);
-        printf(" (~%lu MB)\n",
-               (unsigned long)hd_types[type1-1].cyls *
-               hd_types[type1-1].heads *
-               hd_types[type1-1].sectors * 512UL / (1024UL * 1024UL));
-    } else {
-        printf("Unknown type %d\n", type1);
-    }
+    sprintf(side, "%s.%d.old", NVR_LOCK_FILE, (int)getpid());
 }
 
-static int set_harddisk(const char *drv, const char *typestr)
+/*
+ * Move the stale lock judged in *seen aside.  Returns 0 if it is gone
+ * or was put back, 1 if a live lock had to be kept aside (back off).
+ */
+static int lock_break(const struct stat *seen)
 {
-    int type = atoi(typestr);
-    unsigned char diskbyte;
-
-    if (type < 0 || type > 15) {
-        fprintf(stderr, "Error: Hard disk type must be 0-15:\n");
-        fprintf(stderr, "  0  = Not installed\n");
-        fprintf(stderr, "  1  = 10 MB (306 cyl, 4 heads)\n");
-        fprintf(stderr, "  2  = 20 MB (615 cyl, 4 heads)\n");
-        fprintf(stderr, "  3  = 30 MB (615 cyl, 6 heads)\n");
-        fprintf(stderr, "  4  = 62 MB (940 cyl, 8 heads)\n");
-        fprintf(stderr, "  5  = 46 MB (940 cyl, 6 heads)\n");
-        fprintf(stderr, "  6  = 20 MB (615 cyl, 4 heads, no precomp)\n");
-        fprintf(stderr, "  7  = 30 MB (462 cyl, 8 heads)\n");
-        fprintf(stderr, "  8  = 30 MB (733 cyl, 5 heads)\n");
-        fprintf(stderr, "  9  = 112 MB (900 cyl, 15 heads)\n");
-        fprintf(stderr, " 10  = 20 MB (820 cyl, 3 heads)\n");
-        fprintf(stderr, " 11  = 35 MB (855 cyl, 5 heads)\n");
-        fprintf(stderr, " 12  = 49 MB (855 cyl, 7 heads)\n");
-        fprintf(stderr, " 13  = 20 MB (306 cyl, 8 heads)\n");
-        fprintf(stderr, " 14  = 42 MB (733 cyl, 7 heads)\n");
-        fprintf(stderr, " 15  = Extended type (uses CMOS 0x19/0x1A)\n");
-        return 1;
+    struct stat st;
+    char side[LOCK_NAME_MAX];
+    int pid;
+
+    lock_side_name(side);
+    if (rename(NVR_LOCK_FILE, side) < 0)
+        return 0;
+    if (lock_stale(side, &pid, &st) && st.st_ino == seen->st_ino &&
+        st.st_dev == seen->st_dev && st.st_mtime == seen->st_mtime) {
+        DBG(1, "Lock: removed stale lock of pid %d\n", pid);
+        unlink(side);
+        return 0;
     }
-
-    diskbyte = cmos_read(CMOS_DISK);
-
-    if (drv[0] == '0' || drv[0] == 'C' || drv[0] == 'c') {
-        diskbyte = (diskbyte & 0x0F) | (type << 4);
-        printf("Drive 0 (C:) set to type %d\n", type);
-    } else if (drv[0] == '1' || drv[0] == 'D' || drv[0] == 'd') {
-        diskbyte = (diskbyte & 0xF0) | type;
-        printf("Drive 1 (D:) set to type %d\n", type);
-    } else {
-        fprintf(stderr, "Error: Drive must be 0/C or 1/D\n");
+    if (link(side, NVR_LOCK_FILE) < 0) {
+        DBG(1, "Lock: lock of pid %d kept aside, backing off\n", pid);
         return 1;
     }
-
-    cmos_write(CMOS_DISK, diskbyte);
-    cmos_update_checksum();
+    unlink(side);
     return 0;
 }
 
-/* ================================================================
- * Display: Equipment Byte
- * ================================================================ */
-
-static void show_equipment(void)
+/* Take the lock, waiting up to LOCK_WAIT_MS.  Nests.  Returns 0 or 1 */
+static int nvr_lock(void)
 {
-    unsigned char equip = cmos_read(CMOS_EQUIP);
-    int nfloppy;
-
-    printf("\nEquipment Byte (CMOS 0x14): 0x%02X\n", equip);
-
-    printf("  Bit 0 - Floppy drives:     %s\n",
-           (equip & 0x01) ? "Installed" : "Not installed");
-
-    printf("  Bit 1 - Math coprocessor:  %s\n",
-           (equip & 0x02) ? "8087 installed" : "Not installed");
-
-    printf("  Bits 2-3 (reserved):       0x%X\n", (equip >> 2) & 0x03);
-
-    printf("  Bits 4-5 - Initial video:  ");
-    switch ((equip >> 4) & 0x03) {
-    case 0: printf("EGA/VGA (built-in PEGA)\n"); break;
-    case 1: printf("40-column CGA\n"); break;
-    case 2: printf("80-column CGA\n"); break;
-    case 3: printf("MDA/Hercules\n"); break;
+    struct timeval tv;
+    struct stat st;
+    char tmp[LOCK_NAME_MAX], buf[16];
+    int fd, rc, pid = 0, waited = 0;
+
+    if (lock_depth++ > 0)
+        return 0;
+
+    sprintf(tmp, "%s.%d", NVR_LOCK_FILE, (int)getpid());
+    unlink(tmp);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        DBG(1, "Lock: cannot create %s, running unlocked\n", tmp);
+        return 0;
+    }
+    sprintf(buf, "%d\n", (int)getpid());
+    rc = write(fd, buf, strlen(buf));
+    close(fd);
+    if (rc != (int)strlen(buf)) {
+        DBG(1, "Lock: cannot write %s, running unlocked\n", tmp);
+        unlink(tmp);
+        return 0;
     }
 
-    nfloppy = (equip & 0x01) ? ((equip >> 6) & 0x03) + 1 : 0;
-    printf("  Bits 6-7 - Floppy count:   %d drive(s)\n", nfloppy);
-}
-
-static int set_equipment(const char *field, const char *valstr)
-{
-    unsigned char equip = cmos_read(CMOS_EQUIP);
-    int val = atoi(valstr);
-
-    if (strcmp(field, "fpu") == 0 || strcmp(field, "coprocessor") == 0 ||
-        strcmp(field, "8087") == 0) {
-        if (val)
-            equip |= 0x02;
-        else
-            equip &= ~0x02;
-        printf("Math coprocessor: %s\n", val ? "Installed" : "Not installed");
-    }
-    else if (strcmp(field, "video") == 0) {
-        if (val < 0 || val > 3) {
-            fprintf(stderr, "Error: Video mode 0-3:\n");
-            fprintf(stderr, "  0 = EGA/VGA   1 = 40-col CGA\n");
-            fprintf(stderr, "  2 = 80-col CGA 3 = MDA/Hercules\n");
-            return 1;
+    while (link(tmp, NVR_LOCK_FILE) < 0) {
+        if (errno != EEXIST) {
+            DBG(1, "Lock: cannot link %s, running unlocked\n", NVR_LOCK_FILE);
+            unlink(tmp);
+            return 0;
         }
-        equip = (equip & ~0x30) | ((val & 0x03) << 4);
-        printf("Initial video mode set to %d\n", val);
-    }
-    else if (strcmp(field, "floppy-count") == 0) {
-        if (val < 0 || val > 4) {
-            fprintf(stderr, "Error: Floppy count 0-4\n");
+        if (lock_stale(NVR_LOCK_FILE, &pid, &st) && !lock_break(&st))
+            continue;
+        if (waited >= LOCK_WAIT_MS) {
+            fprintf(stderr, "Error: CMOS is locked by pid %d (%s)\n",
+                    pid, NVR_LOCK_FILE);
+            unlink(tmp);
+            lock_depth--;
             return 1;
         }
-        if (val == 0) {
-            equip &= ~0x01;
-            equip &= ~0xC0;
-        } else {
-            equip |= 0x01;
-            equip = (equip & ~0xC0) | (((val - 1) & 0x03) << 6);
-        }
-        printf("Floppy count set to %d\n", val);
-    }
-    else {
-        fprintf(stderr, "Unknown equipment field: %s\n", field);
-        fprintf(stderr, "Fields: fpu, video, floppy-count\n");
-        return 1;
+        tv.tv_sec = 0;
+        tv.tv_usec = LOCK_POLL_MS * 1000L;
+        select(0, NULL, NULL, NULL, &tv);
+        waited += LOCK_POLL_MS;
     }
 
-    cmos_write(CMOS_EQUIP, equip);
-    cmos_update_checksum();
+    unlink(tmp);
+    lock_side_name(tmp);
+    if (lock_stale(tmp, &pid, &st))
+        unlink(tmp);            /* a lock kept aside whose owner is gone */
+    lock_held = 1;
+    DBG(2, "Lock: %s taken%s\n", NVR_LOCK_FILE, waited ? " after waiting" : "");
     return 0;
 }
 
-/* ================================================================
- * Display: Memory
- * ================================================================ */
-
-static void show_memory(void)
-{
-    unsigned short basemem, extmem;
-
-    basemem = cmos_read(CMOS_BASEMEM_LO) |
-              ((unsigned short)cmos_read(CMOS_BASEMEM_HI) << 8);
-    extmem = cmos_read(CMOS_EXTMEM_LO) |
-             ((unsigned short)cmos_read(CMOS_EXTMEM_HI) << 8);
-
-    printf("\nMemory Configuration:\n");
-    printf("  Base memory:     %u KB", basemem);
-    if (basemem == 640)
-        printf(" (standard PC1640)");
-    printf("\n");
-    printf("  Extended memory: %u KB", extmem);
-    if (extmem == 0)
-        printf(" (normal - 8086 has no extended memory)");
-    printf("\n");
-}
-
-static int set_basemem(const char *valstr)
+static void nvr_unlock(void)
 {
-    int kb = atoi(valstr);
+    struct stat st;
 
-    if (kb < 64 || kb > 640) {
-        fprintf(stderr, "Error: Base memory must be 64-640 KB\n");
-        return 1;
+    if (lock_depth == 0 || --lock_depth > 0)
+        return;
+    if (lock_held) {
+        if (lock_read(NVR_LOCK_FILE, &st) == (int)getpid())
+            unlink(NVR_LOCK_FILE);
+        else
+            DBG(1, "Lock: %s no longer ours, left alone\n", NVR_LOCK_FILE);
+        lock_held = 0;
+        DBG(2, "Lock: released\n");
     }
-
-    cmos_write(CMOS_BASEMEM_LO, kb & 0xFF);
-    cmos_write(CMOS_BASEMEM_HI, (kb >> 8) & 0xFF);
-    cmos_update_checksum();
-    printf("Base memory set to %d KB\n", kb);
-    return 0;
 }
 
 /* ================================================================
- * Display: Diagnostic Status
+ * BCD Conversion Helpers
  * ================================================================ */
 
-static void show_diagnostics(void)
+static unsigned char bcd_to_bin(unsigned char bcd)
 {
-    unsigned char diag = cmos_read(CMOS_DIAG);
-    unsigned char shut = cmos_read(CMOS_SHUTDOWN);
-
-    printf("\nDiagnostic Status (CMOS 0x0E): 0x%02X\n", diag);
-    if (diag & 0x80) printf("  Bit 7: RTC lost power (battery failed during outage)\n");
-    if (diag & 0x40) printf("  Bit 6: CMOS checksum bad\n");
-    if (diag & 0x20) printf("  Bit 5: Invalid configuration info\n");
-    if (diag & 0x10) printf("  Bit 4: Memory size mismatch (POST vs CMOS)\n");
-    if (diag & 0x08) printf("  Bit 3: Hard disk controller init failed\n");
-    if (diag & 0x04) printf("  Bit 2: Time invalid\n");
-    if (diag & 0x02) printf("  Bit 1: Installed adapters error\n");
-    if (diag & 0x01) printf("  Bit 0: Timeout reading adapter ROM\n");
-    if (diag == 0x00) printf("  All clear - no errors\n");
-
-    printf("\nShutdown Status (CMOS 0x0F): 0x%02X", shut);
-    switch (shut) {
-    case 0x00: printf(" - Normal POST\n"); break;
-    case 0x01: printf(" - Chip set init for real mode return\n"); break;
-    case 0x04: printf(" - Jump to bootstrap (INT 19h)\n"); break;
-    case 0x05: printf(" - User-defined warm boot\n"); break;
-    case 0x09: printf(" - Return to real mode (block move)\n"); break;
-    case 0x0A: printf(" - Jump to DWORD at 0040:0067\n"); break;
-    default:   printf(" - Code 0x%02X\n", shut); break;
-    }
+    return ((bcd >> 4) * 10) + (bcd & 0x0F);
 }
 
-static void clear_diagnostics(void)
+static unsigned char bin_to_bcd(unsigned char bin)
 {
-    cmos_write(CMOS_DIAG, 0x00);
-    printf("Diagnostic status cleared\n");
+    return ((bin / 10) << 4) | (bin % 10);
 }
 
-/* ================================================================
- * Display: Amstrad-Specific System Status
- * ================================================================ */
-
-/* Language code table (from BIOS ROM & PCem source) */
-static const char *language_name(unsigned char code)
+static unsigned char bin_identity(unsigned char val)
 {
-    switch (code & 0x07) {
-    case 0: return "Diagnostic mode";
-    case 1: return "Italian";
-    case 2: return "Swedish";
-    case 3: return "Danish";
-    case 4: return "Spanish";
-    case 5: return "French";
-    case 6: return "German";
-    case 7: return "English";
-    default: return "Unknown";
-    }
+    return val;
 }
 
-static const char *display_type_name(unsigned char code)
+/*
+ * RTC data mode.  Register B is fetched at most once per command:
+ * rtc_mode_select() caches it and points rtc_to_bin/bin_to_rtc at the
+ * BCD or binary converter, so converting a field costs no port access.
+ * cmos_write() re-selects whenever Register B itself is written.
+ */
+static unsigned char rtc_to_bin_lazy(unsigned char val);
+static unsigned char bin_to_rtc_lazy(unsigned char val);
+
+static unsigned char (*rtc_to_bin)(unsigned char) = rtc_to_bin_lazy;
+static unsigned char (*bin_to_rtc)(unsigned char) = bin_to_rtc_lazy;
+
+static void rtc_mode_select(unsigned char regb)
 {
-    switch (code & 0x03) {
-    case 0: return "EGA (built-in Paradise PEGA)";
-    case 1: return "Unknown (reserved)";
-    case 2: return "CGA";
-    case 3: return "MDA/Hercules";
-    default: return "Unknown";
+    rtc_regb = regb;
+    rtc_regb_valid = 1;
+    if (regb & RTC_B_DM) {
+        rtc_to_bin = bin_identity;
+        bin_to_rtc = bin_identity;
+    } else {
+        rtc_to_bin = bcd_to_bin;
+        bin_to_rtc = bin_to_bcd;
     }
+    DBG(2, "RTC mode: regB=0x%02X (%s)\n", regb,
+        (regb & RTC_B_DM) ? "binary" : "BCD");
 }
 
-static void show_amstrad_language(void)
+/* Cached Register B, read from the snapshot or chip on first use */
+static unsigned char rtc_mode_load(void)
 {
-    unsigned char lpt_status = inb(PORT_LPT1_STATUS);
-    unsigned char lang = lpt_status & LPT1_LANG_MASK;
-
-    printf("\nLanguage Selection (DIP switches -> port 0x379 bits 0-2):\n");
-    printf("  LPT1 status byte: 0x%02X\n", lpt_status);
-    printf("  Language code:    %d - %s\n", lang, language_name(lang));
-    printf("  Available codes:\n");
-    printf("    0 = Diagnostic   4 = Spanish\n");
-    printf("    1 = Italian      5 = French\n");
-    printf("    2 = Swedish      6 = German\n");
-    printf("    3 = Danish       7 = English\n");
+    if (!rtc_regb_valid)
+        rtc_mode_select(cmos_get(RTC_REG_B));
+    return rtc_regb;
 }
 
-static void show_display_type(void)
+static unsigned char rtc_to_bin_lazy(unsigned char val)
 {
-    unsigned char lpt_status = inb(PORT_LPT1_STATUS);
-    unsigned char disp = (lpt_status & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT;
-    unsigned char ida = inb(PORT_IDA_STATUS);
-
-    printf("\nDisplay Type Detection:\n");
-    printf("  LPT1 status bits 6-7: %d - %s\n", disp, display_type_name(disp));
-    printf("  IDA status (0x3DE):   0x%02X", ida);
-    if (ida & 0x20)
-        printf(" - Internal Display Adapter DISABLED\n");
-    else
-        printf(" - Internal Display Adapter active\n");
+    rtc_mode_load();
+    return rtc_to_bin(val);
+}
 
-    printf("  Video mode switch (port 0x3DB bit 6): ");
-    printf("write-only (toggles CGA/EGA)\n");
+static unsigned char bin_to_rtc_lazy(unsigned char val)
+{
+    rtc_mode_load();
+    return bin_to_rtc(val);
 }
 
-static void show_amstrad_full(void)
+/* Decode the hours register, folding 12-hour AM/PM into 0-23 */
+static unsigned char rtc_hours_to_bin(unsigned char hrs)
 {
-    unsigned char pb, stat2, stat2_raw, stat1;
-    unsigned char lpt_status;
+    int pm;
 
-    printf("\nAmstrad PC1640 System Status:\n");
-    printf("------------------------------\n");
+    if (rtc_mode_load() & RTC_B_24H)
+        return rtc_to_bin(hrs);
 
-    /* PB Register */
-    pb = inb(PORT_PB);
-    printf("\n  PB Register (port 0x61): 0x%02X\n", pb);
-    printf("    Bit 0 - Speaker gate:      %s\n", (pb & PB_SPEAKER_GATE)   ? "ON" : "off");
-    printf("    Bit 1 - Speaker enable:    %s\n", (pb & PB_SPEAKER_ENABLE) ? "ON" : "off");
-    printf("    Bit 2 - Nibble select:     %s nibble\n", (pb & PB_NIBBLE_SEL) ? "Low" : "High");
-    printf("    Bit 6 - Keyboard reset:    %s\n", (pb & PB_KBD_RESET) ? "ACTIVE" : "inactive");
-    printf("    Bit 7 - Port 0x60 mode:    %s\n", (pb & PB_STATUS_MODE) ? "System status" : "Keyboard data");
+    pm = hrs & 0x80;
+    hrs = rtc_to_bin(hrs & 0x7F);
+    if (pm) { if (hrs < 12) hrs += 12; }
+    else    { if (hrs == 12) hrs = 0;  }
+    return hrs;
+}
 
-    /* System Status 2 raw + combined */
-    stat2_raw = inb(PORT_STATUS2);
-    printf("\n  Port 0x62 raw read: 0x%02X\n", stat2_raw);
-    printf("    Bit 5 - Speaker output:    %s\n", (stat2_raw & 0x20) ? "HIGH" : "low");
-    printf("    Bit 6 - NMI status:        %s\n", (stat2_raw & 0x40) ? "ACTIVE" : "inactive");
-
-    stat2 = amstrad_read_sysstat2();
-    printf("  System Status 2 (combined):  0x%02X\n", stat2);
+/* ================================================================
+ * CMOS Field Descriptors
+ * ================================================================ */
 
-    /* System Status 1 */
-    stat1 = amstrad_read_sysstat1();
-    printf("\n  System Status 1 (port 0x60): 0x%02X\n", stat1);
-    printf("    (Value = (sysstat1_latch | 0x0D) & 0x7F)\n");
+/*
+ * Every configuration field is one row: byte, bit mask and shift, a
+ * decoding kind, the valid range and optional value names.  Decoders,
+ * setters, --format output, compare and diff-many all go through
+ * field_get()/field_put(), which work on any 64-byte buffer or, given
+ * NULL, on the live CMOS through cmos_get()/cmos_write(), and so
+ * through the snapshot and the staging engine.  Keys are the
+ * --format=kv names.  With an NVRI byte mask, a field whose bytes were
+ * not saved reads -1.
+ */
+enum {
+    FK_DEC,                     /* (byte & mask) >> shift, decimal */
+    FK_HEX,                     /* same, shown 0xNN */
+    FK_WORD,                    /* little-endian, high byte at ext */
+    FK_HD                       /* type nibble; 15: the type at ext (16+) */
+};
 
-    /* LPT1 status - language + display */
-    lpt_status = inb(PORT_LPT1_STATUS);
-    printf("\n  LPT1 Status (port 0x379):    0x%02X\n", lpt_status);
-    printf("    Bits 0-2 - Language:       %d (%s)\n",
-           lpt_status & LPT1_LANG_MASK,
-           language_name(lpt_status & LPT1_LANG_MASK));
-    printf("    Bit 5   - DIP latch:       %s\n",
-           (lpt_status & LPT1_DIP_LATCH) ? "SW10" : "SW9/none");
-    printf("    Bits 6-7 - Display type:   %d (%s)\n",
-           (lpt_status & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT,
-           display_type_name((lpt_status & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT));
-}
+struct cmos_field {
+    const char *key;
+    const char *name;
+    unsigned char addr;
+    unsigned char mask;         /* bits of addr, before the shift */
+    unsigned char shift;
+    unsigned char kind;
+    unsigned char ext;          /* second byte for FK_WORD and FK_HD */
+    unsigned short min, max;    /* accepted by field_set() */
+    const char *const *names;   /* names of min..max, or NULL */
+};
 
-/* ================================================================
- * Display: Serial & Parallel Ports
- * ================================================================ */
+static const char *const floppy_names[] = {
+    "Not installed", "360 KB 5.25\" DD", "1.2 MB 5.25\" HD",
+    "720 KB 3.5\" DD", "1.44 MB 3.5\" HD"
+};
 
-static int detect_com_port(unsigned short base)
-{
-    unsigned char lcr_orig, test;
+static const char *const video_names[] = {
+    "EGA/VGA (built-in PEGA)", "40-column CGA", "80-column CGA",
+    "MDA/Hercules"
+};
 
-    /* Save line control register */
-    lcr_orig = inb(base + 3);
+/* Indices into cmos_fields[], same order */
+enum {
+    F_RTC_DV, F_RTC_RATE, F_RTC_IRQ, F_RTC_SQW, F_RTC_BINARY, F_RTC_24H,
+    F_RTC_DSE, F_DIAG, F_SHUTDOWN, F_FLOPPY_A, F_FLOPPY_B, F_HD0, F_HD1,
+    F_EQ_FLOPPY, F_EQ_FPU, F_EQ_VIDEO, F_EQ_DRIVES, F_MEM_BASE, F_MEM_EXT,
+    F_CENTURY
+};
 
-    /* Write test pattern to LCR */
-    outb(0xAA, base + 3);
-    io_delay();
-    test = inb(base + 3);
+static const struct cmos_field cmos_fields[] = {
+    { "rtc.dv",       "RTC divider",              RTC_REG_A, RTC_A_DV_MASK, 4, FK_DEC, 0, 0, 7, NULL },
+    { "rtc.rate",     "RTC periodic rate select", RTC_REG_A, RTC_A_RS_MASK, 0, FK_DEC, 0, 0, 15, NULL },
+    { "rtc.irq",      "RTC PIE/AIE/UIE enables",  RTC_REG_B, 0x70, 4, FK_HEX, 0, 0, 7, NULL },
+    { "rtc.sqw",      "RTC square wave",          RTC_REG_B, RTC_B_SQWE, 3, FK_DEC, 0, 0, 1, NULL },
+    { "rtc.binary",   "RTC binary mode",          RTC_REG_B, RTC_B_DM, 2, FK_DEC, 0, 0, 1, NULL },
+    { "rtc.24h",      "RTC 24-hour mode",         RTC_REG_B, RTC_B_24H, 1, FK_DEC, 0, 0, 1, NULL },
+    { "rtc.dse",      "RTC daylight saving",      RTC_REG_B, RTC_B_DSE, 0, FK_DEC, 0, 0, 1, NULL },
+    { "diag",         "Diagnostic status",        CMOS_DIAG, 0xFF, 0, FK_HEX, 0, 0, 0xFF, NULL },
+    { "shutdown",     "Shutdown status",          CMOS_SHUTDOWN, 0xFF, 0, FK_HEX, 0, 0, 0xFF, NULL },
+    { "floppy.a",     "Floppy A type",            CMOS_FLOPPY, 0xF0, 4, FK_DEC, 0, 0, 4, floppy_names },
+    { "floppy.b",     "Floppy B type",            CMOS_FLOPPY, 0x0F, 0, FK_DEC, 0, 0, 4, floppy_names },
+    { "hd.0",         "Hard disk 0 type",         CMOS_DISK, 0xF0, 4, FK_HD, CMOS_DISK0_EXT, 0, 15, NULL },
+    { "hd.1",         "Hard disk 1 type",         CMOS_DISK, 0x0F, 0, FK_HD, CMOS_DISK1_EXT, 0, 15, NULL },
+    { "equip.floppy", "Floppy drives installed",  CMOS_EQUIP, 0x01, 0, FK_DEC, 0, 0, 1, NULL },
+    { "equip.fpu",    "Math coprocessor",         CMOS_EQUIP, 0x02, 1, FK_DEC, 0, 0, 1, NULL },
+    { "equip.video",  "Initial video mode",       CMOS_EQUIP, 0x30, 4, FK_DEC, 0, 0, 3, video_names },
+    { "equip.drives", "Floppy drive count - 1",   CMOS_EQUIP, 0xC0, 6, FK_DEC, 0, 0, 3, NULL },
+    { "mem.base",     "Base memory (KB)",         CMOS_BASEMEM_LO, 0xFF, 0, FK_WORD, CMOS_BASEMEM_HI, 64, 640, NULL },
+    { "mem.ext",      "Extended memory (KB)",     CMOS_EXTMEM_LO, 0xFF, 0, FK_WORD, CMOS_EXTMEM_HI, 0, 0xFFFF, NULL },
+    { "century",      "Century",                  CMOS_CENTURY, 0xFF, 0, FK_HEX, 0, 0, 0xFF, NULL },
+};
 
-    /* Restore */
-    outb(lcr_orig, base + 3);
+#define NFIELDS (sizeof(cmos_fields) / sizeof(cmos_fields[0]))
 
-    return (test == 0xAA);
+static unsigned char field_byte(const unsigned char *data, unsigned char addr)
+{
+    return data ? data[addr] : cmos_get(addr);
 }
 
-static int detect_lpt_port(unsigned short base)
+/* Value of f in data (NULL: live CMOS); -1 if mask (or NULL) lacks a byte */
+static long field_get(const struct cmos_field *f, const unsigned char *data,
+                      const unsigned char *mask)
 {
-    unsigned char orig, test;
-
-    orig = inb(base);
-    outb(0xAA, base);
-    io_delay();
-    test = inb(base);
-    outb(orig, base);
+    unsigned int v, x;
+
+    if (mask && !BIT_TEST(mask, f->addr))
+        return -1;
+    v = (field_byte(data, f->addr) & f->mask) >> f->shift;
+    if (f->kind == FK_WORD || (f->kind == FK_HD && v == 0x0F)) {
+        if (mask && !BIT_TEST(mask, f->ext))
+            return -1;
+        x = field_byte(data, f->ext);
+        if (f->kind == FK_WORD)
+            v |= x << 8;
+        else if (x > 0x0F)      /* extended types start at 16 */
+            v = x;
+    }
+    return v;
+}
 
-    /* On PC1640, LPT1 at 0x378 reads back with language bits OR'd in */
-    return (test == 0xAA || (base == PORT_LPT1_DATA && (test & 0xF8) == 0xA8));
+static void field_print(const struct cmos_field *f, long v)
+{
+    if (v < 0)
+        out_char('-');
+    else if (f->kind == FK_HEX)
+        out_byte((unsigned char)v);
+    else
+        out_dec(v, 0);
 }
 
-static void show_ports(void)
+#if NVR_CONFIG
+static const char *field_value_name(const struct cmos_field *f, long v)
 {
-    printf("\nSerial & Parallel Ports:\n");
+    return (f->names && v >= f->min && v <= f->max) ? f->names[v - f->min]
+                                                    : "Unknown";
+}
 
-    printf("  COM1 (0x3F8): %s\n",
-           detect_com_port(PORT_COM1_BASE) ? "Detected (IRQ 4)" : "Not found");
-    printf("  COM2 (0x2F8): %s\n",
-           detect_com_port(PORT_COM2_BASE) ? "Detected (IRQ 3)" : "Not found");
+/*
+ * Encode v into f, in data or (NULL) in the staged CMOS.  An FK_HD
+ * field takes its nibble only; the extended type byte is left alone.
+ */
+static void field_put(const struct cmos_field *f, unsigned char *data,
+                      unsigned int v)
+{
+    unsigned char b = (field_byte(data, f->addr) & ~f->mask) |
+                      ((v << f->shift) & f->mask);
 
-    printf("  LPT1 (0x378): %s\n",
-           detect_lpt_port(PORT_LPT1_DATA) ? "Detected (Amstrad-overloaded)" : "Not found");
-    printf("  LPT2 (0x3BC): %s\n",
-           detect_lpt_port(PORT_LPT2_DATA) ? "Detected" : "Not found");
+    if (data)
+        data[f->addr] = b;
+    else
+        cmos_write(f->addr, b);
+    if (f->kind == FK_WORD) {
+        if (data)
+            data[f->ext] = v >> 8;
+        else
+            cmos_write(f->ext, v >> 8);
+    }
 }
 
-/* ================================================================
- * Display: Amstrad Mouse Port
- * ================================================================ */
+static void cmos_update_checksum(void);
 
-static void show_mouse(void)
+/*
+ * Range-check valstr and commit it to f with a new checksum.  Returns
+ * 0, 1 if the commit failed, or -1 (nothing written) if out of range.
+ */
+static int field_set(const struct cmos_field *f, const char *valstr)
 {
-    unsigned char mx, my;
+    long v = atol(valstr);
+    unsigned int i;
 
-    printf("\nAmstrad Mouse Port:\n");
-    printf("  Type: Amstrad proprietary (NOT serial/PS2)\n");
-    printf("  X counter port: 0x78 (read=position, write=reset)\n");
-    printf("  Y counter port: 0x7A (read=position, write=reset)\n");
-    printf("  Buttons: via keyboard scancodes:\n");
-    printf("    Left press:  0x7E   Left release:  0xFE\n");
-    printf("    Right press: 0x7D   Right release: 0xFD\n");
+    if (v < f->min || v > f->max) {
+        fprintf(stderr, "Error: %s must be %u-%u%s\n",
+                f->name, f->min, f->max, f->names ? ":" : "");
+        for (i = 0; f->names && i <= (unsigned int)(f->max - f->min); i++)
+            fprintf(stderr, "  %u = %s\n", f->min + i, f->names[i]);
+        return -1;
+    }
 
-    mx = inb(PORT_MOUSE_X);
-    my = inb(PORT_MOUSE_Y);
-    printf("\n  Current X counter: %d (0x%02X)\n", (signed char)mx, mx);
-    printf("  Current Y counter: %d (0x%02X)\n", (signed char)my, my);
+    stage_begin();
+    field_put(f, NULL, (unsigned int)v);
+    cmos_update_checksum();
+    if (stage_commit() != 0)
+        return 1;
+
+    printf("%s set to %ld", f->name, v);
+    if (f->names)
+        printf(" (%s)", field_value_name(f, v));
+    printf("\n");
+    return 0;
 }
 
-static void mouse_reset(void)
+/* Floppy drives the equipment byte declares (bit 0, count in bits 6-7) */
+static int equip_floppies(void)
 {
-    outb(0, PORT_MOUSE_X);
-    outb(0, PORT_MOUSE_Y);
-    printf("Mouse counters reset to 0\n");
+    return field_get(&cmos_fields[F_EQ_FLOPPY], NULL, NULL)
+           ? (int)field_get(&cmos_fields[F_EQ_DRIVES], NULL, NULL) + 1 : 0;
 }
+#endif /* NVR_CONFIG */
 
-static void mouse_test(void)
-{
-    unsigned char mx2, my2;
-    int i;
+#if NVR_EMU
 
-    printf("\nMouse Movement Test (5 seconds):\n");
-    printf("  Move the mouse to see counter changes...\n\n");
+/* ================================================================
+ * Emulated Hardware Backend (PCem-style PC1640 model)
+ * ================================================================ */
 
-    /* Reset counters */
-    outb(0, PORT_MOUSE_X);
-    outb(0, PORT_MOUSE_Y);
+/*
+ * A small model of the ports nvr touches, after the PC1640 and
+ * MC146818 devices in PCem, so every command runs on a host without
+ * the machine and without iopl:
+ *
+ *   0x70/0x71  MC146818: 64 bytes (index masked 0x3F), clock driven
+ *              by the host second, UIP for the last 244 us before each
+ *              update, SET holds updates, UF/AF latched in Register C
+ *              and cleared on read, Register D reads VRT.
+ *   0x40-0x43  8253 channels 0 and 2 counting down at PIT_HZ from host
+ *              time (channel 0 free-running, latched reads only).
+ *   0x60-0x65  PB register, status 1/2 latches and the PB.2 nibble read.
+ *   0x379      LPT1 status: English, EGA.
+ *
+ * Everything else reads as a floating bus (0xFF) and ignores writes.
+ * "file:PATH" loads the CMOS from a raw 64-byte image and writes it
+ * back at exit if it changed; the clock catches up by the file's age,
+ * like a battery-backed chip that was left running.
+ */
 
-    for (i = 0; i < 50; i++) {
-        unsigned char mx, my;
-        mx = inb(PORT_MOUSE_X);
-        my = inb(PORT_MOUSE_Y);
-        if (mx != 0 || my != 0) {
-            printf("  X: %4d  Y: %4d\r", (signed char)mx, (signed char)my);
-        }
-        /* ~100ms delay - crude busy loop */
-        {
-            volatile unsigned long j;
-            for (j = 0; j < 50000UL; j++)
-                ;
-        }
-    }
-    mx2 = inb(PORT_MOUSE_X);
-    my2 = inb(PORT_MOUSE_Y);
-    printf("\n  Final: X=%d Y=%d\n", (signed char)mx2, (signed char)my2);
-    if (mx2 == 0 && my2 == 0)
-        printf("  No movement detected - mouse may not be connected\n");
-    else
-        printf("  Mouse is responding\n");
+#define EMU_UIP_US      244     /* UIP lead time before an update */
+#define EMU_PIT_PER_MS  1193    /* PIT_HZ / 1000 */
+#define EMU_LPT1_STATUS 0x07    /* language 7 (English), display 0 (EGA) */
+#define EMU_MAX_CATCHUP 86400L  /* seconds replayed after a long gap */
+
+static unsigned char emu_ram[CMOS_SIZE];
+static unsigned char emu_index, emu_pb, emu_stat1, emu_stat2;
+static long emu_sec;            /* host second of the last RTC update */
+static unsigned short emu_pit_reload;
+static unsigned short emu_pit_latch;
+static unsigned char emu_pit_flags;    /* EMU_PIT_* */
+static struct timeval emu_pit_start;
+static struct timeval emu_epoch;        /* channel 0 start */
+static unsigned short emu_pit0_latch;
+static unsigned char emu_pit0_hi;
+static struct timeval emu_pf_last;      /* last periodic (PF) edge */
+static const char *emu_file;
+static unsigned char emu_file_orig[CMOS_SIZE];
+
+#define EMU_PIT_HI_NEXT 0x01    /* next data byte is the high byte */
+#define EMU_PIT_LATCHED 0x02
+#define EMU_PIT_LOADED  0x04    /* low byte of a reload has been written */
+
+static unsigned char emu_get(int reg)
+{
+    unsigned char v = emu_ram[reg];
+    return (emu_ram[RTC_REG_B] & RTC_B_DM) ? v : bcd_to_bin(v);
 }
 
-/* ================================================================
- * Speaker / Sound Test
- * ================================================================ */
-
-static void speaker_on(unsigned short freq)
+static void emu_put(int reg, unsigned char v)
 {
-    unsigned short divisor;
-    unsigned char pb;
+    emu_ram[reg] = (emu_ram[RTC_REG_B] & RTC_B_DM) ? v : bin_to_bcd(v);
+}
 
-    if (freq == 0)
-        freq = 1000;
+static unsigned char emu_get_hours(int reg)
+{
+    unsigned char raw = emu_ram[reg], h;
+
+    if (emu_ram[RTC_REG_B] & RTC_B_24H)
+        return emu_get(reg);
+    emu_ram[reg] = raw & 0x7F;
+    h = emu_get(reg) % 12;
+    emu_ram[reg] = raw;
+    return (raw & 0x80) ? h + 12 : h;
+}
 
-    /* PIT channel 2 divisor: 1193182 / freq */
-    divisor = (unsigned short)(1193182UL / (unsigned long)freq);
+static void emu_put_hours(int reg, unsigned char h)
+{
+    if (emu_ram[RTC_REG_B] & RTC_B_24H) {
+        emu_put(reg, h);
+        return;
+    }
+    emu_put(reg, (h % 12) ? h % 12 : 12);
+    if (h >= 12)
+        emu_ram[reg] |= 0x80;
+}
 
-    /* Set PIT channel 2 to mode 3 (square wave) */
-    outb(0xB6, PORT_PIT_MODE);  /* channel 2, mode 3, lobyte/hibyte */
-    io_delay();
-    outb(divisor & 0xFF, PORT_PIT_CH2);
-    io_delay();
-    outb((divisor >> 8) & 0xFF, PORT_PIT_CH2);
-    io_delay();
+/* One update cycle: advance the clock by a second, latch UF and AF */
+static void emu_rtc_tick(void)
+{
+    static const unsigned char mdays[12] = {
+        31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+    };
+    unsigned char s, m, h, dim;
+
+    s = emu_get(RTC_SECONDS) + 1;
+    if (s >= 60) {
+        s = 0;
+        m = emu_get(RTC_MINUTES) + 1;
+        if (m >= 60) {
+            m = 0;
+            h = emu_get_hours(RTC_HOURS) + 1;
+            if (h >= 24) {
+                unsigned char d = emu_get(RTC_DAY_OF_MONTH) + 1;
+                unsigned char mo = emu_get(RTC_MONTH);
+                unsigned char y = emu_get(RTC_YEAR);
+
+                h = 0;
+                emu_put(RTC_DAY_OF_WEEK, emu_get(RTC_DAY_OF_WEEK) % 7 + 1);
+                dim = (mo >= 1 && mo <= 12) ? mdays[mo - 1] : 31;
+                if (mo == 2 && (y % 4) == 0)
+                    dim = 29;
+                if (d > dim) {
+                    d = 1;
+                    if (++mo > 12) {
+                        mo = 1;
+                        emu_put(RTC_YEAR, (y + 1) % 100);
+                    }
+                    emu_put(RTC_MONTH, mo);
+                }
+                emu_put(RTC_DAY_OF_MONTH, d);
+            }
+            emu_put_hours(RTC_HOURS, h);
+        }
+        emu_put(RTC_MINUTES, m);
+    }
+    emu_put(RTC_SECONDS, s);
+
+    emu_ram[RTC_REG_C] |= RTC_C_UF;
+    /* Alarm bytes >= 0xC0 are "don't care" */
+    if ((emu_ram[RTC_ALARM_SEC] >= 0xC0 ||
+         emu_ram[RTC_ALARM_SEC] == emu_ram[RTC_SECONDS]) &&
+        (emu_ram[RTC_ALARM_MIN] >= 0xC0 ||
+         emu_ram[RTC_ALARM_MIN] == emu_ram[RTC_MINUTES]) &&
+        (emu_ram[RTC_ALARM_HRS] >= 0xC0 ||
+         emu_ram[RTC_ALARM_HRS] == emu_ram[RTC_HOURS]))
+        emu_ram[RTC_REG_C] |= RTC_C_AF;
+    if (emu_ram[RTC_REG_C] & emu_ram[RTC_REG_B] & (RTC_C_UF | RTC_C_AF))
+        emu_ram[RTC_REG_C] |= RTC_C_IRQF;
+}
 
-    /* Enable speaker: set PB bits 0 (gate) and 1 (enable) */
-    pb = inb(PORT_PB);
-    outb(pb | PB_SPEAKER_GATE | PB_SPEAKER_ENABLE, PORT_PB);
+/*
+ * Raise PF at the Register A rate (65536 >> RS Hz, RS 1-2 aliasing
+ * 8-9), keeping the phase of the last edge; PIE adds IRQF as on the
+ * chip.  Only called when Register C is read, which is enough to see
+ * every edge a poller could.
+ */
+static void emu_rtc_periodic(void)
+{
+    unsigned char rs = emu_ram[RTC_REG_A] & RTC_A_RS_MASK;
+    unsigned long period, us;
+    struct timeval tv;
+
+    if (rs == 0)
+        return;
+    if (rs < 3)
+        rs += 7;
+    period = 1000000UL / (65536UL >> rs);
+    gettimeofday(&tv, NULL);
+    us = (unsigned long)(tv.tv_sec - emu_pf_last.tv_sec) * 1000000UL
+       + (unsigned long)(tv.tv_usec - emu_pf_last.tv_usec);
+    if (us < period)
+        return;
+    if (us >= 1000000UL) {
+        emu_pf_last = tv;
+    } else {
+        us -= us % period;
+        emu_pf_last.tv_usec += us;
+        if (emu_pf_last.tv_usec >= 1000000L) {
+            emu_pf_last.tv_usec -= 1000000L;
+            emu_pf_last.tv_sec++;
+        }
+    }
+    emu_ram[RTC_REG_C] |= RTC_C_PF;
+    if (emu_ram[RTC_REG_B] & RTC_B_PIE)
+        emu_ram[RTC_REG_C] |= RTC_C_IRQF;
 }
 
-static void speaker_off(void)
+/* Catch the clock up with the host; returns 1 inside the UIP window */
+static int emu_rtc_sync(void)
 {
-    unsigned char pb = inb(PORT_PB);
-    outb(pb & ~(PB_SPEAKER_GATE | PB_SPEAKER_ENABLE), PORT_PB);
+    struct timeval tv;
+    long n;
+
+    gettimeofday(&tv, NULL);
+    n = tv.tv_sec - emu_sec;
+    emu_sec = tv.tv_sec;
+    if (emu_ram[RTC_REG_B] & RTC_B_SET)
+        return 0;
+    if (n > EMU_MAX_CATCHUP)
+        n = EMU_MAX_CATCHUP;
+    while (n-- > 0)
+        emu_rtc_tick();
+    return tv.tv_usec >= 1000000L - EMU_UIP_US;
 }
 
-static void speaker_test(void)
+/* PIT input clocks since 'since', modulo 2^16 */
+static unsigned short emu_pit_ticks(const struct timeval *since)
 {
-    volatile unsigned long j;
+    struct timeval tv;
+    unsigned long us;
+
+    gettimeofday(&tv, NULL);
+    us = (unsigned long)(tv.tv_sec - since->tv_sec) * 1000000UL
+       + (unsigned long)(tv.tv_usec - since->tv_usec);
+    /* Wraps mod 2^32, which keeps the low 16 bits exact */
+    return (unsigned short)((us / 1000) * EMU_PIT_PER_MS +
+                            (us % 1000) * EMU_PIT_PER_MS / 1000);
+}
 
-    printf("Speaker test:\n");
+static unsigned short emu_pit_count(void)
+{
+    return emu_pit_reload - emu_pit_ticks(&emu_pit_start);
+}
 
-    printf("  440 Hz (A4)...\n");
-    speaker_on(440);
-    for (j = 0; j < 500000UL; j++) ;
-    speaker_off();
-    for (j = 0; j < 100000UL; j++) ;
+static unsigned char emu_inb(unsigned short port)
+{
+    unsigned char v;
+
+    switch (port) {
+    case CMOS_DATA_PORT:
+        switch (emu_index) {
+        case RTC_REG_A:
+            v = emu_ram[RTC_REG_A] & ~RTC_A_UIP;
+            return emu_rtc_sync() ? v | RTC_A_UIP : v;
+        case RTC_REG_C:
+            emu_rtc_sync();
+            emu_rtc_periodic();
+            v = emu_ram[RTC_REG_C];
+            emu_ram[RTC_REG_C] = 0;
+            return v;
+        case RTC_REG_D:
+            return RTC_D_VRT;
+        }
+        if (emu_index <= RTC_YEAR)
+            emu_rtc_sync();
+        return emu_ram[emu_index];
+    case PORT_PIT_CH2:
+        if (emu_pit_flags & EMU_PIT_LATCHED) {
+            v = (emu_pit_flags & EMU_PIT_HI_NEXT) ? emu_pit_latch >> 8
+                                                  : emu_pit_latch & 0xFF;
+            if (emu_pit_flags & EMU_PIT_HI_NEXT)
+                emu_pit_flags &= ~EMU_PIT_LATCHED;
+        } else {
+            unsigned short c = emu_pit_count();
+            v = (emu_pit_flags & EMU_PIT_HI_NEXT) ? c >> 8 : c & 0xFF;
+        }
+        emu_pit_flags ^= EMU_PIT_HI_NEXT;
+        return v;
+    case PORT_PIT_CH0:
+        emu_pit0_hi ^= 1;
+        return emu_pit0_hi ? emu_pit0_latch & 0xFF : emu_pit0_latch >> 8;
+    case PORT_KBD_DATA:
+        return (emu_pb & PB_STATUS_MODE) ? emu_stat1 : 0x00;
+    case PORT_PB:
+        return emu_pb;
+    case PORT_STATUS2:
+        return (emu_pb & PB_NIBBLE_SEL) ? emu_stat2 & 0x0F : emu_stat2 >> 4;
+    case PORT_LPT1_STATUS:
+        return EMU_LPT1_STATUS;
+    case PORT_IDA_STATUS:
+    case PORT_MOUSE_X:
+    case PORT_MOUSE_Y:
+        return 0x00;
+    }
+    return 0xFF;
+}
 
-    printf("  880 Hz (A5)...\n");
-    speaker_on(880);
-    for (j = 0; j < 500000UL; j++) ;
-    speaker_off();
-    for (j = 0; j < 100000UL; j++) ;
+static void emu_outb(unsigned char val, unsigned short port)
+{
+    switch (port) {
+    case CMOS_ADDR_PORT:
+        emu_index = val & (CMOS_SIZE - 1);
+        break;
+    case CMOS_DATA_PORT:
+        emu_rtc_sync();
+        if (emu_index == RTC_REG_A) {
+            emu_ram[RTC_REG_A] = (val & ~RTC_A_UIP)
+                               | (emu_ram[RTC_REG_A] & RTC_A_UIP);
+            gettimeofday(&emu_pf_last, NULL);   /* new rate, new phase */
+        } else if (emu_index != RTC_REG_C && emu_index != RTC_REG_D)
+            emu_ram[emu_index] = val;
+        break;
+    case PORT_PIT_MODE:
+        if (val == 0x00) {              /* channel 0 latch */
+            emu_pit0_latch = 0 - emu_pit_ticks(&emu_epoch);
+            emu_pit0_hi = 0;
+            break;
+        }
+        if ((val & 0xC0) != 0x80)       /* otherwise channel 2 only */
+            break;
+        if ((val & 0x30) == 0) {
+            emu_pit_latch = emu_pit_count();
+            emu_pit_flags = EMU_PIT_LATCHED;
+        } else {
+            emu_pit_flags = 0;
+        }
+        break;
+    case PORT_PIT_CH2:
+        if (emu_pit_flags & EMU_PIT_LOADED) {
+            emu_pit_reload = (emu_pit_reload & 0xFF) | ((unsigned short)val << 8);
+            gettimeofday(&emu_pit_start, NULL);
+            emu_pit_flags &= ~EMU_PIT_LOADED;
+        } else {
+            emu_pit_reload = val;
+            emu_pit_flags |= EMU_PIT_LOADED;
+        }
+        break;
+    case PORT_PB:
+        emu_pb = val;
+        break;
+    case PORT_SYSSTAT1_WR:
+        emu_stat1 = val;
+        break;
+    case PORT_SYSSTAT2_WR:
+        emu_stat2 = val;
+        break;
+    case PORT_SOFT_RESET:
+        DBG(1, "emu: soft reset ignored\n");
+        break;
+    }
+}
 
-    printf("  1000 Hz...\n");
-    speaker_on(1000);
-    for (j = 0; j < 500000UL; j++) ;
-    speaker_off();
-    for (j = 0; j < 100000UL; j++) ;
+/* Power-on state: clock from the host, 24h BCD, valid checksum */
+static void emu_power_on(void)
+{
+    time_t now = time(NULL);
+    struct tm *tm = localtime(&now);
+
+    memset(emu_ram, 0, sizeof(emu_ram));
+    emu_ram[RTC_REG_A] = 0x26;
+    emu_ram[RTC_REG_B] = RTC_B_24H;
+    emu_put(RTC_SECONDS, tm->tm_sec);
+    emu_put(RTC_MINUTES, tm->tm_min);
+    emu_put(RTC_HOURS, tm->tm_hour);
+    emu_put(RTC_DAY_OF_WEEK, tm->tm_wday + 1);
+    emu_put(RTC_DAY_OF_MONTH, tm->tm_mday);
+    emu_put(RTC_MONTH, tm->tm_mon + 1);
+    emu_put(RTC_YEAR, tm->tm_year % 100);
+    emu_put(CMOS_CENTURY, 19 + tm->tm_year / 100);
+}
 
-    printf("  2000 Hz...\n");
-    speaker_on(2000);
-    for (j = 0; j < 500000UL; j++) ;
-    speaker_off();
+static void emu_file_save(void)
+{
+    FILE *fp;
 
-    printf("  Done.\n");
+    if (memcmp(emu_ram, emu_file_orig, CMOS_SIZE) == 0)
+        return;
+    fp = fopen(emu_file, "wb");
+    if (!fp || fwrite(emu_ram, 1, CMOS_SIZE, fp) != CMOS_SIZE)
+        fprintf(stderr, "Error: cannot write backend image %s\n", emu_file);
+    if (fp)
+        fclose(fp);
 }
 
-static int speaker_beep(const char *freqstr)
-{
-    int freq = atoi(freqstr);
-    volatile unsigned long j;
+static const struct io_backend io_emu = { "emu", emu_inb, emu_outb, NULL, NULL };
 
-    if (freq < 20 || freq > 20000) {
-        fprintf(stderr, "Error: Frequency must be 20-20000 Hz\n");
+/* Select the backend named by -b: "ports", "emu" or "file:PATH" */
+static int io_select(const char *spec)
+{
+    if (strcmp(spec, "ports") == 0) {
+        io = &io_ports;
+        return 0;
+    }
+    if (strcmp(spec, "emu") != 0 && strncmp(spec, "file:", 5) != 0) {
+        fprintf(stderr, "Error: unknown backend '%s' (ports, emu, file:PATH)\n",
+                spec);
         return 1;
     }
 
-    printf("Beep at %d Hz...\n", freq);
-    speaker_on(freq);
-    for (j = 0; j < 500000UL; j++) ;
-    speaker_off();
+    emu_power_on();
+    emu_sec = time(NULL);
+    gettimeofday(&emu_pit_start, NULL);
+    emu_epoch = emu_pit_start;
+    if (spec[0] == 'f') {
+        FILE *fp;
+
+        emu_file = spec + 5;
+        fp = fopen(emu_file, "rb");
+        if (fp) {
+            struct stat st;
+
+            if (fstat(fileno(fp), &st) == 0 && st.st_mtime < emu_sec)
+                emu_sec = st.st_mtime;
+            if (fread(emu_ram, 1, CMOS_SIZE, fp) != CMOS_SIZE) {
+                fprintf(stderr, "Error: %s is shorter than %d bytes\n",
+                        emu_file, CMOS_SIZE);
+                fclose(fp);
+                return 1;
+            }
+            fclose(fp);
+            memcpy(emu_file_orig, emu_ram, CMOS_SIZE);
+        } else {
+            memset(emu_file_orig, 0xFF, CMOS_SIZE);  /* create on exit */
+        }
+        atexit(emu_file_save);
+    }
+    io = &io_emu;
+    DBG(1, "Backend: %s\n", spec);
     return 0;
 }
 
+#endif /* NVR_EMU */
+
+#if NVR_CONFIG || NVR_HW
+
 /* ================================================================
- * PIC (Interrupt Controller) Status
+ * Amstrad System Status Access
  * ================================================================ */
 
-static void show_pic(void)
+/*
+ * Read system status 2 via port 0x62 with nibble protocol.
+ * From BIOS ROM disassembly at 0x0465-0x047B.
+ *
+ * PB bit 2 = 0: read high nibble (bits 7-4 of latch, returned as bits 3-0)
+ * PB bit 2 = 1: read low nibble (bits 3-0 of latch, returned as bits 3-0)
+ *
+ * sysstat2_nibbles() does the two selections from a saved PB value and
+ * leaves PB.2 set; callers reading several latches restore PB once.
+ */
+static unsigned char sysstat2_nibbles(unsigned char pb)
 {
-    unsigned char imr, isr, irr;
+    unsigned char hi, lo;
 
-    printf("\n8259A PIC Status:\n");
-
-    /* Read IMR (Interrupt Mask Register) */
-    imr = inb(PORT_PIC_DATA);
-
-    /* Read IRR (Interrupt Request Register) via OCW3 */
-    outb(0x0A, PORT_PIC_CMD);  /* OCW3: read IRR */
+    outb(pb & ~PB_NIBBLE_SEL, PORT_PB);
     io_delay();
-    irr = inb(PORT_PIC_CMD);
+    hi = inb(PORT_STATUS2) & 0x0F;
 
-    /* Read ISR (In-Service Register) via OCW3 */
-    outb(0x0B, PORT_PIC_CMD);  /* OCW3: read ISR */
+    outb(pb | PB_NIBBLE_SEL, PORT_PB);
     io_delay();
-    isr = inb(PORT_PIC_CMD);
+    lo = inb(PORT_STATUS2) & 0x0F;
 
-    printf("  IMR (Interrupt Mask):     0x%02X\n", imr);
-    printf("  IRR (Interrupt Request):  0x%02X\n", irr);
-    printf("  ISR (In-Service):         0x%02X\n", isr);
-    printf("\n");
-    printf("  IRQ  Mask  Req  Svc  Function (PC1640)\n");
-    printf("  ---  ----  ---  ---  -----------------\n");
-    printf("   0    %c     %c    %c   Timer (8253 CH0, 18.2 Hz)\n",
-           (imr & 0x01) ? 'M' : '.', (irr & 0x01) ? 'R' : '.', (isr & 0x01) ? 'S' : '.');
-    printf("   1    %c     %c    %c   Keyboard + RTC alarm (Amstrad!)\n",
-           (imr & 0x02) ? 'M' : '.', (irr & 0x02) ? 'R' : '.', (isr & 0x02) ? 'S' : '.');
-    printf("   2    %c     %c    %c   Reserved\n",
-           (imr & 0x04) ? 'M' : '.', (irr & 0x04) ? 'R' : '.', (isr & 0x04) ? 'S' : '.');
-    printf("   3    %c     %c    %c   COM2 (serial port 2)\n",
-           (imr & 0x08) ? 'M' : '.', (irr & 0x08) ? 'R' : '.', (isr & 0x08) ? 'S' : '.');
-    printf("   4    %c     %c    %c   COM1 (serial port 1)\n",
-           (imr & 0x10) ? 'M' : '.', (irr & 0x10) ? 'R' : '.', (isr & 0x10) ? 'S' : '.');
-    printf("   5    %c     %c    %c   LPT2 (parallel port 2)\n",
-           (imr & 0x20) ? 'M' : '.', (irr & 0x20) ? 'R' : '.', (isr & 0x20) ? 'S' : '.');
-    printf("   6    %c     %c    %c   Floppy disk controller\n",
-           (imr & 0x40) ? 'M' : '.', (irr & 0x40) ? 'R' : '.', (isr & 0x40) ? 'S' : '.');
-    printf("   7    %c     %c    %c   LPT1 (parallel port 1)\n",
-           (imr & 0x80) ? 'M' : '.', (irr & 0x80) ? 'R' : '.', (isr & 0x80) ? 'S' : '.');
-
-    printf("\n  Legend: M=Masked  R=Request pending  S=In service\n");
-    printf("  Note: PC1640 has single PIC (no secondary - 8086 system)\n");
-    printf("  Note: RTC alarm routes to IRQ 1 (shared with keyboard)\n");
+    DBG(2, "sysstat2: hi=0x%X lo=0x%X => 0x%02X\n", hi, lo, (hi << 4) | lo);
+    return (hi << 4) | lo;
 }
 
-/* ================================================================
- * DMA Controller Status
- * ================================================================ */
-
-static void show_dma(void)
+static unsigned char amstrad_read_sysstat2(void)
 {
-    unsigned char status;
+    unsigned char pb, val;
 
-    printf("\n8237A DMA Controller Status:\n");
+    pb = inb(PORT_PB);
+    val = sysstat2_nibbles(pb);
+    outb(pb, PORT_PB);  /* restore */
+    return val;
+}
 
-    status = inb(PORT_DMA_STAT);
+/*
+ * Read system status 1 via port 0x60 with PB bit 7.
+ * From BIOS ROM at 0x03F3-0x040F.
+ */
+static unsigned char amstrad_read_sysstat1(void)
+{
+    unsigned char pb, val;
 
-    printf("  Status register (port 0x08): 0x%02X\n", status);
-    printf("    Ch0: TC=%c  Req=%c  (DRAM refresh)\n",
-           (status & 0x01) ? 'Y' : 'N', (status & 0x10) ? 'Y' : 'N');
-    printf("    Ch1: TC=%c  Req=%c  (Available)\n",
-           (status & 0x02) ? 'Y' : 'N', (status & 0x20) ? 'Y' : 'N');
-    printf("    Ch2: TC=%c  Req=%c  (Floppy disk)\n",
-           (status & 0x04) ? 'Y' : 'N', (status & 0x40) ? 'Y' : 'N');
-    printf("    Ch3: TC=%c  Req=%c  (Available)\n",
-           (status & 0x08) ? 'Y' : 'N', (status & 0x80) ? 'Y' : 'N');
+    pb = inb(PORT_PB);
+    outb(pb | PB_STATUS_MODE, PORT_PB);
+    io_delay();
+    val = inb(PORT_KBD_DATA);
+    outb(pb, PORT_PB);
 
-    printf("  TC = Terminal Count reached\n");
-    printf("  Page registers: ch1=0x83  ch2=0x81  ch3=0x82\n");
+    DBG(2, "sysstat1: 0x%02X\n", val);
+    return val;
 }
 
-/* ================================================================
- * PIT (Timer) Status
- * ================================================================ */
-
-static void show_pit(void)
-{
-    unsigned char lo, hi;
-    unsigned short count;
+#if NVR_CONFIG
+/*
+ * Status reads shared by the display routines.  Between
+ * am_cache_begin() and am_cache_end() (one "show") each of sysstat1,
+ * sysstat2 and the LPT1 status is read once and then served from
+ * here; outside it every call goes to the ports.
+ */
+enum { AM_STAT1, AM_STAT2, AM_LPT1, AM_NSTAT };
 
-    printf("\n8253 PIT (Programmable Interval Timer):\n");
-    printf("  Base frequency: 1,193,182 Hz\n");
+static unsigned char am_val[AM_NSTAT];
+static unsigned char am_loaded;         /* bit per AM_*, while caching */
+static int am_caching = 0;
 
-    /* Latch channel 2 count */
-    outb(0x80, PORT_PIT_MODE);  /* Latch channel 2 */
-    io_delay();
-    lo = inb(PORT_PIT_CH2);
-    hi = inb(PORT_PIT_CH2);
-    count = lo | ((unsigned short)hi << 8);
+static void am_cache_begin(void)
+{
+    am_caching = 1;
+    am_loaded = 0;
+}
 
-    printf("  Channel 0: System timer (IRQ 0, ~18.2 Hz tick)\n");
-    printf("  Channel 1: DRAM refresh (hidden)\n");
-    printf("  Channel 2: Speaker tone generator\n");
-    printf("    Current count: %u (0x%04X)\n", count, count);
-    if (count > 0) {
-        printf("    Frequency: ~%lu Hz\n", 1193182UL / (unsigned long)count);
-    }
+static void am_cache_end(void)
+{
+    am_caching = 0;
+}
 
-    {
-        unsigned char pb = inb(PORT_PB);
-        printf("    Speaker gate (PB.0): %s\n",
-               (pb & PB_SPEAKER_GATE) ? "ON" : "off");
-        printf("    Speaker enable (PB.1): %s\n",
-               (pb & PB_SPEAKER_ENABLE) ? "ON" : "off");
+static unsigned char am_status(int which)
+{
+    unsigned char v;
+
+    if (am_caching && (am_loaded & (1 << which)))
+        return am_val[which];
+    switch (which) {
+    case AM_STAT1: v = amstrad_read_sysstat1(); break;
+    case AM_STAT2: v = amstrad_read_sysstat2(); break;
+    default:       v = inb(PORT_LPT1_STATUS); break;
     }
+    am_val[which] = v;
+    am_loaded |= 1 << which;
+    return v;
 }
+#endif
+
+#endif /* NVR_CONFIG || NVR_HW */
+
+#if NVR_TIMING
 
 /* ================================================================
- * Full CMOS Dump
+ * Timing: PIT Channel 2 Timebase and Calibrated Delays
  * ================================================================ */
 
-static void dump_cmos(void)
-{
-    int i;
-    unsigned char data[CMOS_SIZE];
+#define PIT_HZ           1193182UL
+#define PIT_CH2_LATCH    0x80   /* counter latch command, channel 2 */
+#define PIT_CH2_MODE0    0xB0   /* channel 2, lobyte/hibyte, mode 0 */
+#define SLEEP_TICK_MS    10     /* ELKS scheduler tick (HZ=100) */
 
-    rtc_wait_uip();
-    for (i = 0; i < CMOS_SIZE; i++)
-        data[i] = cmos_read(i);
+/*
+ * Delays are wall-clock, not loop counts.  Whole scheduler ticks are
+ * slept in the kernel; only the sub-tick remainder is spun, using a
+ * loop rate calibrated once per process against PIT channel 2.  The
+ * same binary therefore keeps its timing on an 8086, a V30 or PCem.
+ *
+ * Channel 2 also drives the speaker, so calibration has to happen
+ * before a tone is started: tone_play() makes sure of that.
+ */
+static unsigned long loops_per_ms = 0;
+
+/* Free-run channel 2 as a 16-bit down-counter, speaker amp kept off */
+static void pit2_start(void)
+{
+    unsigned char pb = inb(PORT_PB);
+
+    outb((pb | PB_SPEAKER_GATE) & ~PB_SPEAKER_ENABLE, PORT_PB);
+    outb(PIT_CH2_MODE0, PORT_PIT_MODE);
+    io_delay();
+    outb(0, PORT_PIT_CH2);
+    io_delay();
+    outb(0, PORT_PIT_CH2);
+}
+
+/* Latch and read the channel 2 count (decrements at PIT_HZ) */
+static unsigned short pit2_read(void)
+{
+    unsigned char lo, hi;
+
+    outb(PIT_CH2_LATCH, PORT_PIT_MODE);
+    io_delay();
+    lo = inb(PORT_PIT_CH2);
+    hi = inb(PORT_PIT_CH2);
+    return lo | ((unsigned short)hi << 8);
+}
+
+/* PIT ticks to microseconds without overflowing 32 bits */
+static unsigned long pit_ticks_us(unsigned long ticks)
+{
+    return (ticks / 1193) * 1000UL + (ticks % 1193) * 1000UL / 1193;
+}
+
+static void spin_loops(unsigned long n)
+{
+    volatile unsigned long i;
+    for (i = 0; i < n; i++)
+        ;
+}
+
+/*
+ * Double the loop count until one run spans ~10 ms of PIT time, then
+ * keep the fastest of three runs: being scheduled out only ever makes
+ * a run look slower.
+ */
+static void timer_calibrate(void)
+{
+    unsigned long n = 64;
+    unsigned short t0, ticks, best;
+    int i;
+
+    pit2_start();
+    for (;;) {
+        t0 = pit2_read();
+        spin_loops(n);
+        ticks = t0 - pit2_read();
+        if (ticks >= 12000 || n >= 0x100000UL)
+            break;
+        n <<= 1;
+    }
+    best = ticks;
+    for (i = 0; i < 2; i++) {
+        t0 = pit2_read();
+        spin_loops(n);
+        ticks = t0 - pit2_read();
+        if (ticks < best)
+            best = ticks;
+    }
+    if (best == 0)
+        best = 1;
+
+    loops_per_ms = n * (PIT_HZ / 1000UL) / best;
+    if (loops_per_ms == 0)
+        loops_per_ms = 1;
+    DBG(1, "Timer calibrated: %lu loops in %u PIT ticks => %lu loops/ms\n",
+        n, best, loops_per_ms);
+}
+
+/* Give the CPU back to the kernel for roughly ms milliseconds */
+static void sleep_ms(unsigned int ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (long)(ms % 1000) * 1000L;
+    select(0, NULL, NULL, NULL, &tv);
+}
+
+static void delay_ms(unsigned int ms)
+{
+    unsigned int rem = ms % SLEEP_TICK_MS;
+
+    if (ms >= SLEEP_TICK_MS)
+        sleep_ms(ms - rem);
+    if (rem) {
+        if (!loops_per_ms)
+            timer_calibrate();
+        spin_loops(loops_per_ms * rem);
+    }
+}
+
+#if NVR_WATCH || NVR_HW
+static volatile int loop_stop = 0;
+
+/* SIGINT/SIGTERM handler for the long-running loops */
+static void loop_sigint(int sig)
+{
+    (void)sig;
+    loop_stop = 1;
+}
+#endif
+
+#endif /* NVR_TIMING */
+
+/* ================================================================
+ * CMOS Checksum (bytes 0x10-0x2D)
+ * ================================================================ */
+
+static unsigned short cmos_calc_checksum(void)
+{
+    unsigned char live[0x2E - 0x10];
+    unsigned short sum = 0;
+    int i;
+
+    if (!stage_depth && !cmos_image_valid) {
+        cmos_read_burst(0x10, live, sizeof(live));
+        for (i = 0; i < (int)sizeof(live); i++)
+            sum += live[i];
+    } else {
+        for (i = 0x10; i <= 0x2D; i++)
+            sum += cmos_get(i);
+    }
+    DBG(2, "Calculated checksum: 0x%04X\n", sum);
+    return sum;
+}
+
+static int cmos_verify_checksum(void)
+{
+    unsigned short calc, stored;
+    calc = cmos_calc_checksum();
+    stored = ((unsigned short)cmos_get(CMOS_CHECKSUM_HI) << 8) |
+             cmos_get(CMOS_CHECKSUM_LO);
+    DBG(1, "Checksum stored=0x%04X calc=0x%04X\n", stored, calc);
+    if (calc != stored)
+        cksum_bad = 1;
+    else if (!stage_depth)
+        cksum_bad = 0;      /* staged, the chip may still hold the bad one */
+    return (calc == stored);
+}
+
+/*
+ * Inside a transaction without a snapshot the new checksum is derived
+ * from the stored one: every staged byte in 0x10-0x2D moves it by
+ * (shadow - orig), both already in memory.  A one-field setter then
+ * costs only the checksum bytes' reads instead of 30 more.  A full
+ * recompute is used when it is free (snapshot taken), outside a
+ * transaction, or once a verify has shown the stored value is wrong.
+ * In the last case the flag stays set until the recomputed sum has
+ * been committed, since the stored value is still the wrong base for
+ * later setters of the same batch (their recompute is free by then:
+ * the first one staged the whole range).
+ */
+static void cmos_update_checksum(void)
+{
+    unsigned short sum;
+    int i;
+
+    if (stage_depth && !cmos_image_valid && !cksum_bad) {
+        stage_load(CMOS_CHECKSUM_HI);
+        stage_load(CMOS_CHECKSUM_LO);
+        sum = ((unsigned short)stage_orig[CMOS_CHECKSUM_HI] << 8) |
+              stage_orig[CMOS_CHECKSUM_LO];
+        for (i = 0x10; i <= 0x2D; i++)
+            if (BIT_TEST(stage_loaded, i))
+                sum += stage_shadow[i] - stage_orig[i];
+    } else {
+        sum = cmos_calc_checksum();
+        if (!stage_depth)
+            cksum_bad = 0;
+    }
+    cmos_write(CMOS_CHECKSUM_HI, (sum >> 8) & 0xFF);
+    cmos_write(CMOS_CHECKSUM_LO, sum & 0xFF);
+    DBG(1, "Checksum updated to 0x%04X\n", sum);
+}
+
+/* ================================================================
+ * Display: Time & Date
+ * ================================================================ */
+
+static const char *day_names[] = {
+    "???", "Sunday", "Monday", "Tuesday",
+    "Wednesday", "Thursday", "Friday", "Saturday"
+};
+
+static const char *month_names[] = {
+    "???", "January", "February", "March", "April",
+    "May", "June", "July", "August",
+    "September", "October", "November", "December"
+};
+
+static void show_time(void)
+{
+    unsigned char t[RTC_YEAR + 1];
+    unsigned char sec, min, hrs, dow, dom, mon, yr, cen;
+    unsigned char regb;
+
+    rtc_clock_get(t);
+    sec = t[RTC_SECONDS];
+    min = t[RTC_MINUTES];
+    hrs = t[RTC_HOURS];
+    dow = t[RTC_DAY_OF_WEEK];
+    dom = t[RTC_DAY_OF_MONTH];
+    mon = t[RTC_MONTH];
+    yr  = t[RTC_YEAR];
+    cen = cmos_get(CMOS_CENTURY);
+    regb = rtc_mode_load();
+
+    DBG(2, "Raw: sec=%02X min=%02X hrs=%02X dow=%02X dom=%02X "
+           "mon=%02X yr=%02X cen=%02X regB=%02X\n",
+           sec, min, hrs, dow, dom, mon, yr, cen, regb);
+
+    sec = rtc_to_bin(sec);
+    min = rtc_to_bin(min);
+    dom = rtc_to_bin(dom);
+    mon = rtc_to_bin(mon);
+    yr  = rtc_to_bin(yr);
+    cen = rtc_to_bin(cen);
+    dow = rtc_to_bin(dow);
+    hrs = rtc_hours_to_bin(hrs);
+
+    if (dow > 7) dow = 0;
+    if (mon > 12) mon = 0;
+
+    out_str("Date: ");
+    out_str(day_names[dow]);
+    out_char(' ');
+    out_dec(dom, 0);
+    out_char(' ');
+    out_str(month_names[mon]);
+    out_char(' ');
+    out_dec(cen, 0);
+    out_dec_pad(yr, 2, '0');
+    out_str("\nTime: ");
+    out_dec_pad(hrs, 2, '0');
+    out_char(':');
+    out_dec_pad(min, 2, '0');
+    out_char(':');
+    out_dec_pad(sec, 2, '0');
+    out_str("\nMode: ");
+    out_str((regb & RTC_B_24H) ? "24-hour, " : "12-hour, ");
+    out_str((regb & RTC_B_DM) ? "Binary\n" : "BCD\n");
+    out_flush();
+}
+
+#if NVR_CONFIG
+
+/* ================================================================
+ * Display: RTC Status Registers
+ * ================================================================ */
+
+/* Periodic interrupt rate table (from MC146818 datasheet) */
+static const char *rate_freq[] = {
+    "None",        /* 0 */
+    "256 Hz",      /* 1 - 3.90625ms */
+    "128 Hz",      /* 2 - 7.8125ms */
+    "8192 Hz",     /* 3 - 122.070us */
+    "4096 Hz",     /* 4 */
+    "2048 Hz",     /* 5 */
+    "1024 Hz",     /* 6 */
+    "512 Hz",      /* 7 */
+    "256 Hz",      /* 8 */
+    "128 Hz",      /* 9 */
+    "64 Hz",       /* 10 */
+    "32 Hz",       /* 11 */
+    "16 Hz",       /* 12 */
+    "8 Hz",        /* 13 */
+    "4 Hz",        /* 14 */
+    "2 Hz"         /* 15 */
+};
+
+static const char *divider_name[] = {
+    "4.194304 MHz (time base)", /* 0 */
+    "1.048576 MHz",             /* 1 */
+    "32.768 kHz",               /* 2 - standard crystal */
+    "Test: any",                /* 3 */
+    "Test: any",                /* 4 */
+    "Reset / divider held",     /* 5 */
+    "Reset / divider held",     /* 6 */
+    "Reset / divider held"      /* 7 */
+};
+
+static void show_rtc_status(void)
+{
+    unsigned char rega, regb, regc, regd;
+
+    rega = cmos_get(RTC_REG_A);
+    regb = cmos_get(RTC_REG_B);
+    regc = cmos_get(RTC_REG_C);  /* live read clears IRQ flags */
+    regd = cmos_get(RTC_REG_D);
+
+    out_str("\nRTC Status Registers:\n");
+    out_reg("  Register A (0x0A): ", rega);
+    out_flag("    Update In Progress: ", rega & RTC_A_UIP,
+             "Yes (do not read time)", "No");
+    out_str("    Divider: ");
+    out_dec((rega & RTC_A_DV_MASK) >> RTC_A_DV_SHIFT, 0);
+    out_str(" - ");
+    out_str(divider_name[(rega & RTC_A_DV_MASK) >> RTC_A_DV_SHIFT]);
+    out_str("\n    Rate select: ");
+    out_dec(rega & RTC_A_RS_MASK, 0);
+    out_str(" - ");
+    out_str(rate_freq[rega & RTC_A_RS_MASK]);
+    out_char('\n');
+
+    out_reg("  Register B (0x0B): ", regb);
+    out_flag("    SET (halt updates):     ", regb & RTC_B_SET,  "YES", "no");
+    out_flag("    Periodic IRQ enable:    ", regb & RTC_B_PIE,  "YES", "no");
+    out_flag("    Alarm IRQ enable:       ", regb & RTC_B_AIE,  "YES", "no");
+    out_flag("    Update-end IRQ enable:  ", regb & RTC_B_UIE,  "YES", "no");
+    out_flag("    Square wave output:     ", regb & RTC_B_SQWE, "YES", "no");
+    out_flag("    Data mode:              ", regb & RTC_B_DM,   "Binary", "BCD");
+    out_flag("    Hour format:            ", regb & RTC_B_24H,  "24-hour", "12-hour");
+    out_flag("    Daylight savings:       ", regb & RTC_B_DSE,  "YES", "no");
+
+    out_str("  Register C (0x0C): ");
+    out_byte(regc);
+    out_str("  [read clears flags]\n");
+    out_flag("    IRQ flag (composite):   ", regc & RTC_C_IRQF, "SET", "clear");
+    out_flag("    Periodic flag:          ", regc & RTC_C_PF,   "SET", "clear");
+    out_flag("    Alarm flag:             ", regc & RTC_C_AF,   "SET", "clear");
+    out_flag("    Update-ended flag:      ", regc & RTC_C_UF,   "SET", "clear");
+
+    out_reg("  Register D (0x0D): ", regd);
+    out_flag("    Battery: ", regd & RTC_D_VRT, "OK (valid RAM & time)",
+             "*** DEAD - REPLACE BATTERY ***");
+    out_flush();
+}
+
+/* ================================================================
+ * Display: Alarm
+ * ================================================================ */
+
+static void show_alarm(void)
+{
+    unsigned char sec, min, hrs, regb;
+    unsigned char v[3];
+    int i;
+
+    if (!cmos_image_valid)
+        rtc_wait_uip();
+
+    sec = cmos_get(RTC_ALARM_SEC);
+    min = cmos_get(RTC_ALARM_MIN);
+    hrs = cmos_get(RTC_ALARM_HRS);
+    regb = rtc_mode_load();
+
+    out_str("\nRTC Alarm:\n");
+
+    /* 0xC0-0xFF in alarm registers means "don't care" (wildcard) */
+    if (sec >= 0xC0 && min >= 0xC0 && hrs >= 0xC0) {
+        out_str("  Alarm: Not set (all wildcards)\n");
+    } else {
+        v[0] = hrs;
+        v[1] = min;
+        v[2] = sec;
+        out_str("  Alarm time: ");
+        for (i = 0; i < 3; i++) {
+            if (i)
+                out_char(':');
+            if (v[i] >= 0xC0)
+                out_str("**");
+            else
+                out_dec_pad(rtc_to_bin(v[i]), 2, '0');
+        }
+        out_str("\n  (** = wildcard/don't care)\n");
+    }
+
+    out_str("  Alarm IRQ: ");
+    out_str((regb & RTC_B_AIE) ? "ENABLED (routes to IRQ 1 on PC1640)\n"
+                               : "Disabled\n");
+    out_flush();
+}
+
+static int set_alarm(const char *timestr)
+{
+    int hrs, min, sec;
+    unsigned char regb;
+
+    if (sscanf(timestr, "%d:%d:%d", &hrs, &min, &sec) != 3) {
+        fprintf(stderr, "Error: Alarm format must be HH:MM:SS\n");
+        fprintf(stderr, "  Use -1 for wildcard (e.g. -1:-1:00 = every minute at :00)\n");
+        return 1;
+    }
+
+    regb = rtc_mode_load();
+    cmos_write(RTC_REG_B, regb | RTC_B_SET);
+
+    /* -1 means wildcard (don't care) = 0xC0 */
+    cmos_write(RTC_ALARM_SEC, (sec < 0) ? 0xC0 : bin_to_rtc(sec));
+    cmos_write(RTC_ALARM_MIN, (min < 0) ? 0xC0 : bin_to_rtc(min));
+    cmos_write(RTC_ALARM_HRS, (hrs < 0) ? 0xC0 : bin_to_rtc(hrs));
+
+    cmos_write(RTC_REG_B, regb & ~RTC_B_SET);
+
+    printf("Alarm set to %s\n", timestr);
+    printf("Note: Use 'nvr alarm-enable' to arm the alarm IRQ\n");
+    return 0;
+}
+
+static int alarm_enable(int enable)
+{
+    unsigned char regb;
+
+    stage_begin();
+    regb = cmos_get(RTC_REG_B);
+    if (enable)
+        regb |= RTC_B_AIE;
+    else
+        regb &= ~RTC_B_AIE;
+    cmos_write(RTC_REG_B, regb);
+    if (stage_commit() != 0)
+        return 1;
+
+    printf("Alarm IRQ %s\n", enable ? "ENABLED" : "disabled");
+    if (enable)
+        printf("  Note: On PC1640 alarm routes to IRQ 1 (shared with keyboard)\n");
+    return 0;
+}
+
+static int alarm_on(void)  { return alarm_enable(1); }
+static int alarm_off(void) { return alarm_enable(0); }
+
+/* ================================================================
+ * Display: Floppy Drives
+ * ================================================================ */
+
+static void show_floppy(void)
+{
+    int d;
+
+    out_str("\nFloppy Drive Configuration:\n");
+    out_reg("  CMOS byte 0x10: ", cmos_get(CMOS_FLOPPY));
+    for (d = 0; d < 2; d++) {
+        const struct cmos_field *f = &cmos_fields[F_FLOPPY_A + d];
+        long type = field_get(f, NULL, NULL);
+
+        out_str("  Drive ");
+        out_char('A' + d);
+        out_str(": type ");
+        out_dec(type, 0);
+        out_str(" - ");
+        out_str(field_value_name(f, type));
+        out_char('\n');
+    }
+    out_str("  Equipment says: ");
+    out_dec(equip_floppies(), 0);
+    out_str(" drive(s) installed\n");
+    out_str("  Disk-change line: active-low (PC1640 specific)\n");
+    out_flush();
+}
+
+static int set_floppy(const char *drv, const char *typestr)
+{
+    int d;
+
+    if (drv[0] == 'A' || drv[0] == 'a' || drv[0] == '0') {
+        d = 0;
+    } else if (drv[0] == 'B' || drv[0] == 'b' || drv[0] == '1') {
+        d = 1;
+    } else {
+        fprintf(stderr, "Error: Drive must be A or B\n");
+        return 1;
+    }
+    return field_set(&cmos_fields[F_FLOPPY_A + d], typestr) != 0;
+}
+
+/* ================================================================
+ * Display: Hard Disk Drives
+ * ================================================================ */
+
+/*
+ * Standard AT BIOS hard disk type table.
+ * The PC1640 BIOS reads CMOS 0x12 to determine drive types.
+ * If the nibble is 0x0F, the extended type register is consulted.
+ * Type 0 = not installed.
+ * The table below covers types 1-14; 15 selects the extended byte.
+ */
+struct hd_type_entry {
+    unsigned short cyls;
+    unsigned char  heads;
+    unsigned short precomp;
+    unsigned short landing;
+    unsigned char  sectors;
+};
+
+static const struct hd_type_entry hd_types[] = {
+    /* type  cyls  hds  precomp  landing  spt */
+    {  306,   4,   128,   305,   17 },  /* 1 - 10MB */
+    {  615,   4,   300,   615,   17 },  /* 2 - 20MB */
+    {  615,   6,   300,   615,   17 },  /* 3 - 30MB */
+    {  940,   8,   512,   940,   17 },  /* 4 - 62MB */
+    {  940,   6,   512,   940,   17 },  /* 5 - 46MB */
+    {  615,   4,    -1,   615,   17 },  /* 6 - 20MB (no precomp) */
+    {  462,   8,   256,   511,   17 },  /* 7 - 30MB */
+    {  733,   5,    -1,   733,   17 },  /* 8 - 30MB */
+    {  900,  15,    -1,   901,   17 },  /* 9 - 112MB */
+    {  820,   3,    -1,   820,   17 },  /* 10 - 20MB */
+    {  855,   5,    -1,   855,   17 },  /* 11 - 35MB */
+    {  855,   7,    -1,   855,   17 },  /* 12 - 49MB */
+    {  306,   8,   128,   319,   17 },  /* 13 - 20MB */
+    {  733,   7,    -1,   733,   17 },  /* 14 - 42MB */
+};
+
+#define HD_NTYPES   (sizeof(hd_types) / sizeof(hd_types[0]))
+
+static unsigned long hd_type_mb(unsigned int type)
+{
+    const struct hd_type_entry *t = &hd_types[type - 1];
+
+    return (unsigned long)t->cyls * t->heads * t->sectors * 512UL /
+           (1024UL * 1024UL);
+}
+
+static void show_harddisk(void)
+{
+    int d;
+
+    out_str("\nHard Disk Configuration:\n");
+    out_reg("  CMOS byte 0x12: ", cmos_get(CMOS_DISK));
+
+    for (d = 0; d < 2; d++) {
+        const struct cmos_field *f = &cmos_fields[F_HD0 + d];
+        unsigned int type = (cmos_get(f->addr) & f->mask) >> f->shift;
+
+        out_str("  Drive ");
+        out_dec(d, 0);
+        out_str(" (");
+        out_char('C' + d);
+        out_str(":): ");
+        if (type == 0) {
+            out_str("Not installed\n");
+        } else if (type == 0x0F) {
+            out_str("Extended type ");
+            out_dec(cmos_get(f->ext), 0);
+            out_str(" (from CMOS ");
+            out_byte(f->ext);
+            out_str(")\n");
+        } else {
+            const struct hd_type_entry *t = &hd_types[type - 1];
+
+            out_str("Type ");
+            out_dec(type, 0);
+            out_str(" - ");
+            out_dec(t->cyls, 0);
+            out_str(" cyl, ");
+            out_dec(t->heads, 0);
+            out_str(" heads, ");
+            out_dec(t->sectors, 0);
+            out_str(" spt (~");
+            out_dec((long)hd_type_mb(type), 0);
+            out_str(" MB)\n");
+        }
+    }
+    out_flush();
+}
+
+static int set_harddisk(const char *drv, const char *typestr)
+{
+    unsigned int type;
+    int d, rc;
+
+    if (drv[0] == '0' || drv[0] == 'C' || drv[0] == 'c') {
+        d = 0;
+    } else if (drv[0] == '1' || drv[0] == 'D' || drv[0] == 'd') {
+        d = 1;
+    } else {
+        fprintf(stderr, "Error: Drive must be 0/C or 1/D\n");
+        return 1;
+    }
+
+    rc = field_set(&cmos_fields[F_HD0 + d], typestr);
+    if (rc >= 0)
+        return rc;
+    fprintf(stderr, "  0  = Not installed\n");
+    for (type = 1; type <= HD_NTYPES; type++)
+        fprintf(stderr, " %2u  = %lu MB (%u cyl, %u heads%s)\n", type,
+                hd_type_mb(type), hd_types[type - 1].cyls,
+                hd_types[type - 1].heads,
+                hd_types[type - 1].precomp == 0xFFFF ? ", no precomp" : "");
+    fprintf(stderr, " 15  = Extended type (uses CMOS 0x19/0x1A)\n");
+    return 1;
+}
+
+/* ================================================================
+ * Display: Equipment Byte
+ * ================================================================ */
+
+static void show_equipment(void)
+{
+    unsigned char equip = cmos_get(CMOS_EQUIP);
+
+    out_reg("\nEquipment Byte (CMOS 0x14): ", equip);
+
+    out_flag("  Bit 0 - Floppy drives:     ",
+             field_get(&cmos_fields[F_EQ_FLOPPY], NULL, NULL) != 0,
+             "Installed", "Not installed");
+    out_flag("  Bit 1 - Math coprocessor:  ",
+             field_get(&cmos_fields[F_EQ_FPU], NULL, NULL) != 0,
+             "8087 installed", "Not installed");
+
+    out_str("  Bits 2-3 (reserved):       0x");
+    out_hex((equip >> 2) & 0x03, 1);
+
+    out_str("\n  Bits 4-5 - Initial video:  ");
+    out_str(field_value_name(&cmos_fields[F_EQ_VIDEO],
+                             field_get(&cmos_fields[F_EQ_VIDEO], NULL, NULL)));
+
+    out_str("\n  Bits 6-7 - Floppy count:   ");
+    out_dec(equip_floppies(), 0);
+    out_str(" drive(s)\n");
+    out_flush();
+}
+
+static int set_equipment(const char *field, const char *valstr)
+{
+    int val = atoi(valstr);
+
+    if (strcmp(field, "fpu") == 0 || strcmp(field, "coprocessor") == 0 ||
+        strcmp(field, "8087") == 0)
+        return field_set(&cmos_fields[F_EQ_FPU], val ? "1" : "0") != 0;
+    if (strcmp(field, "video") == 0)
+        return field_set(&cmos_fields[F_EQ_VIDEO], valstr) != 0;
+    if (strcmp(field, "floppy-count") != 0) {
+        fprintf(stderr, "Unknown equipment field: %s\n", field);
+        fprintf(stderr, "Fields: fpu, video, floppy-count\n");
+        return 1;
+    }
+
+    /* Two fields: bit 0 says any are installed, bits 6-7 count - 1 */
+    if (val < 0 || val > 4) {
+        fprintf(stderr, "Error: Floppy count 0-4\n");
+        return 1;
+    }
+    stage_begin();
+    field_put(&cmos_fields[F_EQ_FLOPPY], NULL, val != 0);
+    field_put(&cmos_fields[F_EQ_DRIVES], NULL, val ? val - 1 : 0);
+    cmos_update_checksum();
+    if (stage_commit() != 0)
+        return 1;
+    printf("Floppy count set to %d\n", val);
+    return 0;
+}
+
+/* ================================================================
+ * Display: Memory
+ * ================================================================ */
+
+static void show_memory(void)
+{
+    long basemem = field_get(&cmos_fields[F_MEM_BASE], NULL, NULL);
+    long extmem = field_get(&cmos_fields[F_MEM_EXT], NULL, NULL);
+
+    out_str("\nMemory Configuration:\n");
+    out_str("  Base memory:     ");
+    out_dec(basemem, 0);
+    out_str(" KB");
+    if (basemem == 640)
+        out_str(" (standard PC1640)");
+    out_str("\n  Extended memory: ");
+    out_dec(extmem, 0);
+    out_str(" KB");
+    if (extmem == 0)
+        out_str(" (normal - 8086 has no extended memory)");
+    out_char('\n');
+    out_flush();
+}
+
+static int set_basemem(const char *valstr)
+{
+    return field_set(&cmos_fields[F_MEM_BASE], valstr) != 0;
+}
+
+/* ================================================================
+ * Display: Diagnostic Status
+ * ================================================================ */
+
+static void show_diagnostics(void)
+{
+    static const char *const diag_bits[8] = {
+        "Timeout reading adapter ROM",
+        "Installed adapters error",
+        "Time invalid",
+        "Hard disk controller init failed",
+        "Memory size mismatch (POST vs CMOS)",
+        "Invalid configuration info",
+        "CMOS checksum bad",
+        "RTC lost power (battery failed during outage)",
+    };
+    unsigned char diag = cmos_get(CMOS_DIAG);
+    unsigned char shut = cmos_get(CMOS_SHUTDOWN);
+    const char *why;
+    int b;
+
+    out_reg("\nDiagnostic Status (CMOS 0x0E): ", diag);
+    for (b = 7; b >= 0; b--) {
+        if (!(diag & (1 << b)))
+            continue;
+        out_str("  Bit ");
+        out_dec(b, 0);
+        out_str(": ");
+        out_str(diag_bits[b]);
+        out_char('\n');
+    }
+    if (diag == 0x00)
+        out_str("  All clear - no errors\n");
+
+    switch (shut) {
+    case 0x00: why = "Normal POST"; break;
+    case 0x01: why = "Chip set init for real mode return"; break;
+    case 0x04: why = "Jump to bootstrap (INT 19h)"; break;
+    case 0x05: why = "User-defined warm boot"; break;
+    case 0x09: why = "Return to real mode (block move)"; break;
+    case 0x0A: why = "Jump to DWORD at 0040:0067"; break;
+    default:   why = NULL; break;
+    }
+    out_str("\nShutdown Status (CMOS 0x0F): ");
+    out_byte(shut);
+    out_str(" - ");
+    if (why) {
+        out_str(why);
+    } else {
+        out_str("Code ");
+        out_byte(shut);
+    }
+    out_char('\n');
+    out_flush();
+}
+
+static void clear_diagnostics(void)
+{
+    cmos_write(CMOS_DIAG, 0x00);
+    printf("Diagnostic status cleared\n");
+}
+
+/* ================================================================
+ * Display: Amstrad-Specific System Status
+ * ================================================================ */
+
+/* Language code table (from BIOS ROM & PCem source) */
+static const char *language_name(unsigned char code)
+{
+    switch (code & 0x07) {
+    case 0: return "Diagnostic mode";
+    case 1: return "Italian";
+    case 2: return "Swedish";
+    case 3: return "Danish";
+    case 4: return "Spanish";
+    case 5: return "French";
+    case 6: return "German";
+    case 7: return "English";
+    default: return "Unknown";
+    }
+}
+
+static const char *display_type_name(unsigned char code)
+{
+    switch (code & 0x03) {
+    case 0: return "EGA (built-in Paradise PEGA)";
+    case 1: return "Unknown (reserved)";
+    case 2: return "CGA";
+    case 3: return "MDA/Hercules";
+    default: return "Unknown";
+    }
+}
+
+static void show_amstrad_language(void)
+{
+    unsigned char lpt_status = am_status(AM_LPT1);
+    unsigned char lang = lpt_status & LPT1_LANG_MASK;
+
+    out_str("\nLanguage Selection (DIP switches -> port 0x379 bits 0-2):\n");
+    out_reg("  LPT1 status byte: ", lpt_status);
+    out_str("  Language code:    ");
+    out_dec(lang, 0);
+    out_str(" - ");
+    out_str(language_name(lang));
+    out_str("\n  Available codes:\n"
+            "    0 = Diagnostic   4 = Spanish\n"
+            "    1 = Italian      5 = French\n"
+            "    2 = Swedish      6 = German\n"
+            "    3 = Danish       7 = English\n");
+    out_flush();
+}
+
+static void show_display_type(void)
+{
+    unsigned char lpt_status = am_status(AM_LPT1);
+    unsigned char disp = (lpt_status & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT;
+    unsigned char ida = inb(PORT_IDA_STATUS);
+
+    out_str("\nDisplay Type Detection:\n");
+    out_str("  LPT1 status bits 6-7: ");
+    out_dec(disp, 0);
+    out_str(" - ");
+    out_str(display_type_name(disp));
+    out_str("\n  IDA status (0x3DE):   ");
+    out_byte(ida);
+    out_str((ida & 0x20) ? " - Internal Display Adapter DISABLED\n"
+                         : " - Internal Display Adapter active\n");
+
+    out_str("  Video mode switch (port 0x3DB bit 6): "
+            "write-only (toggles CGA/EGA)\n");
+    out_flush();
+}
+
+static void show_amstrad_full(void)
+{
+    unsigned char pb, stat2_raw, lpt_status;
+    unsigned char lang, disp;
+
+    out_str("\nAmstrad PC1640 System Status:\n");
+    out_str("------------------------------\n");
+
+    /* PB Register */
+    pb = inb(PORT_PB);
+    out_reg("\n  PB Register (port 0x61): ", pb);
+    out_flag("    Bit 0 - Speaker gate:      ", pb & PB_SPEAKER_GATE, "ON", "off");
+    out_flag("    Bit 1 - Speaker enable:    ", pb & PB_SPEAKER_ENABLE, "ON", "off");
+    out_flag("    Bit 2 - Nibble select:     ", pb & PB_NIBBLE_SEL,
+             "Low nibble", "High nibble");
+    out_flag("    Bit 6 - Keyboard reset:    ", pb & PB_KBD_RESET, "ACTIVE", "inactive");
+    out_flag("    Bit 7 - Port 0x60 mode:    ", pb & PB_STATUS_MODE,
+             "System status", "Keyboard data");
+
+    /* System Status 2 raw + combined */
+    stat2_raw = inb(PORT_STATUS2);
+    out_reg("\n  Port 0x62 raw read: ", stat2_raw);
+    out_flag("    Bit 5 - Speaker output:    ", stat2_raw & 0x20, "HIGH", "low");
+    out_flag("    Bit 6 - NMI status:        ", stat2_raw & 0x40, "ACTIVE", "inactive");
+
+    out_reg("  System Status 2 (combined):  ", am_status(AM_STAT2));
+
+    /* System Status 1 */
+    out_reg("\n  System Status 1 (port 0x60): ", am_status(AM_STAT1));
+    out_str("    (Value = (sysstat1_latch | 0x0D) & 0x7F)\n");
+
+    /* LPT1 status - language + display */
+    lpt_status = am_status(AM_LPT1);
+    lang = lpt_status & LPT1_LANG_MASK;
+    disp = (lpt_status & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT;
+    out_reg("\n  LPT1 Status (port 0x379):    ", lpt_status);
+    out_str("    Bits 0-2 - Language:       ");
+    out_dec(lang, 0);
+    out_str(" (");
+    out_str(language_name(lang));
+    out_str(")\n");
+    out_flag("    Bit 5   - DIP latch:       ", lpt_status & LPT1_DIP_LATCH,
+             "SW10", "SW9/none");
+    out_str("    Bits 6-7 - Display type:   ");
+    out_dec(disp, 0);
+    out_str(" (");
+    out_str(display_type_name(disp));
+    out_str(")\n");
+    out_flush();
+}
+
+#endif /* NVR_CONFIG */
+
+#if NVR_HW
+
+/* ================================================================
+ * Display: Serial & Parallel Ports
+ * ================================================================ */
+
+static int detect_com_port(unsigned short base)
+{
+    unsigned char lcr_orig, test;
+
+    /* Save line control register */
+    lcr_orig = inb(base + 3);
+
+    /* Write test pattern to LCR */
+    outb(0xAA, base + 3);
+    io_delay();
+    test = inb(base + 3);
+
+    /* Restore */
+    outb(lcr_orig, base + 3);
+
+    return (test == 0xAA);
+}
+
+static int detect_lpt_port(unsigned short base)
+{
+    unsigned char orig, test;
+
+    orig = inb(base);
+    outb(0xAA, base);
+    io_delay();
+    test = inb(base);
+    outb(orig, base);
+
+    /* On PC1640, LPT1 at 0x378 reads back with language bits OR'd in */
+    return (test == 0xAA || (base == PORT_LPT1_DATA && (test & 0xF8) == 0xA8));
+}
+
+static void show_ports(void)
+{
+    out_str("\nSerial & Parallel Ports:\n");
+    out_flag("  COM1 (0x3F8): ", detect_com_port(PORT_COM1_BASE),
+             "Detected (IRQ 4)", "Not found");
+    out_flag("  COM2 (0x2F8): ", detect_com_port(PORT_COM2_BASE),
+             "Detected (IRQ 3)", "Not found");
+    out_flag("  LPT1 (0x378): ", detect_lpt_port(PORT_LPT1_DATA),
+             "Detected (Amstrad-overloaded)", "Not found");
+    out_flag("  LPT2 (0x3BC): ", detect_lpt_port(PORT_LPT2_DATA),
+             "Detected", "Not found");
+    out_flush();
+}
+
+#endif /* NVR_HW */
+
+#if NVR_MOUSE
+
+/* ================================================================
+ * Display: Amstrad Mouse Port
+ * ================================================================ */
+
+static void show_mouse(void)
+{
+    unsigned char mx, my;
+
+    out_str("\nAmstrad Mouse Port:\n"
+            "  Type: Amstrad proprietary (NOT serial/PS2)\n"
+            "  X counter port: 0x78 (read=position, write=reset)\n"
+            "  Y counter port: 0x7A (read=position, write=reset)\n"
+            "  Buttons: via keyboard scancodes:\n"
+            "    Left press:  0x7E   Left release:  0xFE\n"
+            "    Right press: 0x7D   Right release: 0xFD\n");
+
+    mx = inb(PORT_MOUSE_X);
+    my = inb(PORT_MOUSE_Y);
+    out_str("\n  Current X counter: ");
+    out_dec((signed char)mx, 0);
+    out_str(" (");
+    out_byte(mx);
+    out_str(")\n  Current Y counter: ");
+    out_dec((signed char)my, 0);
+    out_str(" (");
+    out_byte(my);
+    out_str(")\n");
+    out_flush();
+}
+
+static void mouse_reset(void)
+{
+    outb(0, PORT_MOUSE_X);
+    outb(0, PORT_MOUSE_Y);
+    printf("Mouse counters reset to 0\n");
+}
+
+static void mouse_test(void)
+{
+    unsigned char mx2, my2;
+    int i;
+
+    printf("\nMouse Movement Test (5 seconds):\n");
+    printf("  Move the mouse to see counter changes...\n\n");
+
+    /* Reset counters */
+    outb(0, PORT_MOUSE_X);
+    outb(0, PORT_MOUSE_Y);
+
+    for (i = 0; i < 50; i++) {
+        unsigned char mx, my;
+        mx = inb(PORT_MOUSE_X);
+        my = inb(PORT_MOUSE_Y);
+        if (mx != 0 || my != 0) {
+            printf("  X: %4d  Y: %4d\r", (signed char)mx, (signed char)my);
+        }
+        delay_ms(100);
+    }
+    mx2 = inb(PORT_MOUSE_X);
+    my2 = inb(PORT_MOUSE_Y);
+    printf("\n  Final: X=%d Y=%d\n", (signed char)mx2, (signed char)my2);
+    if (mx2 == 0 && my2 == 0)
+        printf("  No movement detected - mouse may not be connected\n");
+    else
+        printf("  Mouse is responding\n");
+}
+
+/*
+ * "nvr mouse-sample" polls the counters on a fixed schedule timed by
+ * PIT channel 2 (spinning, not sleeping: a scheduler tick is 10 ms).
+ * Each poll takes the 8-bit X/Y counters and the keyboard data latch
+ * for the 0x7E/0xFE/0x7D/0xFD button codes.  Counter deltas are taken
+ * mod 256 and accumulated into longs, so wraps between polls are
+ * harmless as long as the mouse moves less than 127 counts per poll;
+ * polls with a delta of MS_WRAP_RISK or more are counted as suspect.
+ *
+ * Movement and button events go into a fixed single-producer,
+ * single-consumer ring (head owned by the sampler, tail by the
+ * reporter), so no locking is needed and a full ring only drops and
+ * counts events.  The ring is drained after the run: printing during
+ * it would stall the poll loop.
+ *
+ * Time is kept in PIT ticks by summing successive channel 2 deltas;
+ * a gap longer than one 16-bit wrap (55 ms, e.g. being scheduled out)
+ * is under-measured, but shows up as missed slots nonetheless.
+ */
+#define MS_RING         512     /* event slots, power of two */
+#define MS_DEFAULT_HZ   500
+#define MS_MAX_HZ       2000
+#define MS_MAX_SECONDS  60
+#define MS_WRAP_RISK    64
+
+#define KBD_MOUSE_LEFT      0x7E    /* release = code | 0x80 */
+#define KBD_MOUSE_RIGHT     0x7D
+
+enum { MS_MOVE, MS_BUTTON };
+
+struct ms_event {
+    unsigned long t;            /* PIT ticks since sampling started */
+    signed char dx, dy;
+    unsigned char type, code;
+};
+
+static struct ms_event ms_ring[MS_RING];
+static unsigned int ms_head = 0, ms_tail = 0;
+static unsigned long ms_dropped = 0;
+
+static void ms_push(unsigned long t, unsigned char type, unsigned char code,
+                    int dx, int dy)
+{
+    struct ms_event *e;
+
+    if (((ms_head - ms_tail) & (MS_RING - 1)) == MS_RING - 1) {
+        ms_dropped++;
+        return;
+    }
+    e = &ms_ring[ms_head];
+    e->t = t;
+    e->type = type;
+    e->code = code;
+    e->dx = (signed char)dx;
+    e->dy = (signed char)dy;
+    ms_head = (ms_head + 1) & (MS_RING - 1);
+}
+
+static const struct ms_event *ms_pop(void)
+{
+    const struct ms_event *e;
+
+    if (ms_tail == ms_head)
+        return NULL;
+    e = &ms_ring[ms_tail];
+    ms_tail = (ms_tail + 1) & (MS_RING - 1);
+    return e;
+}
+
+static void ms_out_us(const char *label, unsigned long ticks)
+{
+    out_str(label);
+    out_dec((long)pit_ticks_us(ticks), 0);
+    out_str(" us");
+}
+
+static int mouse_sample(const char *unused, int argc, char *argv[])
+{
+    unsigned long now = 0, due = 0, end, period, prev = 0, ms;
+    unsigned long polls = 0, missed = 0, late_sum = 0, late_max = 0;
+    unsigned long gap_min = 0xFFFFFFFFUL, gap_max = 0, suspect = 0;
+    unsigned long presses[2] = { 0, 0 }, releases[2] = { 0, 0 };
+    long x = 0, y = 0, xmin = 0, xmax = 0, ymin = 0, ymax = 0;
+    unsigned int hz = MS_DEFAULT_HZ, seconds = 5;
+    unsigned short cnt, last;
+    unsigned char lx, ly, lk;
+    int i, timeline = 0, dmax = 0;
+    const struct ms_event *e;
+
+    (void)unused;
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = (unsigned int)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            hz = (unsigned int)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-v") == 0) {
+            timeline = 1;
+        } else {
+            fprintf(stderr, "Unknown mouse-sample option: %s\n", argv[i]);
+            fprintf(stderr, "Options: -t SECONDS, -r HZ, -v (event timeline)\n");
+            return 1;
+        }
+    }
+    if (seconds < 1 || seconds > MS_MAX_SECONDS || hz < 10 || hz > MS_MAX_HZ) {
+        fprintf(stderr, "Error: -t must be 1-%d seconds, -r 10-%d Hz\n",
+                MS_MAX_SECONDS, MS_MAX_HZ);
+        return 1;
+    }
+
+    printf("\nMouse Sampler (%u s at %u Hz):\n", seconds, hz);
+    printf("  Move the mouse and click both buttons...\n");
+    fflush(stdout);
+
+    period = PIT_HZ / hz;
+    end = (unsigned long)seconds * PIT_HZ;
+    ms_head = ms_tail = 0;
+    ms_dropped = 0;
+
+    pit2_start();
+    last = pit2_read();
+    lx = inb(PORT_MOUSE_X);
+    ly = inb(PORT_MOUSE_Y);
+    lk = inb(PORT_KBD_DATA);
+
+    while (now < end) {
+        unsigned char mx, my, k;
+        int dx, dy;
+
+        cnt = pit2_read();
+        now += (unsigned short)(last - cnt);
+        last = cnt;
+        if (now < due)
+            continue;
+
+        mx = inb(PORT_MOUSE_X);
+        my = inb(PORT_MOUSE_Y);
+        k = inb(PORT_KBD_DATA);
+
+        /* Schedule bookkeeping: lateness against the slot, missed slots */
+        if (now - due > late_max)
+            late_max = now - due;
+        late_sum += now - due;
+        missed += (now - due) / period;
+        due += period * ((now - due) / period + 1);
+        if (polls) {
+            if (now - prev < gap_min)
+                gap_min = now - prev;
+            if (now - prev > gap_max)
+                gap_max = now - prev;
+        }
+        prev = now;
+        polls++;
+
+        dx = (signed char)(mx - lx);
+        dy = (signed char)(my - ly);
+        lx = mx;
+        ly = my;
+        if (dx || dy) {
+            int adx = dx < 0 ? -dx : dx, ady = dy < 0 ? -dy : dy;
+
+            x += dx;
+            y += dy;
+            if (x < xmin) xmin = x;
+            if (x > xmax) xmax = x;
+            if (y < ymin) ymin = y;
+            if (y > ymax) ymax = y;
+            if (adx > dmax) dmax = adx;
+            if (ady > dmax) dmax = ady;
+            if (adx >= MS_WRAP_RISK || ady >= MS_WRAP_RISK)
+                suspect++;
+            ms_push(now, MS_MOVE, 0, dx, dy);
+        }
+        if (k != lk) {
+            lk = k;
+            if ((k & 0x7F) == KBD_MOUSE_LEFT || (k & 0x7F) == KBD_MOUSE_RIGHT) {
+                int b = (k & 0x7F) == KBD_MOUSE_RIGHT;
+                if (k & 0x80)
+                    releases[b]++;
+                else
+                    presses[b]++;
+                ms_push(now, MS_BUTTON, k, 0, 0);
+            }
+        }
+    }
+
+    if (timeline) {
+        out_str("\n  Time (ms)   Event\n");
+        while ((e = ms_pop()) != NULL) {
+            unsigned long us = pit_ticks_us(e->t);
+
+            out_str("  ");
+            out_dec_pad((long)(us / 1000), 6, ' ');
+            out_char('.');
+            out_dec_pad((long)(us % 1000), 3, '0');
+            if (e->type == MS_MOVE) {
+                out_str("  move   dx=");
+                out_dec(e->dx, 4);
+                out_str(" dy=");
+                out_dec(e->dy, 4);
+            } else {
+                out_str((e->code & 0x7F) == KBD_MOUSE_LEFT ? "  left   " : "  right  ");
+                out_str((e->code & 0x80) ? "release" : "press");
+            }
+            out_char('\n');
+        }
+    }
+
+    out_str("\n  Polls:            ");
+    out_dec((long)polls, 0);
+    out_str(" (");
+    ms = pit_ticks_us(now) / 1000;
+    out_dec(ms ? (long)(polls * 1000UL / ms) : 0, 0);
+    out_str(" Hz achieved)\n");
+    ms_out_us("  Poll interval:    min ", polls > 1 ? gap_min : 0);
+    ms_out_us(", max ", gap_max);
+    out_char('\n');
+    ms_out_us("  Poll latency:     avg ", polls ? late_sum / polls : 0);
+    ms_out_us(", max ", late_max);
+    out_char('\n');
+    out_str("  Missed slots:     ");
+    out_dec((long)missed, 0);
+    out_str("\n  Position:         X ");
+    out_dec(x, 0);
+    out_str(" (");
+    out_dec(xmin, 0);
+    out_str("..");
+    out_dec(xmax, 0);
+    out_str("), Y ");
+    out_dec(y, 0);
+    out_str(" (");
+    out_dec(ymin, 0);
+    out_str("..");
+    out_dec(ymax, 0);
+    out_str(")\n  Largest step:     ");
+    out_dec(dmax, 0);
+    out_str(" counts/poll");
+    if (suspect) {
+        out_str(", ");
+        out_dec((long)suspect, 0);
+        out_str(" poll(s) >= ");
+        out_dec(MS_WRAP_RISK, 0);
+        out_str(" (possible wrap: raise -r)");
+    }
+    out_str("\n  Buttons:          left ");
+    out_dec((long)presses[0], 0);
+    out_char('/');
+    out_dec((long)releases[0], 0);
+    out_str(", right ");
+    out_dec((long)presses[1], 0);
+    out_char('/');
+    out_dec((long)releases[1], 0);
+    out_str(" (press/release)\n  Events dropped:   ");
+    out_dec((long)ms_dropped, 0);
+    out_char('\n');
+    out_flush();
+    return 0;
+}
+
+#endif /* NVR_MOUSE */
+
+#if NVR_SOUND
+
+/* ================================================================
+ * Speaker / Tone Sequencer
+ * ================================================================ */
+
+/*
+ * A tune is an array of (divisor, duration) pairs played by one call
+ * to tone_play().  Channel 2 is put into square-wave mode once and the
+ * gate stays open for the whole tune: between notes only the count is
+ * reloaded, which the 8253 picks up at the end of the current half
+ * cycle, so there is no click.  A rest (divisor 0) just mutes the
+ * amplifier.  Durations are spun on the calibrated loop rate rather
+ * than slept, since a scheduler tick would make them uneven.
+ */
+#define PIT_CH2_SQUARE  0xB6    /* channel 2, lobyte/hibyte, mode 3 */
+#define PLAY_MAX        64      /* notes per play command */
+#define PLAY_DEFAULT_MS 200
+#define PLAY_MAX_MS     5000
+
+/* Channel 2 divisor for a frequency in mHz, for compile-time tables */
+#define TONE_DIV(mhz)   ((unsigned short)((PIT_HZ * 1000UL + (mhz) / 2) / (mhz)))
+
+struct tone {
+    unsigned short div;         /* PIT divisor, 0 = rest */
+    unsigned short ms;
+};
+
+/* Octave 1, C to B: higher octaves halve these (C1-B8 fit 16 bits) */
+static const unsigned short note_div1[12] = {
+    TONE_DIV(32703), TONE_DIV(34648), TONE_DIV(36708), TONE_DIV(38891),
+    TONE_DIV(41203), TONE_DIV(43654), TONE_DIV(46249), TONE_DIV(48999),
+    TONE_DIV(51913), TONE_DIV(55000), TONE_DIV(58270), TONE_DIV(61735),
+};
+
+static unsigned short note_div(int semi, int octave)
+{
+    int sh = octave - 1;
+
+    if (sh == 0)
+        return note_div1[semi];
+    return (note_div1[semi] + (1U << (sh - 1))) >> sh;
+}
+
+static void tone_play(const struct tone *t, int n)
+{
+    unsigned short div = 0;
+    unsigned char pb;
+    int on = 0, i;
+
+    /* Channel 2 is about to be busy with the tune */
+    if (!loops_per_ms)
+        timer_calibrate();
+
+    pb = inb(PORT_PB) & ~(PB_SPEAKER_GATE | PB_SPEAKER_ENABLE);
+    outb(pb | PB_SPEAKER_GATE, PORT_PB);
+    outb(PIT_CH2_SQUARE, PORT_PIT_MODE);
+
+    for (; n > 0; n--, t++) {
+        if (t->div) {
+            if (t->div != div) {
+                div = t->div;
+                io_delay();
+                outb(div & 0xFF, PORT_PIT_CH2);
+                io_delay();
+                outb(div >> 8, PORT_PIT_CH2);
+            }
+            if (!on)
+                outb(pb | PB_SPEAKER_GATE | PB_SPEAKER_ENABLE, PORT_PB);
+            on = 1;
+        } else if (on) {
+            outb(pb | PB_SPEAKER_GATE, PORT_PB);
+            on = 0;
+        }
+        for (i = 0; i < t->ms; i++)
+            spin_loops(loops_per_ms);
+    }
+    outb(pb, PORT_PB);
+}
+
+static void speaker_test(void)
+{
+    static const struct tone test[] = {
+        { TONE_DIV(440000UL), 500 }, { 0, 100 },
+        { TONE_DIV(880000UL), 500 }, { 0, 100 },
+        { TONE_DIV(1000000UL), 500 }, { 0, 100 },
+        { TONE_DIV(2000000UL), 500 },
+    };
+
+    printf("Speaker test: 440 Hz (A4), 880 Hz (A5), 1000 Hz, 2000 Hz...\n");
+    fflush(stdout);
+    tone_play(test, sizeof(test) / sizeof(test[0]));
+    printf("  Done.\n");
+}
+
+static int speaker_beep(const char *freqstr)
+{
+    struct tone t;
+    int freq = atoi(freqstr);
+
+    if (freq < 20 || freq > 20000) {
+        fprintf(stderr, "Error: Frequency must be 20-20000 Hz\n");
+        return 1;
+    }
+
+    printf("Beep at %d Hz...\n", freq);
+    fflush(stdout);
+    t.div = (unsigned short)(PIT_HZ / (unsigned long)freq);
+    t.ms = 500;
+    tone_play(&t, 1);
+    return 0;
+}
+
+static int tone_sep(char c)
+{
+    return c == ' ' || c == '\t' || c == ',';
+}
+
+/*
+ * Decode one note, s up to end: NAME[:MS] where NAME is C4, F#3, Bb5
+ * (octaves 1-8), a frequency in Hz (20-20000) or R for a rest.
+ */
+static int tone_note(const char *s, const char *end, struct tone *t)
+{
+    static const signed char semis[7] = { 9, 11, 0, 2, 4, 5, 7 };  /* A-G */
+    char *p;
+    long v;
+    int semi, octave;
+
+    t->div = 0;
+    if (*s == 'R' || *s == 'r') {
+        s++;
+    } else if (*s >= '0' && *s <= '9') {
+        v = strtol(s, &p, 10);
+        if (v < 20 || v > 20000)
+            return 1;
+        t->div = (unsigned short)(PIT_HZ / (unsigned long)v);
+        s = p;
+    } else {
+        char c = *s & ~0x20;
+        if (c < 'A' || c > 'G')
+            return 1;
+        semi = semis[c - 'A'];
+        if (*++s == '#')
+            semi++, s++;
+        else if (*s == 'b')
+            semi--, s++;
+        if (*s < '1' || *s > '8')
+            return 1;
+        octave = *s++ - '0';
+        if (semi < 0)
+            semi += 12, octave--;
+        else if (semi > 11)
+            semi -= 12, octave++;
+        if (octave < 1 || octave > 8)
+            return 1;
+        t->div = note_div(semi, octave);
+    }
+
+    v = PLAY_DEFAULT_MS;
+    if (*s == ':') {
+        v = strtol(s + 1, &p, 10);
+        if (p == s + 1)
+            return 1;
+        s = p;
+    }
+    if (s != end || v < 1 || v > PLAY_MAX_MS)
+        return 1;
+    t->ms = (unsigned short)v;
+    return 0;
+}
+
+/* Append the notes in s, separated by spaces or commas, to seq */
+static int tone_parse(const char *s, struct tone *seq, int *n)
+{
+    const char *end;
+
+    while (*s) {
+        if (tone_sep(*s)) {
+            s++;
+            continue;
+        }
+        for (end = s; *end && !tone_sep(*end); end++)
+            ;
+        if (*n == PLAY_MAX) {
+            fprintf(stderr, "Error: at most %d notes\n", PLAY_MAX);
+            return 1;
+        }
+        if (tone_note(s, end, &seq[*n]) != 0) {
+            fprintf(stderr, "Error: bad note \"%.*s\" (e.g. C4:100, F#3,"
+                    " 440:50, R:100; 1-%d ms)\n", (int)(end - s), s, PLAY_MAX_MS);
+            return 1;
+        }
+        (*n)++;
+        s = end;
+    }
+    return 0;
+}
+
+/* "nvr play NOTES...": every argument may hold several notes */
+static int play_cmd(const char *notes, int argc, char *argv[])
+{
+    static struct tone seq[PLAY_MAX];
+    unsigned long total = 0;
+    int n = 0, i;
+
+    if (tone_parse(notes, seq, &n) != 0)
+        return 1;
+    for (i = 0; i < argc; i++)
+        if (tone_parse(argv[i], seq, &n) != 0)
+            return 1;
+    if (n == 0) {
+        fprintf(stderr, "Error: no notes given\n");
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+        total += seq[i].ms;
+
+    printf("Playing %d note(s), %lu ms...\n", n, total);
+    fflush(stdout);
+    tone_play(seq, n);
+    return 0;
+}
+
+#endif /* NVR_SOUND */
+
+#if NVR_HW
+
+/* ================================================================
+ * PIC (Interrupt Controller) Status
+ * ================================================================ */
+
+static void show_pic(void)
+{
+    static const char *const irq_use[8] = {
+        "Timer (8253 CH0, 18.2 Hz)",
+        "Keyboard + RTC alarm (Amstrad!)",
+        "Reserved",
+        "COM2 (serial port 2)",
+        "COM1 (serial port 1)",
+        "LPT2 (parallel port 2)",
+        "Floppy disk controller",
+        "LPT1 (parallel port 1)"
+    };
+    unsigned char imr, isr, irr;
+    int irq;
+
+    out_str("\n8259A PIC Status:\n");
+
+    /* Read IMR (Interrupt Mask Register) */
+    imr = inb(PORT_PIC_DATA);
+
+    /* Read IRR (Interrupt Request Register) via OCW3 */
+    outb(0x0A, PORT_PIC_CMD);  /* OCW3: read IRR */
+    io_delay();
+    irr = inb(PORT_PIC_CMD);
+
+    /* Read ISR (In-Service Register) via OCW3 */
+    outb(0x0B, PORT_PIC_CMD);  /* OCW3: read ISR */
+    io_delay();
+    isr = inb(PORT_PIC_CMD);
+
+    out_reg("  IMR (Interrupt Mask):     ", imr);
+    out_reg("  IRR (Interrupt Request):  ", irr);
+    out_reg("  ISR (In-Service):         ", isr);
+    out_str("\n"
+            "  IRQ  Mask  Req  Svc  Function (PC1640)\n"
+            "  ---  ----  ---  ---  -----------------\n");
+    for (irq = 0; irq < 8; irq++) {
+        unsigned char bit = 1 << irq;
+
+        out_str("   ");
+        out_dec(irq, 0);
+        out_str("    ");
+        out_char((imr & bit) ? 'M' : '.');
+        out_str("     ");
+        out_char((irr & bit) ? 'R' : '.');
+        out_str("    ");
+        out_char((isr & bit) ? 'S' : '.');
+        out_str("   ");
+        out_str(irq_use[irq]);
+        out_char('\n');
+    }
+
+    out_str("\n  Legend: M=Masked  R=Request pending  S=In service\n"
+            "  Note: PC1640 has single PIC (no secondary - 8086 system)\n"
+            "  Note: RTC alarm routes to IRQ 1 (shared with keyboard)\n");
+    out_flush();
+}
+
+/* ================================================================
+ * DMA Controller Status
+ * ================================================================ */
+
+static void show_dma(void)
+{
+    static const char *const ch_use[4] = {
+        "DRAM refresh", "Available", "Floppy disk", "Available"
+    };
+    unsigned char status;
+    int ch;
+
+    out_str("\n8237A DMA Controller Status:\n");
+
+    status = inb(PORT_DMA_STAT);
+
+    out_reg("  Status register (port 0x08): ", status);
+    for (ch = 0; ch < 4; ch++) {
+        out_str("    Ch");
+        out_dec(ch, 0);
+        out_str(": TC=");
+        out_char((status & (0x01 << ch)) ? 'Y' : 'N');
+        out_str("  Req=");
+        out_char((status & (0x10 << ch)) ? 'Y' : 'N');
+        out_str("  (");
+        out_str(ch_use[ch]);
+        out_str(")\n");
+    }
+
+    out_str("  TC = Terminal Count reached\n"
+            "  Page registers: ch1=0x83  ch2=0x81  ch3=0x82\n");
+    out_flush();
+}
+
+/* ================================================================
+ * PIT (Timer) Status
+ * ================================================================ */
+
+static void show_pit(void)
+{
+    unsigned short count;
+    unsigned char pb;
+
+    out_str("\n8253 PIT (Programmable Interval Timer):\n");
+    out_str("  Base frequency: 1,193,182 Hz\n");
+
+    count = pit2_read();
+
+    out_str("  Channel 0: System timer (IRQ 0, ~18.2 Hz tick)\n");
+    out_str("  Channel 1: DRAM refresh (hidden)\n");
+    out_str("  Channel 2: Speaker tone generator\n");
+    out_str("    Current count: ");
+    out_dec(count, 0);
+    out_str(" (0x");
+    out_hex(count, 4);
+    out_str(")\n");
+    if (count > 0) {
+        out_str("    Frequency: ~");
+        out_dec((long)(1193182UL / (unsigned long)count), 0);
+        out_str(" Hz\n");
+    }
+
+    pb = inb(PORT_PB);
+    out_flag("    Speaker gate (PB.0): ", pb & PB_SPEAKER_GATE, "ON", "off");
+    out_flag("    Speaker enable (PB.1): ", pb & PB_SPEAKER_ENABLE, "ON", "off");
+    out_flush();
+}
+
+#endif /* NVR_HW */
+
+/* ================================================================
+ * Full CMOS Dump
+ * ================================================================ */
+
+static void dump_cmos(void)
+{
+    int i;
+    const unsigned char *data = cmos_image;
+
+    cmos_snapshot();
+
+    out_str("\nCMOS RAM Dump (64 bytes):\n"
+            "       00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F\n"
+            "       -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- --\n");
+
+    for (i = 0; i < CMOS_SIZE; i++) {
+        if ((i % 16) == 0) {
+            out_str("  ");
+            out_hex(i, 2);
+            out_str(":  ");
+        }
+        out_hex(data[i], 2);
+        out_char(' ');
+        if ((i % 16) == 15)
+            out_char('\n');
+    }
+
+    out_str("\n  Regions:\n"
+            "    0x00-0x09: RTC time/date registers\n"
+            "    0x0A-0x0D: RTC status registers (A-D)\n"
+            "    0x0E:      Diagnostic status\n"
+            "    0x0F:      Shutdown status\n"
+            "    0x10:      Floppy drive types\n"
+            "    0x12:      Hard disk types\n"
+            "    0x14:      Equipment byte\n"
+            "    0x15-0x16: Base memory (KB)\n"
+            "    0x17-0x18: Extended memory (KB)\n"
+            "    0x19-0x1A: HD extended types\n"
+            "    0x2E-0x2F: Checksum\n"
+            "    0x32:      Century (BCD)\n");
+
+    out_str("\n  Checksum (0x10-0x2D): ");
+    out_str(cmos_verify_checksum() ? "VALID\n" : "*** INVALID ***\n");
+    out_flush();
+}
+
+/* ================================================================
+ * CMOS Image Files
+ * ================================================================ */
+
+/*
+ * Two on-disk formats are understood:
+ *
+ *   raw     the bare 64-byte CMOS image (128-byte AT dumps accepted,
+ *           only the first 64 bytes are used)
+ *
+ *   NVRI    a stream of records, each a 40-byte header followed by the
+ *           64 data bytes.  Records can be appended, so one file holds
+ *           the history of a machine.  All fields are little-endian:
+ *
+ *     0   4  magic "NVRI"
+ *     4   1  version (1)
+ *     5   1  header length (40)
+ *     6   1  data length (64)
+ *     7   1  flags (reserved, 0)
+ *     8   4  timestamp (seconds since 1970, UTC)
+ *    12   8  valid-byte mask, bit n = CMOS byte n present
+ *    20  16  machine tag, NUL padded
+ *    36   2  reserved (0)
+ *    38   2  CRC-16/CCITT of header bytes 0-37 and the data
+ *
+ * Images are always decoded and CRC-checked before any port is touched.
+ */
+#define IMG_MAGIC       "NVRI"
+#define IMG_VERSION     1
+#define IMG_HDR_SIZE    40
+#define IMG_TAG_LEN     16
+#define IMG_REC_SIZE    (IMG_HDR_SIZE + CMOS_SIZE)
+
+struct nvr_image {
+    unsigned long time;
+    unsigned char mask[CMOS_SIZE / 8];
+    char          tag[IMG_TAG_LEN + 1];
+    unsigned char data[CMOS_SIZE];
+    int           structured;           /* 0 = raw blob */
+};
+
+static unsigned short crc16(unsigned short crc, const unsigned char *p, int n)
+{
+    int b;
+
+    while (n-- > 0) {
+        crc ^= (unsigned short)*p++ << 8;
+        for (b = 0; b < 8; b++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
+static unsigned short img_crc(const unsigned char *rec)
+{
+    unsigned short crc = crc16(0xFFFF, rec, IMG_HDR_SIZE - 2);
+    return crc16(crc, rec + IMG_HDR_SIZE, CMOS_SIZE);
+}
+
+static void img_encode(const struct nvr_image *img, unsigned char *rec)
+{
+    unsigned short crc;
+    int i;
+
+    memset(rec, 0, IMG_REC_SIZE);
+    memcpy(rec, IMG_MAGIC, 4);
+    rec[4] = IMG_VERSION;
+    rec[5] = IMG_HDR_SIZE;
+    rec[6] = CMOS_SIZE;
+    for (i = 0; i < 4; i++)
+        rec[8 + i] = (img->time >> (8 * i)) & 0xFF;
+    memcpy(rec + 12, img->mask, sizeof(img->mask));
+    memcpy(rec + 20, img->tag, strlen(img->tag));   /* tag <= IMG_TAG_LEN */
+    memcpy(rec + IMG_HDR_SIZE, img->data, CMOS_SIZE);
+    crc = img_crc(rec);
+    rec[38] = crc & 0xFF;
+    rec[39] = crc >> 8;
+}
+
+/* Returns 0, or an error message for a bad record */
+static const char *img_decode(const unsigned char *rec, struct nvr_image *img)
+{
+    int i;
+
+    if (memcmp(rec, IMG_MAGIC, 4) != 0)
+        return "bad magic";
+    if (rec[4] != IMG_VERSION || rec[5] != IMG_HDR_SIZE || rec[6] != CMOS_SIZE)
+        return "unsupported version";
+    if (img_crc(rec) != (rec[38] | ((unsigned short)rec[39] << 8)))
+        return "CRC mismatch (corrupt image)";
+
+    img->time = 0;
+    for (i = 3; i >= 0; i--)
+        img->time = (img->time << 8) | rec[8 + i];
+    memcpy(img->mask, rec + 12, sizeof(img->mask));
+    memcpy(img->tag, rec + 20, IMG_TAG_LEN);
+    img->tag[IMG_TAG_LEN] = '\0';
+    memcpy(img->data, rec + IMG_HDR_SIZE, CMOS_SIZE);
+    img->structured = 1;
+    return 0;
+}
+
+/*
+ * Read record number 'record' (0-based, -1 = last) from an NVRI file,
+ * or the whole of a raw file.  Prints its own errors; returns 0 on
+ * success.
+ */
+static int image_read(const char *filename, int record, struct nvr_image *img)
+{
+    FILE *fp;
+    unsigned char rec[IMG_REC_SIZE];
+    const char *err;
+    long fsize;
+    int n;
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        perror("Error opening file");
+        return 1;
+    }
+
+    n = fread((char *)rec, 1, IMG_REC_SIZE, fp);
+    if (n >= 4 && memcmp(rec, IMG_MAGIC, 4) == 0) {
+        int idx = 0, found = 0;
+        unsigned char want[IMG_REC_SIZE];
+
+        for (;;) {
+            if (n != IMG_REC_SIZE) {
+                if (n != 0)
+                    fprintf(stderr, "%s: truncated record %d\n", filename, idx);
+                break;
+            }
+            if (record < 0 || idx == record) {
+                memcpy(want, rec, IMG_REC_SIZE);
+                found = 1;
+                if (record >= 0)
+                    break;
+            }
+            idx++;
+            n = fread((char *)rec, 1, IMG_REC_SIZE, fp);
+        }
+        fclose(fp);
+        if (!found) {
+            fprintf(stderr, "%s: no record %d (%d present)\n",
+                    filename, record, idx);
+            return 1;
+        }
+        err = img_decode(want, img);
+        if (err) {
+            fprintf(stderr, "%s: %s\n", filename, err);
+            return 1;
+        }
+        DBG(1, "%s: record %d, tag '%s', time %lu\n",
+            filename, record < 0 ? idx - 1 : record, img->tag, img->time);
+        return 0;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    fsize = ftell(fp);
+    fclose(fp);
+    if (fsize != CMOS_SIZE && fsize != 128) {
+        fprintf(stderr, "Error: File size %ld, expected %d or 128\n",
+                fsize, CMOS_SIZE);
+        return 1;
+    }
+    if (record > 0) {
+        fprintf(stderr, "%s: raw image has only record 0\n", filename);
+        return 1;
+    }
+    memcpy(img->data, rec, CMOS_SIZE);
+    memset(img->mask, 0xFF, sizeof(img->mask));
+    img->tag[0] = '\0';
+    img->time = 0;
+    img->structured = 0;
+    return 0;
+}
+
+/* Write (or append) one NVRI record */
+static int image_write(const char *filename, const struct nvr_image *img,
+                       int append)
+{
+    FILE *fp;
+    unsigned char rec[IMG_REC_SIZE];
+
+    img_encode(img, rec);
+    fp = fopen(filename, append ? "ab" : "wb");
+    if (!fp) {
+        perror("Error opening file for writing");
+        return 1;
+    }
+    if (fwrite((const char *)rec, 1, IMG_REC_SIZE, fp) != IMG_REC_SIZE) {
+        perror("Error writing CMOS image");
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Parse the "-r N" record selector shared by load and compare */
+static int image_record_opt(int *i, int argc, char *argv[], int *record)
+{
+    if (strcmp(argv[*i], "-r") != 0 && strcmp(argv[*i], "--record") != 0)
+        return 0;
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Error: %s needs a record number\n", argv[*i]);
+        return -1;
+    }
+    *record = atoi(argv[++*i]);
+    return 1;
+}
+
+/* List the records in an image file */
+static int image_info(const char *filename)
+{
+    FILE *fp;
+    unsigned char rec[IMG_REC_SIZE];
+    struct nvr_image img;
+    int idx = 0;
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        perror("Error opening file");
+        return 1;
+    }
+    if (fread((char *)rec, 1, IMG_REC_SIZE, fp) < 4 ||
+        memcmp(rec, IMG_MAGIC, 4) != 0) {
+        fclose(fp);
+        printf("%s: raw CMOS image (no header)\n", filename);
+        return 0;
+    }
+
+    printf("%s: NVRI image file\n", filename);
+    printf("  Rec  Saved (UTC)          Tag               Bytes  Status\n");
+    printf("  ---  -------------------  ----------------  -----  ------\n");
+    do {
+        const char *err = img_decode(rec, &img);
+        if (err) {
+            printf("  %3d  %-19s  %-16s  %5s  %s\n", idx, "-", "-", "-", err);
+        } else {
+            time_t t = (time_t)img.time;
+            struct tm *tm = gmtime(&t);
+            int i, nbytes = 0;
+
+            for (i = 0; i < CMOS_SIZE; i++)
+                if (BIT_TEST(img.mask, i))
+                    nbytes++;
+            printf("  %3d  %04d-%02d-%02d %02d:%02d:%02d  %-16s  %5d  ok\n",
+                   idx, tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+                   tm->tm_hour, tm->tm_min, tm->tm_sec, img.tag, nbytes);
+        }
+        idx++;
+    } while (fread((char *)rec, 1, IMG_REC_SIZE, fp) == IMG_REC_SIZE);
+    fclose(fp);
+    return 0;
+}
+
+/* ================================================================
+ * CMOS Compare: show differences between two dumps
+ * ================================================================ */
+
+/*
+ * Names for the clock and status bytes, which are not configuration
+ * fields; every other byte is described by the fields that cover it.
+ */
+static const char *const cmos_reg_names[RTC_REG_D + 1] = {
+    "Seconds", "Alarm seconds", "Minutes", "Alarm minutes", "Hours",
+    "Alarm hours", "Day of week", "Day of month", "Month", "Year",
+    "Register A", "Register B", "Register C (flags)", "Register D (battery)"
+};
+
+static int compare_cmos(const char *filename, int argc, char *argv[])
+{
+    struct nvr_image img;
+    const unsigned char *file_data = img.data;
+    const unsigned char *live_data;
+    unsigned long shown = 0;            /* one bit per cmos_fields[] row */
+    unsigned int j;
+    int i, diffs = 0, record = -1;
+
+    for (i = 0; i < argc; i++) {
+        int r = image_record_opt(&i, argc, argv, &record);
+        if (r < 0)
+            return 1;
+        if (r == 0) {
+            fprintf(stderr, "Unknown compare option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (image_read(filename, record, &img) != 0)
+        return 1;
+
+    cmos_snapshot();
+    live_data = cmos_image;
+
+    out_str("\nCMOS Compare: live vs ");
+    out_str(filename);
+    out_str("\n  Addr  Live  File  Description\n"
+            "  ----  ----  ----  -----------\n");
+
+    for (i = 0; i < CMOS_SIZE; i++) {
+        if (BIT_TEST(img.mask, i) && live_data[i] != file_data[i]) {
+            out_str("  ");
+            out_byte(i);
+            out_str("  ");
+            out_byte(live_data[i]);
+            out_str("  ");
+            out_byte(file_data[i]);
+            if (i <= RTC_REG_D) {
+                out_str("  ");
+                out_str(cmos_reg_names[i]);
+            } else if (i == CMOS_CHECKSUM_HI || i == CMOS_CHECKSUM_LO) {
+                out_str("  Checksum");
+            }
+            /* Each changed field once, as live->file, at its first byte */
+            for (j = 0; j < NFIELDS; j++) {
+                const struct cmos_field *f = &cmos_fields[j];
+                long lv, fv;
+
+                if ((shown & (1UL << j)) || (f->addr != i &&
+                    !((f->kind == FK_WORD || f->kind == FK_HD) && f->ext == i)))
+                    continue;
+                lv = field_get(f, live_data, NULL);
+                fv = field_get(f, file_data, img.mask);
+                if (lv == fv)
+                    continue;
+                shown |= 1UL << j;
+                out_str("  ");
+                out_str(f->key);
+                out_char(' ');
+                field_print(f, lv);
+                out_str("->");
+                field_print(f, fv);
+            }
+            out_char('\n');
+            diffs++;
+        }
+    }
+
+    if (diffs == 0) {
+        out_str("  No differences found\n");
+    } else {
+        out_str("\n  Total: ");
+        out_dec(diffs, 0);
+        out_str(" byte(s) differ\n");
+    }
+    out_flush();
+
+    return 0;
+}
+
+/*
+ * Offline fleet diff: every image against BASE, field by field from
+ * cmos_fields[].  Each image is read once and its row printed at once,
+ * so memory does not grow with the number of images.  A cell is '.'
+ * (as BASE), 'x' (differs) or '-' (byte not in the record), and the
+ * differing values follow on the row.  Bytes 0x0E-0x3F that no field
+ * covers are counted under "Other".  The clock, Registers C/D and the
+ * checksum are left out, since any two machines differ there.  NVRI
+ * files contribute their last record.
+ */
+#define DIFF_LABEL  16
+
+static int diff_many(const char *basefile, int argc, char *argv[])
+{
+    struct nvr_image base, img;
+    unsigned char skip[CMOS_SIZE / 8];
+    unsigned int differ[NFIELDS], same = 0, fails = 0, j;
+    long bv[NFIELDS];
+    int i, k;
+
+    if (argc < 1) {
+        fprintf(stderr, "Usage: diff-many BASE IMAGE...\n");
+        return 1;
+    }
+    if (image_read(basefile, -1, &base) != 0)
+        return 1;
+
+    memset(skip, 0, sizeof(skip));
+    for (k = 0; k <= RTC_REG_D; k++)
+        BIT_SET(skip, k);
+    BIT_SET(skip, CMOS_CHECKSUM_HI);
+    BIT_SET(skip, CMOS_CHECKSUM_LO);
+    for (j = 0; j < NFIELDS; j++) {
+        BIT_SET(skip, cmos_fields[j].addr);
+        if (cmos_fields[j].kind == FK_WORD || cmos_fields[j].kind == FK_HD)
+            BIT_SET(skip, cmos_fields[j].ext);
+        bv[j] = field_get(&cmos_fields[j], base.data, base.mask);
+        differ[j] = 0;
+    }
+
+    out_str("\nFleet diff against ");
+    out_str(basefile);
+    out_str("\n  Image           ");
+    for (j = 0; j < NFIELDS; j++) {
+        out_char(' ');
+        out_char('a' + j);
+    }
+    out_str("  Other\n");
+
+    for (i = 0; i < argc; i++) {
+        const char *label = argv[i];
+        int len = (int)strlen(label), other = 0, dev = 0;
+
+        if (len > DIFF_LABEL)
+            label += len - DIFF_LABEL;
+        out_flush();                    /* keep stderr in step */
+        k = image_read(argv[i], -1, &img);
+        out_str("  ");
+        out_str(label);
+        for (len = (int)strlen(label); len < DIFF_LABEL; len++)
+            out_char(' ');
+        if (k != 0) {
+            out_str(" unreadable\n");
+            fails++;
+            continue;
+        }
+
+        for (j = 0; j < NFIELDS; j++) {
+            long v = field_get(&cmos_fields[j], img.data, img.mask);
+
+            out_char(' ');
+            if (v < 0 || bv[j] < 0) {
+                out_char('-');
+            } else if (v != bv[j]) {
+                out_char('x');
+                differ[j]++;
+                dev++;
+            } else {
+                out_char('.');
+            }
+        }
+        for (k = 0; k < CMOS_SIZE; k++)
+            if (!BIT_TEST(skip, k) && BIT_TEST(img.mask, k) &&
+                BIT_TEST(base.mask, k) && img.data[k] != base.data[k])
+                other++;
+        out_dec(other, 7);
+        for (j = 0; j < NFIELDS; j++) {
+            long v = field_get(&cmos_fields[j], img.data, img.mask);
+
+            if (v < 0 || bv[j] < 0 || v == bv[j])
+                continue;
+            out_char(' ');
+            out_str(cmos_fields[j].key);
+            out_char('=');
+            field_print(&cmos_fields[j], v);
+        }
+        out_char('\n');
+        if (!dev && !other)
+            same++;
+    }
+
+    out_str("\n  Col  Field         Base  Differ  Description\n");
+    for (j = 0; j < NFIELDS; j++) {
+        const char *key = cmos_fields[j].key;
+
+        out_str("  ");
+        out_char('a' + j);
+        out_str("    ");
+        out_str(key);
+        for (k = (int)strlen(key); k < 13; k++)
+            out_char(' ');
+        if (bv[j] >= 0 && cmos_fields[j].kind == FK_HEX) {
+            out_byte((unsigned char)bv[j]);
+        } else {
+            out_dec(bv[j] < 0 ? 0 : bv[j], 4);
+        }
+        out_dec((long)differ[j], 8);
+        out_str("  ");
+        out_str(cmos_fields[j].name);
+        out_char('\n');
+    }
+    out_str("\n  ");
+    out_dec(argc - (int)fails, 0);
+    out_str(" image(s) compared, ");
+    out_dec((long)same, 0);
+    out_str(" identical to base");
+    if (fails) {
+        out_str(", ");
+        out_dec((long)fails, 0);
+        out_str(" unreadable");
+    }
+    out_char('\n');
+    out_flush();
+    return fails ? 1 : 0;
+}
+
+/* ================================================================
+ * Raw CMOS Read/Write
+ * ================================================================ */
+
+static int raw_read(const char *addrstr)
+{
+    unsigned int addr = (unsigned int)strtol(addrstr, NULL, 0);
+
+    if (addr >= CMOS_SIZE) {
+        fprintf(stderr, "Error: Address must be 0x00-0x3F\n");
+        return 1;
+    }
+
+    {
+        unsigned char val = cmos_get(addr);
+        printf("CMOS[0x%02X] = 0x%02X (%u)\n", addr, val, val);
+    }
+    return 0;
+}
+
+static int raw_write(const char *addrstr, const char *valstr)
+{
+    unsigned int addr = (unsigned int)strtol(addrstr, NULL, 0);
+    unsigned int val = (unsigned int)strtol(valstr, NULL, 0);
+
+    if (addr >= CMOS_SIZE) {
+        fprintf(stderr, "Error: Address must be 0x00-0x3F\n");
+        return 1;
+    }
+    if (val > 0xFF) {
+        fprintf(stderr, "Error: Value must be 0x00-0xFF\n");
+        return 1;
+    }
+
+    stage_begin();
+    cmos_write(addr, val);
+
+    if (addr >= 0x10 && addr <= 0x2D) {
+        cmos_update_checksum();
+        DBG(1, "Checksum auto-updated\n");
+    }
+
+    printf("CMOS[0x%02X] = 0x%02X written\n", addr, val);
+    return stage_commit();
+}
+
+static void checksum_repair(void)
+{
+    if (cmos_verify_checksum()) {
+        printf("CMOS checksum is valid\n");
+    } else {
+        printf("CMOS checksum is INVALID - recalculating...\n");
+        cmos_update_checksum();
+        printf("Checksum updated\n");
+    }
+}
+
+/* ================================================================
+ * Set Time / Date
+ * ================================================================ */
+
+static int set_time(const char *timestr)
+{
+    int hrs, min, sec;
+    unsigned char regb;
+
+    if (sscanf(timestr, "%d:%d:%d", &hrs, &min, &sec) != 3) {
+        fprintf(stderr, "Error: Time format must be HH:MM:SS\n");
+        return 1;
+    }
+    if (hrs < 0 || hrs > 23 || min < 0 || min > 59 || sec < 0 || sec > 59) {
+        fprintf(stderr, "Error: Invalid time values\n");
+        return 1;
+    }
+
+    regb = rtc_mode_load();
+    cmos_write(RTC_REG_B, regb | RTC_B_SET);
+
+    cmos_write(RTC_SECONDS, bin_to_rtc(sec));
+    cmos_write(RTC_MINUTES, bin_to_rtc(min));
+    cmos_write(RTC_HOURS, bin_to_rtc(hrs));
+
+    cmos_write(RTC_REG_B, regb & ~RTC_B_SET);
+
+    printf("Time set to %02d:%02d:%02d\n", hrs, min, sec);
+    return 0;
+}
+
+static int set_date(const char *datestr)
+{
+    int day, mon, year;
+    unsigned char regb, yr, cen;
+
+    if (sscanf(datestr, "%d/%d/%d", &day, &mon, &year) != 3) {
+        fprintf(stderr, "Error: Date format must be DD/MM/YYYY\n");
+        return 1;
+    }
+    if (day < 1 || day > 31 || mon < 1 || mon > 12 ||
+        year < 1980 || year > 2099) {
+        fprintf(stderr, "Error: Invalid date (1980-2099)\n");
+        return 1;
+    }
+
+    cen = year / 100;
+    yr = year % 100;
+
+    regb = rtc_mode_load();
+    cmos_write(RTC_REG_B, regb | RTC_B_SET);
+
+    cmos_write(RTC_DAY_OF_MONTH, bin_to_rtc(day));
+    cmos_write(RTC_MONTH, bin_to_rtc(mon));
+    cmos_write(RTC_YEAR, bin_to_rtc(yr));
+    cmos_write(CMOS_CENTURY, bin_to_rtc(cen));
+
+    cmos_write(RTC_REG_B, regb & ~RTC_B_SET);
+
+    printf("Date set to %02d/%02d/%04d\n", day, mon, year);
+    return 0;
+}
+
+static int set_dow(const char *dowstr)
+{
+    int dow = atoi(dowstr);
+    unsigned char regb;
+
+    if (dow < 1 || dow > 7) {
+        fprintf(stderr, "Error: Day of week 1-7 (1=Sunday, 7=Saturday)\n");
+        return 1;
+    }
+
+    regb = rtc_mode_load();
+    cmos_write(RTC_REG_B, regb | RTC_B_SET);
+    cmos_write(RTC_DAY_OF_WEEK, bin_to_rtc(dow));
+    cmos_write(RTC_REG_B, regb & ~RTC_B_SET);
+
+    printf("Day of week set to %d (%s)\n", dow, day_names[dow]);
+    return 0;
+}
+
+#if NVR_CONFIG
+
+/* ================================================================
+ * RTC Mode Configuration
+ * ================================================================ */
+
+/* Register B bits behind "set-rtc MODE 0|1"; bcd is the inverse of DM */
+static const struct rtc_mode_bit {
+    const char *mode;
+    unsigned char bit;
+    unsigned char invert;
+    const char *label;
+    const char *set, *clear;
+} rtc_mode_bits[] = {
+    { "24h", RTC_B_24H,  0, "Hour format set to",     "24-hour", "12-hour" },
+    { "bcd", RTC_B_DM,   1, "Data mode set to",       "Binary",  "BCD" },
+    { "sqw", RTC_B_SQWE, 0, "Square wave output",     "ENABLED", "disabled" },
+    { "dse", RTC_B_DSE,  0, "Daylight savings",       "ENABLED", "disabled" },
+    { "pie", RTC_B_PIE,  0, "Periodic interrupt",     "ENABLED", "disabled" },
+    { "uie", RTC_B_UIE,  0, "Update-ended interrupt", "ENABLED", "disabled" },
+};
+
+/*
+ * Read-modify-write of Register A or B, staged and committed on its
+ * own so that an earlier change in the same batch script is kept.
+ */
+static int set_rtc_mode(const char *mode, const char *valstr)
+{
+    const struct rtc_mode_bit *m;
+    unsigned char reg;
+    int rate;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(rtc_mode_bits) / sizeof(rtc_mode_bits[0]); i++)
+        if (strcmp(mode, rtc_mode_bits[i].mode) == 0)
+            break;
+    if (i < sizeof(rtc_mode_bits) / sizeof(rtc_mode_bits[0])) {
+        m = &rtc_mode_bits[i];
+        stage_begin();
+        reg = cmos_get(RTC_REG_B);
+        if ((atoi(valstr) != 0) != m->invert)
+            reg |= m->bit;
+        else
+            reg &= ~m->bit;
+        cmos_write(RTC_REG_B, reg);
+        if (stage_commit() != 0)
+            return 1;
+        printf("%s %s\n", m->label, (reg & m->bit) ? m->set : m->clear);
+    }
+    else if (strcmp(mode, "rate") == 0) {
+        rate = atoi(valstr);
+        if (rate < 0 || rate > 15) {
+            fprintf(stderr, "Error: Rate select 0-15\n");
+            return 1;
+        }
+        stage_begin();
+        reg = cmos_get(RTC_REG_A);
+        cmos_write(RTC_REG_A, (reg & ~RTC_A_RS_MASK) | (rate & RTC_A_RS_MASK));
+        if (stage_commit() != 0)
+            return 1;
+        printf("Periodic rate set to %d (%s)\n", rate, rate_freq[rate]);
+    }
+    else {
+        fprintf(stderr, "Unknown RTC mode: %s\n", mode);
+        fprintf(stderr, "Modes: 24h, bcd, sqw, dse, pie, uie, rate\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+#endif /* NVR_CONFIG */
+
+/* ================================================================
+ * Save / Load CMOS
+ * ================================================================ */
+
+/*
+ * Save the live CMOS.  Plain "save FILE" writes the raw 64-byte blob;
+ * --tag NAME, --image or --append write an NVRI record instead.
+ */
+static int save_cmos(const char *filename, int argc, char *argv[])
+{
+    FILE *fp;
+    struct nvr_image img;
+    int i, structured = 0, append = 0;
+
+    img.tag[0] = '\0';
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--append") == 0) {
+            structured = append = 1;
+        } else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--image") == 0) {
+            structured = 1;
+        } else if ((strcmp(argv[i], "-T") == 0 || strcmp(argv[i], "--tag") == 0) &&
+                   i + 1 < argc) {
+            strncpy(img.tag, argv[++i], IMG_TAG_LEN);
+            img.tag[IMG_TAG_LEN] = '\0';
+            structured = 1;
+        } else {
+            fprintf(stderr, "Unknown save option: %s\n", argv[i]);
+            fprintf(stderr, "Options: --image, --append, --tag NAME\n");
+            return 1;
+        }
+    }
+
+    cmos_snapshot();
+
+    if (structured) {
+        img.time = (unsigned long)time(NULL);
+        memset(img.mask, 0xFF, sizeof(img.mask));
+        memcpy(img.data, cmos_image, CMOS_SIZE);
+        if (image_write(filename, &img, append) != 0)
+            return 1;
+        printf("CMOS %s %s (NVRI record, tag '%s')\n",
+               append ? "appended to" : "saved to", filename, img.tag);
+        return 0;
+    }
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        perror("Error opening file for writing");
+        return 1;
+    }
+    if (fwrite((const char *)cmos_image, 1, CMOS_SIZE, fp) != CMOS_SIZE) {
+        perror("Error writing CMOS data");
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    printf("CMOS saved to %s (%d bytes)\n", filename, CMOS_SIZE);
+    return 0;
+}
+
+/* Clock and date bytes left alone by "load --keep-time" */
+static int cmos_is_clock(int addr)
+{
+    return addr <= RTC_YEAR || addr == CMOS_CENTURY;
+}
+
+/*
+ * Restore an image (raw or NVRI; the last record unless -r N picks
+ * one).  The live CMOS is snapshotted first and the image goes
+ * through the staging engine, so only bytes that actually differ
+ * reach the chip (fewer bus cycles, fewer battery RAM writes).
+ *
+ *   --keep-time   leave 0x00-0x09 and the century byte untouched
+ *   --verify      read every restored byte back from the chip
+ */
+static int load_cmos(const char *filename, int argc, char *argv[])
+{
+    struct nvr_image img;
+    const unsigned char *data = img.data;
+    int i, r, keep_time = 0, verify = 0, bad = 0, record = -1;
+
+    for (i = 0; i < argc; i++) {
+        if ((r = image_record_opt(&i, argc, argv, &record)) != 0) {
+            if (r < 0)
+                return 1;
+        } else if (strcmp(argv[i], "--keep-time") == 0 || strcmp(argv[i], "-t") == 0) {
+            keep_time = 1;
+        } else if (strcmp(argv[i], "--verify") == 0 || strcmp(argv[i], "-v") == 0) {
+            verify = 1;
+        } else {
+            fprintf(stderr, "Unknown load option: %s\n", argv[i]);
+            fprintf(stderr, "Options: --keep-time, --verify, -r N\n");
+            return 1;
+        }
+    }
+
+    if (image_read(filename, record, &img) != 0)
+        return 1;
+
+    cmos_snapshot();
+    stage_begin();
+    for (i = 0; i < CMOS_SIZE; i++) {
+        if (i == RTC_REG_C || i == RTC_REG_D || !BIT_TEST(img.mask, i))
+            continue;  /* read-only or not in the image */
+        if (keep_time && cmos_is_clock(i))
+            continue;
+        if (i == RTC_REG_B)
+            cmos_write(i, data[i] & ~RTC_B_SET);
+        else
+            cmos_write(i, data[i]);
+    }
+    if (stage_commit() != 0)
+        return 1;
+
+    printf("CMOS loaded from %s: %d byte(s) written\n", filename, stage_written);
+
+    if (verify) {
+        unsigned char live[CMOS_SIZE];
+
+        /* Read back in two bursts around C (reading it clears flags) */
+        cmos_read_burst(RTC_REG_A, live + RTC_REG_A, 2);
+        cmos_read_burst(CMOS_DIAG, live + CMOS_DIAG, CMOS_SIZE - CMOS_DIAG);
+        for (i = 0; i < CMOS_SIZE; i++) {
+            unsigned char want = data[i], got;
+
+            if (i == RTC_REG_C || i == RTC_REG_D || cmos_is_clock(i) ||
+                !BIT_TEST(img.mask, i))
+                continue;   /* read-only, ticking or not in the image */
+            got = live[i];
+            if (i == RTC_REG_A) {
+                want &= ~RTC_A_UIP;
+                got &= ~RTC_A_UIP;
+            } else if (i == RTC_REG_B) {
+                want &= ~RTC_B_SET;
+            }
+            if (got != want) {
+                fprintf(stderr, "Verify: CMOS[0x%02X] = 0x%02X, expected 0x%02X\n",
+                        i, got, want);
+                bad++;
+            }
+        }
+        if (bad) {
+            fprintf(stderr, "Verify FAILED: %d byte(s) differ\n", bad);
+            return 1;
+        }
+        printf("Verify OK\n");
+    }
 
-    printf("\nCMOS RAM Dump (64 bytes):\n");
-    printf("       00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F\n");
-    printf("       -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- --\n");
+    if (!keep_time)
+        printf("WARNING: Verify time and date are correct!\n");
+    return 0;
+}
 
-    for (i = 0; i < CMOS_SIZE; i++) {
-        if ((i % 16) == 0)
-            printf("  %02X:  ", i);
-        printf("%02X ", data[i]);
-        if ((i % 16) == 15)
-            printf("\n");
+/* ================================================================
+ * CMOS Factory Reset
+ * ================================================================ */
+
+static int factory_reset(void)
+{
+    int i;
+
+    printf("Resetting CMOS to PC1640 factory defaults...\n");
+
+    /* Everything below is staged; the commit holds SET while writing */
+    stage_begin();
+
+    /* Register A: standard 32.768 kHz divider, 1024 Hz periodic rate */
+    cmos_write(RTC_REG_A, 0x26);  /* DV=010, RS=0110 */
+
+    /* Register B: 24-hour, BCD, no interrupts */
+    cmos_write(RTC_REG_B, 0x02);  /* 24H=1, all else off */
+
+    /* Clear diagnostic + shutdown status */
+    cmos_write(CMOS_DIAG, 0x00);
+    cmos_write(CMOS_SHUTDOWN, 0x00);
+
+    /* Floppy: drive A = 720KB 3.5" (type 3, standard PC1640) */
+    cmos_write(CMOS_FLOPPY, 0x30);
+
+    /* Hard disk: none */
+    cmos_write(CMOS_DISK, 0x00);
+
+    /* Equipment: floppy present, no FPU, EGA video, 1 floppy drive */
+    cmos_write(CMOS_EQUIP, 0x01);
+
+    /* Base memory: 640 KB */
+    cmos_write(CMOS_BASEMEM_LO, 0x80);
+    cmos_write(CMOS_BASEMEM_HI, 0x02);
+
+    /* Extended memory: 0 (8086 has none) */
+    cmos_write(CMOS_EXTMEM_LO, 0x00);
+    cmos_write(CMOS_EXTMEM_HI, 0x00);
+
+    /* Clear extended HD types */
+    cmos_write(CMOS_DISK0_EXT, 0x00);
+    cmos_write(CMOS_DISK1_EXT, 0x00);
+
+    /* Century */
+    cmos_write(CMOS_CENTURY, 0x20);
+
+    /* Clear alarm registers (wildcard = disabled) */
+    cmos_write(RTC_ALARM_SEC, 0xC0);
+    cmos_write(RTC_ALARM_MIN, 0xC0);
+    cmos_write(RTC_ALARM_HRS, 0xC0);
+
+    /* Clear remaining config bytes */
+    for (i = 0x1B; i <= 0x2D; i++)
+        cmos_write(i, 0x00);
+    for (i = 0x33; i <= 0x3F; i++)
+        cmos_write(i, 0x00);
+
+    /* Update checksum last */
+    cmos_update_checksum();
+    if (stage_commit() != 0)
+        return 1;
+
+    printf("CMOS reset to factory defaults:\n");
+    printf("  Floppy A: 720 KB 3.5\"  Floppy B: None\n");
+    printf("  Hard disk: None\n");
+    printf("  Video: EGA (built-in PEGA)\n");
+    printf("  Memory: 640 KB base, 0 KB extended\n");
+    printf("  RTC: 24-hour BCD mode\n");
+    printf("  Checksum updated\n");
+    return 0;
+}
+
+#if NVR_HW
+
+/* ================================================================
+ * Debug: NVR Protocol Trace
+ * ================================================================ */
+
+static void debug_nvr_trace(void)
+{
+    unsigned char pb = inb(PORT_PB);
+    int i;
+
+    out_str("\nNVR Protocol Trace (port 0x65 -> port 0x62):\n"
+            "  Addr  Wr65  Rd62(hi)  Rd62(lo)  Combined\n"
+            "  ----  ----  --------  --------  --------\n");
+
+    for (i = 0; i < 16; i++) {
+        unsigned char val, hi_nib, lo_nib;
+
+        outb((unsigned char)i, PORT_SYSSTAT2_WR);
+        io_delay();
+        val = sysstat2_nibbles(pb);
+        hi_nib = val >> 4;
+        lo_nib = val & 0x0F;
+
+        out_str("  ");
+        out_byte(i);
+        out_str("  ");
+        out_byte(i);
+        out_str("    0x");
+        out_hex(hi_nib, 1);
+        out_str("       0x");
+        out_hex(lo_nib, 1);
+        out_str("      ");
+        out_byte(val);
+        out_char('\n');
+    }
+    outb(pb, PORT_PB);
+    out_flush();
+}
+
+/* ================================================================
+ * Debug: Port Read/Write
+ * ================================================================ */
+
+static int port_read(const char *portstr)
+{
+    unsigned int port = (unsigned int)strtol(portstr, NULL, 0);
+    unsigned char val;
+
+    if (port > 0xFFFF) {
+        fprintf(stderr, "Error: Port must be 0x0000-0xFFFF\n");
+        return 1;
+    }
+
+    val = inb(port);
+    printf("IN  port 0x%04X = 0x%02X (%u)\n", port, val, val);
+    return 0;
+}
+
+static int port_write(const char *portstr, const char *valstr)
+{
+    unsigned int port = (unsigned int)strtol(portstr, NULL, 0);
+    unsigned int val = (unsigned int)strtol(valstr, NULL, 0);
+
+    if (port > 0xFFFF) {
+        fprintf(stderr, "Error: Port must be 0x0000-0xFFFF\n");
+        return 1;
+    }
+    if (val > 0xFF) {
+        fprintf(stderr, "Error: Value must be 0x00-0xFF\n");
+        return 1;
+    }
+
+    outb(val, port);
+    printf("OUT port 0x%04X = 0x%02X\n", port, val);
+    return 0;
+}
+
+/* ================================================================
+ * Dead-Man Diagnostic Port
+ * ================================================================ */
+
+static void show_deadman(void)
+{
+    out_reg("\nDead-Man Diagnostic Port (0xDEAD): ", inb(PORT_DEAD));
+    out_str("  This port stores the last POST progress code.\n"
+            "  If the system hangs during POST, this value\n"
+            "  indicates which test stage failed.\n");
+    out_flush();
+}
+
+/*
+ * "nvr deadman-capture" follows the POST/diagnostic code live: it
+ * polls 0xDEAD (with -s, system status 2 as well) in a tight loop and
+ * keeps only changes of value, timestamped against PIT channel 2, in
+ * a preallocated table.  Nothing is printed until the run ends (-t
+ * SECONDS, Ctrl+C or SIGTERM), so output never costs a transition.
+ * A full table stops recording but changes are still counted.
+ *
+ * The longest gap between two polls is reported: a code held for less
+ * than that may have been missed.  A gap longer than one channel 2
+ * wrap (55 ms, e.g. the process scheduled out) cannot be measured, so
+ * the PIT timeline is checked against the wall clock at the end.
+ */
+#define DM_EVENTS       1024
+#define DM_DEFAULT_S    10
+#define DM_MAX_SECONDS  600
+
+struct dm_event {
+    unsigned long t;            /* PIT ticks since the start */
+    unsigned char src;          /* 0 = 0xDEAD, 1 = sysstat2 */
+    unsigned char val;
+};
+
+static struct dm_event dm_events[DM_EVENTS];
+
+static int deadman_capture(const char *unused, int argc, char *argv[])
+{
+    static const char *const src_names[2] = { "0xDEAD  ", "sysstat2" };
+    unsigned long now = 0, end, prev = 0, polls = 0, gap_max = 0, lost = 0;
+    unsigned long ms, wall;
+    unsigned int seconds = DM_DEFAULT_S, n = 0, i;
+    unsigned short cnt, last;
+    unsigned char cur[2];
+    struct timeval tv0, tv;
+    int a, s, nsrc = 1;
+
+    (void)unused;
+    for (a = 0; a < argc; a++) {
+        if (strcmp(argv[a], "-t") == 0 && a + 1 < argc) {
+            seconds = (unsigned int)atoi(argv[++a]);
+        } else if (strcmp(argv[a], "-s") == 0 || strcmp(argv[a], "--sysstat2") == 0) {
+            nsrc = 2;
+        } else {
+            fprintf(stderr, "Unknown deadman-capture option: %s\n", argv[a]);
+            fprintf(stderr, "Options: -t SECONDS, -s (also sysstat2)\n");
+            return 1;
+        }
+    }
+    if (seconds < 1 || seconds > DM_MAX_SECONDS) {
+        fprintf(stderr, "Error: -t must be 1-%d seconds\n", DM_MAX_SECONDS);
+        return 1;
+    }
+
+    printf("\nDead-Man Capture (%u s%s, Ctrl+C to stop):\n",
+           seconds, nsrc > 1 ? ", 0xDEAD and sysstat2" : "");
+    fflush(stdout);
+
+    end = (unsigned long)seconds * PIT_HZ;
+    loop_stop = 0;
+    signal(SIGINT, loop_sigint);
+    signal(SIGTERM, loop_sigint);
+
+    pit2_start();
+    gettimeofday(&tv0, NULL);
+    last = pit2_read();
+    cur[0] = inb(PORT_DEAD);
+    cur[1] = (nsrc > 1) ? amstrad_read_sysstat2() : 0;
+    for (s = 0; s < nsrc; s++) {
+        dm_events[n].t = 0;
+        dm_events[n].src = s;
+        dm_events[n].val = cur[s];
+        n++;
+    }
+
+    while (now < end && !loop_stop) {
+        unsigned char v[2];
+
+        v[0] = inb(PORT_DEAD);
+        if (nsrc > 1)
+            v[1] = amstrad_read_sysstat2();
+        cnt = pit2_read();
+        now += (unsigned short)(last - cnt);
+        last = cnt;
+        if (now - prev > gap_max)
+            gap_max = now - prev;
+        prev = now;
+        polls++;
+
+        for (s = 0; s < nsrc; s++) {
+            if (v[s] == cur[s])
+                continue;
+            cur[s] = v[s];
+            if (n == DM_EVENTS) {
+                lost++;
+                continue;
+            }
+            dm_events[n].t = now;
+            dm_events[n].src = s;
+            dm_events[n].val = v[s];
+            n++;
+        }
+    }
+    gettimeofday(&tv, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    out_str("        Time (us)  Source    Value\n");
+    for (i = 0; i < n; i++) {
+        out_dec((long)pit_ticks_us(dm_events[i].t), 17);
+        out_str("  ");
+        out_str(src_names[dm_events[i].src]);
+        out_str("  ");
+        out_byte(dm_events[i].val);
+        if (i < (unsigned int)nsrc)
+            out_str("  (initial)");
+        out_char('\n');
+    }
+
+    ms = pit_ticks_us(now) / 1000;
+    wall = (unsigned long)(tv.tv_sec - tv0.tv_sec) * 1000UL
+         + (tv.tv_usec - tv0.tv_usec) / 1000;
+    out_str("\n  Window:          ");
+    out_dec((long)ms, 0);
+    out_str(loop_stop ? " ms (interrupted)\n" : " ms\n");
+    out_str("  Transitions:     ");
+    out_dec((long)(n - nsrc + lost), 0);
+    if (lost) {
+        out_str(" (");
+        out_dec((long)lost, 0);
+        out_str(" after the table filled, not recorded)");
+    }
+    out_str("\n  Polls:           ");
+    out_dec((long)polls, 0);
+    out_str(", avg ");
+    if (polls > pit_ticks_us(now))
+        out_str("<1");
+    else
+        out_dec(polls ? (long)(pit_ticks_us(now) / polls) : 0, 0);
+    out_str(" us, longest gap ");
+    out_dec((long)pit_ticks_us(gap_max), 0);
+    out_str(" us\n");
+    if (wall > ms + 55)
+        out_str("  Note: the loop was held off for more than one PIT wrap;"
+                " times run short\n");
+    out_flush();
+    return 0;
+}
+
+/* ================================================================
+ * Soft Reset
+ * ================================================================ */
+
+static void soft_reset(void)
+{
+    printf("Triggering soft reset via port 0x66...\n");
+    printf("System will reboot NOW!\n");
+    outb(0x00, PORT_SOFT_RESET);
+    /* Should not reach here */
+    printf("ERROR: Soft reset failed!\n");
+}
+
+/* ================================================================
+ * Game Port Detection
+ * ================================================================ */
+
+/*
+ * Axis positions come from the port's four one-shots: any write to
+ * 0x201 sets bits 0-3, and each drops back after 24.2 us plus 11 us
+ * per kOhm of its pot (about 1.1 ms at 100 kOhm).  joy_measure() fires
+ * them and samples the port against latched PIT channel 2 counts in
+ * one loop, so results are in PIT ticks whatever the CPU speed; each
+ * falling edge is placed midway between the last sample that saw the
+ * bit set and the first that saw it clear, so the error is half a
+ * loop pass.  Interrupts stay enabled: a gap between two samples long
+ * enough to mean we were interrupted voids the run, which is retried.
+ */
+#define JOY_TIMEOUT_TICKS   3580    /* 3 ms, well past a 100 kOhm pot */
+#define JOY_GAP_TICKS       240     /* 200 us between samples: interrupted */
+#define JOY_TRIES           3
+#define JOY_NONE            0xFFFF  /* axis never fell: nothing connected */
+#define JOY_MAX_HZ          200
+#define JOY_MAX_SAMPLES     10000
+
+static const char *const joy_axis_names[4] = {
+    "Joystick A X", "Joystick A Y", "Joystick B X", "Joystick B Y"
+};
+
+static unsigned long joy_retries = 0;
+
+/* Axis times in PIT ticks (JOY_NONE if absent); returns 0, -1 if disturbed */
+static int joy_measure(unsigned short *ticks, unsigned char *buttons)
+{
+    unsigned short t0, el, prev_el;
+    unsigned char v, pending;
+    int tries, i;
+
+    for (tries = 0; tries < JOY_TRIES; tries++) {
+        if (tries)
+            joy_retries++;
+
+        /* Let a previous cycle finish before re-firing */
+        t0 = pit2_read();
+        while ((inb(PORT_GAME) & 0x0F) &&
+               (unsigned short)(t0 - pit2_read()) < JOY_TIMEOUT_TICKS)
+            ;
+
+        for (i = 0; i < 4; i++)
+            ticks[i] = JOY_NONE;
+        pending = 0x0F;
+        outb(0xFF, PORT_GAME);
+        t0 = pit2_read();
+        prev_el = 0;
+        for (;;) {
+            v = inb(PORT_GAME);
+            el = t0 - pit2_read();
+            if (el - prev_el > JOY_GAP_TICKS)
+                break;
+            for (i = 0; i < 4; i++) {
+                if ((pending & (1 << i)) && !(v & (1 << i))) {
+                    ticks[i] = prev_el + (el - prev_el) / 2;
+                    pending &= ~(1 << i);
+                }
+            }
+            prev_el = el;
+            if (!pending || el > JOY_TIMEOUT_TICKS) {
+                *buttons = v >> 4;
+                return 0;
+            }
+        }
+        DBG(2, "Joystick: %u-tick gap at %u, retrying\n", el - prev_el, prev_el);
+    }
+    *buttons = inb(PORT_GAME) >> 4;
+    return -1;
+}
+
+/* Pot resistance in 0.1 kOhm for an axis time in us */
+static unsigned int joy_kohm10(unsigned long us)
+{
+    return us * 10 > 242 ? (unsigned int)((us * 10 - 242) / 11) : 0;
+}
+
+static void show_gameport(void)
+{
+    unsigned short ticks[4];
+    unsigned char val, buttons;
+    int i, ok;
+
+    out_str("\nGame Port (Joystick):\n");
+    out_str("  Port: 0x201\n");
+
+    val = inb(PORT_GAME);
+    out_reg("  Raw read: ", val);
+    for (i = 0; i < 4; i++) {
+        out_str("    Button ");
+        out_dec(i + 1, 0);
+        out_flag(": ", val & (0x10 << i), "Released", "PRESSED");
+    }
+
+    pit2_start();
+    ok = joy_measure(ticks, &buttons) == 0;
+    out_str("  Axes (PIT-timed one-shots");
+    out_str(ok ? "):\n" : ", run was interrupted):\n");
+    for (i = 0; i < 4; i++) {
+        unsigned long us = pit_ticks_us(ticks[i]);
+
+        out_str("    ");
+        out_str(joy_axis_names[i]);
+        if (ticks[i] == JOY_NONE) {
+            out_str(": not connected\n");
+            continue;
+        }
+        out_str(": ");
+        out_dec((long)us, 4);
+        out_str(" us (");
+        out_dec(joy_kohm10(us) / 10, 0);
+        out_char('.');
+        out_dec(joy_kohm10(us) % 10, 0);
+        out_str(" kOhm)\n");
+    }
+    out_flush();
+}
+
+/*
+ * "nvr gameport-sample" repeats the measurement at up to JOY_MAX_HZ,
+ * printing the four axis times per line, then a summary whose range
+ * doubles as a calibration: move each stick to its stops during the
+ * run and the min/max give its travel.
+ */
+static int gameport_sample(const char *unused, int argc, char *argv[])
+{
+    unsigned short ticks[4];
+    unsigned long us, sum[4] = { 0, 0, 0, 0 };
+    unsigned long lo[4], hi[4], got[4] = { 0, 0, 0, 0 };
+    unsigned int hz = 10, samples = 50, n, disturbed = 0;
+    unsigned char buttons;
+    struct timeval t0, t1;
+    long ms;
+    int i;
+
+    (void)unused;
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            samples = (unsigned int)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            hz = (unsigned int)atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown gameport-sample option: %s\n", argv[i]);
+            fprintf(stderr, "Options: -n SAMPLES, -r HZ\n");
+            return 1;
+        }
+    }
+    if (samples < 1 || samples > JOY_MAX_SAMPLES || hz < 1 || hz > JOY_MAX_HZ) {
+        fprintf(stderr, "Error: -n must be 1-%d, -r 1-%d Hz\n",
+                JOY_MAX_SAMPLES, JOY_MAX_HZ);
+        return 1;
+    }
+    for (i = 0; i < 4; i++) {
+        lo[i] = 0xFFFFFFFFUL;
+        hi[i] = 0;
+    }
+
+    printf("\nGame Port Sampler (%u samples at %u Hz, axis times in us):\n", samples, hz);
+    printf("      #    A.X    A.Y    B.X    B.Y  Buttons\n");
+    fflush(stdout);
+
+    pit2_start();
+    gettimeofday(&t0, NULL);
+    for (n = 0; n < samples; n++) {
+        if (joy_measure(ticks, &buttons) != 0)
+            disturbed++;
+        out_dec(n + 1, 7);
+        for (i = 0; i < 4; i++) {
+            if (ticks[i] == JOY_NONE) {
+                out_str("     --");
+                continue;
+            }
+            us = pit_ticks_us(ticks[i]);
+            out_dec((long)us, 7);
+            sum[i] += us;
+            got[i]++;
+            if (us < lo[i])
+                lo[i] = us;
+            if (us > hi[i])
+                hi[i] = us;
+        }
+        out_str("  ");
+        for (i = 0; i < 4; i++)
+            out_char((buttons & (1 << i)) ? '.' : '1' + i);
+        out_char('\n');
+        out_flush();
+        if (n + 1 < samples)
+            delay_ms(1000 / hz);
+    }
+    gettimeofday(&t1, NULL);
+    ms = (t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_usec - t0.tv_usec) / 1000L;
+
+    out_str("\n  Axis          min    avg    max  us   (travel, kOhm)\n");
+    for (i = 0; i < 4; i++) {
+        out_str("  ");
+        out_str(joy_axis_names[i]);
+        if (!got[i]) {
+            out_str(":  not connected\n");
+            continue;
+        }
+        out_dec((long)lo[i], 6);
+        out_dec((long)(sum[i] / got[i]), 7);
+        out_dec((long)hi[i], 7);
+        out_str("      (");
+        out_dec(joy_kohm10(lo[i]) / 10, 0);
+        out_str(" - ");
+        out_dec(joy_kohm10(hi[i]) / 10, 0);
+        out_str(")\n");
+    }
+    out_str("  Samples:      ");
+    out_dec(samples, 0);
+    out_str(" in ");
+    out_dec(ms, 0);
+    out_str(" ms, ");
+    out_dec((long)joy_retries, 0);
+    out_str(" retried, ");
+    out_dec(disturbed, 0);
+    out_str(" still interrupted\n");
+    out_flush();
+    return 0;
+}
+
+#endif /* NVR_HW */
+
+#if NVR_CONFIG
+
+/* ================================================================
+ * Machine-Readable Output (--format=kv|json|bin)
+ * ================================================================ */
+
+/*
+ * "show" in a compact, stable schema for collection over slow serial
+ * lines.  kv prints one key=value per line, json one flat object on a
+ * single line; both carry the same keys, with "nvr" giving the schema
+ * version.  Register-like values are 0xNN in kv and plain integers in
+ * json.  Time fields come from the same snapshot as everything else.
+ *
+ * bin is a fixed 78-byte record:
+ *   0  "NVRS"         4  version (1)     5  sysstat1    6  sysstat2
+ *   7  LPT1 status    8  IDA status      9  dead-man   10  flags
+ *  11  reserved      12  CMOS image (64 bytes)
+ *  76  CRC-16/CCITT of bytes 0-75, little-endian (as in NVRI files)
+ */
+
+#define FMT_SCHEMA      1
+#define FMT_BIN_SIZE    78
+#define FMT_BIN_CSUM_OK 0x01    /* flags: CMOS checksum valid */
+
+enum { FMT_TEXT, FMT_KV, FMT_JSON, FMT_BIN };
+
+static int out_format = FMT_TEXT;
+static int fmt_fields;
+
+static void fmt_key(const char *key)
+{
+    if (out_format == FMT_JSON) {
+        out_str(fmt_fields++ ? ",\"" : "{\"");
+        out_str(key);
+        out_str("\":");
+    } else {
+        out_str(key);
+        out_char('=');
     }
+}
 
-    printf("\n  Regions:\n");
-    printf("    0x00-0x09: RTC time/date registers\n");
-    printf("    0x0A-0x0D: RTC status registers (A-D)\n");
-    printf("    0x0E:      Diagnostic status\n");
-    printf("    0x0F:      Shutdown status\n");
-    printf("    0x10:      Floppy drive types\n");
-    printf("    0x12:      Hard disk types\n");
-    printf("    0x14:      Equipment byte\n");
-    printf("    0x15-0x16: Base memory (KB)\n");
-    printf("    0x17-0x18: Extended memory (KB)\n");
-    printf("    0x19-0x1A: HD extended types\n");
-    printf("    0x2E-0x2F: Checksum\n");
-    printf("    0x32:      Century (BCD)\n");
+static void fmt_end_field(void)
+{
+    if (out_format == FMT_KV)
+        out_char('\n');
+}
 
-    printf("\n  Checksum (0x10-0x2D): %s\n",
-           cmos_verify_checksum() ? "VALID" : "*** INVALID ***");
+static void fmt_int(const char *key, long v)
+{
+    fmt_key(key);
+    out_dec(v, 0);
+    fmt_end_field();
 }
 
-/* ================================================================
- * CMOS Compare: show differences between two dumps
- * ================================================================ */
+static void fmt_hex(const char *key, unsigned char v)
+{
+    fmt_key(key);
+    if (out_format == FMT_JSON)
+        out_dec(v, 0);
+    else
+        out_byte(v);
+    fmt_end_field();
+}
 
-static int compare_cmos(const char *filename)
+/* Values are our own fixed strings: no escaping needed */
+static void fmt_str(const char *key, const char *s)
 {
-    FILE *fp;
-    unsigned char file_data[CMOS_SIZE], live_data[CMOS_SIZE];
-    int i, diffs = 0;
+    fmt_key(key);
+    if (out_format == FMT_JSON)
+        out_char('"');
+    out_str(s);
+    if (out_format == FMT_JSON)
+        out_char('"');
+    fmt_end_field();
+}
 
-    fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("Error opening file");
-        return 1;
-    }
-    if (fread((char *)file_data, 1, CMOS_SIZE, fp) != CMOS_SIZE) {
-        fprintf(stderr, "Error: File too small (expected %d bytes)\n", CMOS_SIZE);
-        fclose(fp);
-        return 1;
-    }
-    fclose(fp);
+/* One cmos_fields[] entry under its own key */
+static void fmt_field(int idx)
+{
+    const struct cmos_field *f = &cmos_fields[idx];
 
-    rtc_wait_uip();
-    for (i = 0; i < CMOS_SIZE; i++)
-        live_data[i] = cmos_read(i);
+    if (f->kind == FK_HEX)
+        fmt_hex(f->key, (unsigned char)field_get(f, NULL, NULL));
+    else
+        fmt_int(f->key, field_get(f, NULL, NULL));
+}
 
-    printf("\nCMOS Compare: live vs %s\n", filename);
-    printf("  Addr  Live  File  Description\n");
-    printf("  ----  ----  ----  -----------\n");
+/* "HH:MM:SS" from three RTC registers; alarm wildcards print as ** */
+static void fmt_hms(char *buf, unsigned char h, unsigned char m,
+                    unsigned char s, int wild)
+{
+    unsigned char v[3];
+    int i;
 
-    for (i = 0; i < CMOS_SIZE; i++) {
-        if (live_data[i] != file_data[i]) {
-            printf("  0x%02X  0x%02X  0x%02X", i, live_data[i], file_data[i]);
-
-            switch (i) {
-            case 0x00: printf("  Seconds"); break;
-            case 0x01: printf("  Alarm seconds"); break;
-            case 0x02: printf("  Minutes"); break;
-            case 0x03: printf("  Alarm minutes"); break;
-            case 0x04: printf("  Hours"); break;
-            case 0x05: printf("  Alarm hours"); break;
-            case 0x06: printf("  Day of week"); break;
-            case 0x07: printf("  Day of month"); break;
-            case 0x08: printf("  Month"); break;
-            case 0x09: printf("  Year"); break;
-            case 0x0A: printf("  Register A"); break;
-            case 0x0B: printf("  Register B"); break;
-            case 0x0C: printf("  Register C (flags)"); break;
-            case 0x0D: printf("  Register D (battery)"); break;
-            case 0x0E: printf("  Diagnostic status"); break;
-            case 0x0F: printf("  Shutdown status"); break;
-            case 0x10: printf("  Floppy types"); break;
-            case 0x12: printf("  Hard disk types"); break;
-            case 0x14: printf("  Equipment byte"); break;
-            case 0x15: printf("  Base mem low"); break;
-            case 0x16: printf("  Base mem high"); break;
-            case 0x17: printf("  Ext mem low"); break;
-            case 0x18: printf("  Ext mem high"); break;
-            case 0x19: printf("  HD0 ext type"); break;
-            case 0x1A: printf("  HD1 ext type"); break;
-            case 0x2E: printf("  Checksum high"); break;
-            case 0x2F: printf("  Checksum low"); break;
-            case 0x32: printf("  Century"); break;
-            }
-            printf("\n");
-            diffs++;
+    v[0] = h; v[1] = m; v[2] = s;
+    for (i = 0; i < 3; i++) {
+        if (wild && v[i] >= 0xC0) {
+            buf[0] = buf[1] = '*';
+        } else {
+            unsigned char b = (i == 0) ? rtc_hours_to_bin(v[i])
+                                       : rtc_to_bin(v[i]);
+            buf[0] = '0' + b / 10;
+            buf[1] = '0' + b % 10;
         }
+        buf[2] = (i < 2) ? ':' : '\0';
+        buf += 3;
     }
+}
 
-    if (diffs == 0)
-        printf("  No differences found\n");
-    else
-        printf("\n  Total: %d byte(s) differ\n", diffs);
+static void show_bin(void)
+{
+    unsigned char rec[FMT_BIN_SIZE];
+    unsigned short crc;
+    int i;
 
-    return 0;
+    memset(rec, 0, sizeof(rec));
+    memcpy(rec, "NVRS", 4);
+    rec[4] = FMT_SCHEMA;
+    rec[5] = am_status(AM_STAT1);
+    rec[6] = am_status(AM_STAT2);
+    rec[7] = am_status(AM_LPT1);
+    rec[8] = inb(PORT_IDA_STATUS);
+    rec[9] = inb(PORT_DEAD);
+    rec[10] = cmos_verify_checksum() ? FMT_BIN_CSUM_OK : 0;
+    memcpy(rec + 12, cmos_image, CMOS_SIZE);
+    crc = crc16(0xFFFF, rec, FMT_BIN_SIZE - 2);
+    rec[76] = crc & 0xFF;
+    rec[77] = crc >> 8;
+
+    for (i = 0; i < FMT_BIN_SIZE; i++)
+        out_char(rec[i]);
+    out_flush();
 }
 
-/* ================================================================
- * Raw CMOS Read/Write
- * ================================================================ */
-
-static int raw_read(const char *addrstr)
+static void show_machine(void)
 {
-    unsigned int addr = (unsigned int)strtol(addrstr, NULL, 0);
+    unsigned char regb, lpt;
+    char buf[12];
 
-    if (addr >= CMOS_SIZE) {
-        fprintf(stderr, "Error: Address must be 0x00-0x3F\n");
-        return 1;
+    cmos_snapshot();
+    if (out_format == FMT_BIN) {
+        show_bin();
+        return;
     }
 
-    printf("CMOS[0x%02X] = 0x%02X (%u)\n", addr, cmos_read(addr), cmos_read(addr));
-    return 0;
+    regb = rtc_mode_load();
+    fmt_fields = 0;
+    fmt_int("nvr", FMT_SCHEMA);
+
+    buf[0] = '0' + rtc_to_bin(cmos_get(CMOS_CENTURY)) / 10;
+    buf[1] = '0' + rtc_to_bin(cmos_get(CMOS_CENTURY)) % 10;
+    buf[2] = '0' + rtc_to_bin(cmos_get(RTC_YEAR)) / 10;
+    buf[3] = '0' + rtc_to_bin(cmos_get(RTC_YEAR)) % 10;
+    buf[4] = '-';
+    buf[5] = '0' + rtc_to_bin(cmos_get(RTC_MONTH)) / 10;
+    buf[6] = '0' + rtc_to_bin(cmos_get(RTC_MONTH)) % 10;
+    buf[7] = '-';
+    buf[8] = '0' + rtc_to_bin(cmos_get(RTC_DAY_OF_MONTH)) / 10;
+    buf[9] = '0' + rtc_to_bin(cmos_get(RTC_DAY_OF_MONTH)) % 10;
+    buf[10] = '\0';
+    fmt_str("date", buf);
+    fmt_hms(buf, cmos_get(RTC_HOURS), cmos_get(RTC_MINUTES),
+            cmos_get(RTC_SECONDS), 0);
+    fmt_str("time", buf);
+    fmt_int("dow", rtc_to_bin(cmos_get(RTC_DAY_OF_WEEK)));
+    fmt_field(F_RTC_24H);
+    fmt_field(F_RTC_BINARY);
+    fmt_hms(buf, cmos_get(RTC_ALARM_HRS), cmos_get(RTC_ALARM_MIN),
+            cmos_get(RTC_ALARM_SEC), 1);
+    fmt_str("alarm", buf);
+    fmt_int("alarm.irq", (regb & RTC_B_AIE) != 0);
+    fmt_hex("rtc.a", cmos_get(RTC_REG_A));
+    fmt_hex("rtc.b", regb);
+    fmt_hex("rtc.c", cmos_get(RTC_REG_C));
+    fmt_hex("rtc.d", cmos_get(RTC_REG_D));
+    fmt_int("battery", (cmos_get(RTC_REG_D) & RTC_D_VRT) != 0);
+
+    fmt_field(F_FLOPPY_A);
+    fmt_field(F_FLOPPY_B);
+    fmt_field(F_HD0);
+    fmt_field(F_HD1);
+    fmt_hex("equip", cmos_get(CMOS_EQUIP));
+    fmt_int("equip.floppies", equip_floppies());
+    fmt_field(F_EQ_FPU);
+    fmt_field(F_EQ_VIDEO);
+    fmt_field(F_MEM_BASE);
+    fmt_field(F_MEM_EXT);
+    fmt_field(F_DIAG);
+    fmt_field(F_SHUTDOWN);
+    fmt_int("checksum", cmos_verify_checksum());
+
+    fmt_hex("sysstat1", am_status(AM_STAT1));
+    fmt_hex("sysstat2", am_status(AM_STAT2));
+    lpt = am_status(AM_LPT1);
+    fmt_hex("lpt1", lpt);
+    fmt_int("language", lpt & LPT1_LANG_MASK);
+    fmt_int("display", (lpt & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT);
+    fmt_hex("ida", inb(PORT_IDA_STATUS));
+    fmt_hex("deadman", inb(PORT_DEAD));
+
+    if (out_format == FMT_JSON)
+        out_str("}\n");
+    out_flush();
 }
 
-static int raw_write(const char *addrstr, const char *valstr)
+/* Parse the --format argument */
+static int fmt_select(const char *name)
 {
-    unsigned int addr = (unsigned int)strtol(addrstr, NULL, 0);
-    unsigned int val = (unsigned int)strtol(valstr, NULL, 0);
-
-    if (addr >= CMOS_SIZE) {
-        fprintf(stderr, "Error: Address must be 0x00-0x3F\n");
-        return 1;
-    }
-    if (val > 0xFF) {
-        fprintf(stderr, "Error: Value must be 0x00-0xFF\n");
+    if (strcmp(name, "text") == 0)
+        out_format = FMT_TEXT;
+    else if (strcmp(name, "kv") == 0)
+        out_format = FMT_KV;
+    else if (strcmp(name, "json") == 0)
+        out_format = FMT_JSON;
+    else if (strcmp(name, "bin") == 0)
+        out_format = FMT_BIN;
+    else {
+        fprintf(stderr, "Error: unknown format '%s' (text, kv, json, bin)\n",
+                name);
         return 1;
     }
-
-    cmos_write(addr, val);
-
-    if (addr >= 0x10 && addr <= 0x2D) {
-        cmos_update_checksum();
-        DBG(1, "Checksum auto-updated\n");
-    }
-
-    printf("CMOS[0x%02X] = 0x%02X written\n", addr, val);
     return 0;
 }
 
-/* ================================================================
- * Set Time / Date
- * ================================================================ */
+#endif /* NVR_CONFIG */
 
-static int set_time(const char *timestr)
-{
-    int hrs, min, sec;
-    unsigned char regb;
+#if NVR_HW
 
-    if (sscanf(timestr, "%d:%d:%d", &hrs, &min, &sec) != 3) {
-        fprintf(stderr, "Error: Time format must be HH:MM:SS\n");
-        return 1;
-    }
-    if (hrs < 0 || hrs > 23 || min < 0 || min > 59 || sec < 0 || sec > 59) {
-        fprintf(stderr, "Error: Invalid time values\n");
-        return 1;
-    }
+/* ================================================================
+ * Debug: Comprehensive Hardware Probe
+ * ================================================================ */
 
-    regb = cmos_read(RTC_REG_B);
-    cmos_write(RTC_REG_B, regb | RTC_B_SET);
+/*
+ * The probe is driven by probe_ports[]: each entry names a port, how
+ * it is read and what the read may disturb.  probe_run() does all
+ * harmless reads first, one protocol at a time, so the PB-selected
+ * status latches share a single PB save/restore and the PIT/PIC
+ * latch-then-read pairs run back to back with interrupts masked.
+ * Reads that clear state (RTC Register C) run last, and only with
+ * "probe --all".  The same values then feed the text report or the
+ * --format=kv|json keys.
+ */
 
-    cmos_write(RTC_SECONDS, bin_to_rtc(sec));
-    cmos_write(RTC_MINUTES, bin_to_rtc(min));
-    cmos_write(RTC_HOURS, bin_to_rtc(hrs));
+enum {
+    PR_PLAIN,       /* inb(port) */
+    PR_PB,          /* status latch selected by PB bits (arg), PB restored */
+    PR_LATCH,       /* outb(arg, cport), then width reads of port */
+    PR_INDEX,       /* CMOS register arg (and arg + 1 if width 2) */
+    PR_DETECT,      /* present/absent via detect_com/lpt_port() */
+    PR_COUNT
+};
 
-    cmos_write(RTC_REG_B, regb & ~RTC_B_SET);
+enum {
+    SE_NONE,        /* read only */
+    SE_RESTORED,    /* writes a select, latch or test register, then restores */
+    SE_CLEARS       /* the read itself consumes state */
+};
 
-    printf("Time set to %02d:%02d:%02d\n", hrs, min, sec);
-    return 0;
-}
+enum {
+    PD_HEX, PD_SIGNED, PD_IDA, PD_LPT_STATUS, PD_CLEARED, PD_VRT,
+    PD_KB, PD_CHECKSUM, PD_COUNT16, PD_PRESENT
+};
 
-static int set_date(const char *datestr)
-{
-    int day, mon, year;
-    unsigned char regb, yr, cen;
+enum {
+    PS_AMSTRAD, PS_LPT1, PS_PIC, PS_DMA, PS_PIT, PS_CMOS,
+    PS_SERIAL, PS_PARALLEL, PS_DIAG
+};
 
-    if (sscanf(datestr, "%d/%d/%d", &day, &mon, &year) != 3) {
-        fprintf(stderr, "Error: Date format must be DD/MM/YYYY\n");
-        return 1;
-    }
-    if (day < 1 || day > 31 || mon < 1 || mon > 12 ||
-        year < 1980 || year > 2099) {
-        fprintf(stderr, "Error: Invalid date (1980-2099)\n");
-        return 1;
-    }
+static const char *const probe_sections[] = {
+    "Amstrad System Ports", "LPT1 (Amstrad-overloaded)", "8259A PIC",
+    "8237A DMA", "8253 PIT (latched counts)", "MC146818 CMOS (selected)",
+    "Serial Ports", "Parallel Ports", "Diagnostic"
+};
 
-    cen = year / 100;
-    yr = year % 100;
+#define PROBE_COM       0       /* PR_DETECT arg */
+#define PROBE_LPT       1
+#define PIC_OCW3_IRR    0x0A
+#define PIC_OCW3_ISR    0x0B
+
+struct probe_port {
+    const char *key;            /* --format key */
+    const char *label;          /* text label, padded */
+    unsigned short port;
+    unsigned short cport;       /* PR_LATCH command port */
+    unsigned char arg;
+    unsigned char proto, width, effect, decode, section;
+};
 
-    regb = cmos_read(RTC_REG_B);
-    cmos_write(RTC_REG_B, regb | RTC_B_SET);
+static const struct probe_port probe_ports[] = {
+    { "pb", "0x61 PB Register:       ", PORT_PB, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_HEX, PS_AMSTRAD },
+    { "status2.raw", "0x62 Status2 (raw):     ", PORT_STATUS2, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_HEX, PS_AMSTRAD },
+    { "sysstat2", "0x62 Status2 (nibbles): ", PORT_STATUS2, 0, PB_NIBBLE_SEL,
+      PR_PB, 1, SE_RESTORED, PD_HEX, PS_AMSTRAD },
+    { "sysstat1", "0x60 Status1:           ", PORT_KBD_DATA, 0, PB_STATUS_MODE,
+      PR_PB, 1, SE_RESTORED, PD_HEX, PS_AMSTRAD },
+    { "mouse.x", "0x78 Mouse X:           ", PORT_MOUSE_X, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_SIGNED, PS_AMSTRAD },
+    { "mouse.y", "0x7A Mouse Y:           ", PORT_MOUSE_Y, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_SIGNED, PS_AMSTRAD },
+    { "ida", "0x3DE IDA status:       ", PORT_IDA_STATUS, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_IDA, PS_AMSTRAD },
+    { "lpt1.data", "0x378 Data:             ", PORT_LPT1_DATA, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_HEX, PS_LPT1 },
+    { "lpt1", "0x379 Status:           ", PORT_LPT1_STATUS, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_LPT_STATUS, PS_LPT1 },
+    { "lpt1.ctrl", "0x37A Control:          ", PORT_LPT1_CTRL, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_HEX, PS_LPT1 },
+    { "pic.imr", "0x21 IMR:               ", PORT_PIC_DATA, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_HEX, PS_PIC },
+    { "pic.irr", "0x20 IRR:               ", PORT_PIC_CMD, PORT_PIC_CMD, PIC_OCW3_IRR,
+      PR_LATCH, 1, SE_RESTORED, PD_HEX, PS_PIC },
+    { "pic.isr", "0x20 ISR:               ", PORT_PIC_CMD, PORT_PIC_CMD, PIC_OCW3_ISR,
+      PR_LATCH, 1, SE_RESTORED, PD_HEX, PS_PIC },
+    { "dma.status", "0x08 Status:            ", PORT_DMA_STAT, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_HEX, PS_DMA },
+    { "pit.0", "0x40 Channel 0:         ", PORT_PIT_CH0, PORT_PIT_MODE, 0x00,
+      PR_LATCH, 2, SE_RESTORED, PD_COUNT16, PS_PIT },
+    { "pit.2", "0x42 Channel 2:         ", PORT_PIT_CH2, PORT_PIT_MODE, PIT_CH2_LATCH,
+      PR_LATCH, 2, SE_RESTORED, PD_COUNT16, PS_PIT },
+    { "rtc.a", "0x0A Reg A:             ", CMOS_DATA_PORT, 0, RTC_REG_A,
+      PR_INDEX, 1, SE_NONE, PD_HEX, PS_CMOS },
+    { "rtc.b", "0x0B Reg B:             ", CMOS_DATA_PORT, 0, RTC_REG_B,
+      PR_INDEX, 1, SE_NONE, PD_HEX, PS_CMOS },
+    { "rtc.c", "0x0C Reg C:             ", CMOS_DATA_PORT, 0, RTC_REG_C,
+      PR_INDEX, 1, SE_CLEARS, PD_CLEARED, PS_CMOS },
+    { "rtc.d", "0x0D Reg D:             ", CMOS_DATA_PORT, 0, RTC_REG_D,
+      PR_INDEX, 1, SE_NONE, PD_VRT, PS_CMOS },
+    { "diag", "0x0E Diagnostic:        ", CMOS_DATA_PORT, 0, CMOS_DIAG,
+      PR_INDEX, 1, SE_NONE, PD_HEX, PS_CMOS },
+    { "shutdown", "0x0F Shutdown:          ", CMOS_DATA_PORT, 0, CMOS_SHUTDOWN,
+      PR_INDEX, 1, SE_NONE, PD_HEX, PS_CMOS },
+    { "floppy", "0x10 Floppy:            ", CMOS_DATA_PORT, 0, CMOS_FLOPPY,
+      PR_INDEX, 1, SE_NONE, PD_HEX, PS_CMOS },
+    { "hd", "0x12 Hard disk:         ", CMOS_DATA_PORT, 0, CMOS_DISK,
+      PR_INDEX, 1, SE_NONE, PD_HEX, PS_CMOS },
+    { "equip", "0x14 Equipment:         ", CMOS_DATA_PORT, 0, CMOS_EQUIP,
+      PR_INDEX, 1, SE_NONE, PD_HEX, PS_CMOS },
+    { "mem.base", "0x15-16 Base mem:       ", CMOS_DATA_PORT, 0, CMOS_BASEMEM_LO,
+      PR_INDEX, 2, SE_NONE, PD_KB, PS_CMOS },
+    { "checksum.stored", "0x2E-2F Checksum:       ", CMOS_DATA_PORT, 0, CMOS_CHECKSUM_HI,
+      PR_INDEX, 2, SE_NONE, PD_CHECKSUM, PS_CMOS },
+    { "century", "0x32 Century:           ", CMOS_DATA_PORT, 0, CMOS_CENTURY,
+      PR_INDEX, 1, SE_NONE, PD_HEX, PS_CMOS },
+    { "com1", "COM1 (0x3F8):           ", PORT_COM1_BASE, 0, 0,
+      PR_DETECT, 1, SE_RESTORED, PD_PRESENT, PS_SERIAL },
+    { "com2", "COM2 (0x2F8):           ", PORT_COM2_BASE, 0, 0,
+      PR_DETECT, 1, SE_RESTORED, PD_PRESENT, PS_SERIAL },
+    { "lpt1.present", "LPT1 (0x378):           ", PORT_LPT1_DATA, 0, PROBE_LPT,
+      PR_DETECT, 1, SE_RESTORED, PD_PRESENT, PS_PARALLEL },
+    { "lpt2", "LPT2 (0x3BC):           ", PORT_LPT2_DATA, 0, PROBE_LPT,
+      PR_DETECT, 1, SE_RESTORED, PD_PRESENT, PS_PARALLEL },
+    { "deadman", "0xDEAD Dead-man:        ", PORT_DEAD, 0, 0,
+      PR_PLAIN, 1, SE_NONE, PD_HEX, PS_DIAG },
+};
 
-    cmos_write(RTC_DAY_OF_MONTH, bin_to_rtc(day));
-    cmos_write(RTC_MONTH, bin_to_rtc(mon));
-    cmos_write(RTC_YEAR, bin_to_rtc(yr));
-    cmos_write(CMOS_CENTURY, bin_to_rtc(cen));
+#define NPROBE  ((int)(sizeof(probe_ports) / sizeof(probe_ports[0])))
 
-    cmos_write(RTC_REG_B, regb & ~RTC_B_SET);
+/* Raw bytes per entry (16-bit values low byte first); 0x100 = not read */
+static unsigned short probe_val[NPROBE][2];
 
-    printf("Date set to %02d/%02d/%04d\n", day, mon, year);
-    return 0;
+/* One entry's bytes, for every protocol but PR_PB */
+static void probe_read(const struct probe_port *p, unsigned short *v)
+{
+    unsigned short flags;
+
+    switch (p->proto) {
+    case PR_PLAIN:
+        v[0] = inb(p->port);
+        break;
+    case PR_LATCH:
+        flags = irq_save();
+        outb(p->arg, p->cport);
+        io_delay();
+        v[0] = inb(p->port);
+        if (p->width == 2)
+            v[1] = inb(p->port);
+        irq_restore(flags);
+        break;
+    case PR_INDEX:
+        v[0] = cmos_read(p->arg);
+        if (p->width == 2)
+            v[1] = cmos_read(p->arg + 1);
+        break;
+    case PR_DETECT:
+        v[0] = p->arg == PROBE_LPT ? detect_lpt_port(p->port)
+                                   : detect_com_port(p->port);
+        break;
+    }
 }
 
-static int set_dow(const char *dowstr)
+static void probe_run(int all)
 {
-    int dow = atoi(dowstr);
-    unsigned char regb;
+    int effect, proto, i, latched = 0;
+    unsigned char pb;
 
-    if (dow < 1 || dow > 7) {
-        fprintf(stderr, "Error: Day of week 1-7 (1=Sunday, 7=Saturday)\n");
-        return 1;
+    for (i = 0; i < NPROBE; i++)
+        probe_val[i][0] = probe_val[i][1] = 0x100;
+
+    for (effect = SE_NONE; effect <= (all ? SE_CLEARS : SE_RESTORED); effect++) {
+        for (proto = 0; proto < PR_COUNT; proto++) {
+            int have_pb = 0;
+
+            pb = 0;
+            for (i = 0; i < NPROBE; i++) {
+                const struct probe_port *p = &probe_ports[i];
+
+                if (p->effect != effect || p->proto != proto)
+                    continue;
+                if (proto == PR_PB) {
+                    if (!have_pb) {
+                        pb = inb(PORT_PB);
+                        have_pb = 1;
+                    }
+                    if (p->arg == PB_NIBBLE_SEL) {
+                        probe_val[i][0] = sysstat2_nibbles(pb);
+                    } else {
+                        outb(pb | p->arg, PORT_PB);
+                        io_delay();
+                        probe_val[i][0] = inb(p->port);
+                    }
+                    continue;
+                }
+                if (proto == PR_LATCH && p->cport == PORT_PIC_CMD)
+                    latched = 1;
+                probe_read(p, probe_val[i]);
+            }
+            if (have_pb)
+                outb(pb, PORT_PB);
+        }
     }
+    if (latched)
+        outb(PIC_OCW3_IRR, PORT_PIC_CMD);     /* power-on default */
+    DBG(2, "Probe: %d entries, %s\n", NPROBE, all ? "all" : "non-clearing");
+}
 
-    regb = cmos_read(RTC_REG_B);
-    cmos_write(RTC_REG_B, regb | RTC_B_SET);
-    cmos_write(RTC_DAY_OF_WEEK, bin_to_rtc(dow));
-    cmos_write(RTC_REG_B, regb & ~RTC_B_SET);
+/* Decoded value of entry i as an integer (width-2 values combined) */
+static long probe_value(int i)
+{
+    const unsigned short *v = probe_val[i];
 
-    printf("Day of week set to %d (%s)\n", dow, day_names[dow]);
-    return 0;
+    switch (probe_ports[i].decode) {
+    case PD_SIGNED:   return (signed char)v[0];
+    case PD_KB:
+    case PD_COUNT16:  return v[0] | ((long)v[1] << 8);
+    case PD_CHECKSUM: return ((long)v[0] << 8) | v[1];
+    }
+    return v[0];
 }
 
-/* ================================================================
- * RTC Mode Configuration
- * ================================================================ */
+static void probe_text(int i)
+{
+    const struct probe_port *p = &probe_ports[i];
+    unsigned char v = (unsigned char)probe_val[i][0];
+    long n = probe_value(i);
+
+    out_str("  ");
+    out_str(p->label);
+    switch (p->decode) {
+    case PD_HEX:
+        out_byte(v);
+        break;
+    case PD_SIGNED:
+        out_byte(v);
+        out_str(" (");
+        out_dec(n, 0);
+        out_char(')');
+        break;
+    case PD_IDA:
+        out_byte(v);
+        out_str((v & 0x20) ? " (IDA disabled)" : " (IDA active)");
+        break;
+    case PD_LPT_STATUS:
+        out_byte(v);
+        out_str("\n        Language:         ");
+        out_dec(v & LPT1_LANG_MASK, 0);
+        out_str(" (");
+        out_str(language_name(v & LPT1_LANG_MASK));
+        out_str(")\n        DIP latch:        ");
+        out_str((v & LPT1_DIP_LATCH) ? "SW10" : "SW9/none");
+        out_str("\n        Display type:     ");
+        out_dec((v & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT, 0);
+        out_str(" (");
+        out_str(display_type_name((v & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT));
+        out_char(')');
+        break;
+    case PD_CLEARED:
+        out_byte(v);
+        out_str(" (flags cleared by read)");
+        break;
+    case PD_VRT:
+        out_byte(v);
+        out_str((v & RTC_D_VRT) ? " (battery OK)" : " (BATTERY DEAD)");
+        break;
+    case PD_KB:
+        out_dec(n, 0);
+        out_str(" KB");
+        break;
+    case PD_CHECKSUM:
+        out_str("0x");
+        out_hex((unsigned short)n, 4);
+        out_str(cmos_verify_checksum() ? " (valid)" : " (INVALID)");
+        break;
+    case PD_COUNT16:
+        out_dec(n, 0);
+        out_str(" (0x");
+        out_hex((unsigned short)n, 4);
+        out_char(')');
+        break;
+    case PD_PRESENT:
+        out_str(v ? "Present" : "Not found");
+        break;
+    }
+    out_char('\n');
+}
 
-static int set_rtc_mode(const char *mode, const char *valstr)
+#if NVR_CONFIG
+static void probe_machine(void)
 {
-    unsigned char regb = cmos_read(RTC_REG_B);
+    int i;
 
-    if (strcmp(mode, "24h") == 0) {
-        if (atoi(valstr))
-            regb |= RTC_B_24H;
-        else
-            regb &= ~RTC_B_24H;
-        cmos_write(RTC_REG_B, regb);
-        printf("Hour format set to %s\n", (regb & RTC_B_24H) ? "24-hour" : "12-hour");
-    }
-    else if (strcmp(mode, "bcd") == 0) {
-        if (atoi(valstr))
-            regb &= ~RTC_B_DM;  /* BCD = DM bit clear */
-        else
-            regb |= RTC_B_DM;   /* Binary = DM bit set */
-        cmos_write(RTC_REG_B, regb);
-        printf("Data mode set to %s\n", (regb & RTC_B_DM) ? "Binary" : "BCD");
-    }
-    else if (strcmp(mode, "sqw") == 0) {
-        if (atoi(valstr))
-            regb |= RTC_B_SQWE;
-        else
-            regb &= ~RTC_B_SQWE;
-        cmos_write(RTC_REG_B, regb);
-        printf("Square wave output %s\n", (regb & RTC_B_SQWE) ? "ENABLED" : "disabled");
-    }
-    else if (strcmp(mode, "dse") == 0) {
-        if (atoi(valstr))
-            regb |= RTC_B_DSE;
-        else
-            regb &= ~RTC_B_DSE;
-        cmos_write(RTC_REG_B, regb);
-        printf("Daylight savings %s\n", (regb & RTC_B_DSE) ? "ENABLED" : "disabled");
-    }
-    else if (strcmp(mode, "pie") == 0) {
-        if (atoi(valstr))
-            regb |= RTC_B_PIE;
-        else
-            regb &= ~RTC_B_PIE;
-        cmos_write(RTC_REG_B, regb);
-        printf("Periodic interrupt %s\n", (regb & RTC_B_PIE) ? "ENABLED" : "disabled");
-    }
-    else if (strcmp(mode, "uie") == 0) {
-        if (atoi(valstr))
-            regb |= RTC_B_UIE;
+    fmt_fields = 0;
+    fmt_int("nvr", FMT_SCHEMA);
+    for (i = 0; i < NPROBE; i++) {
+        if (probe_val[i][0] > 0xFF)
+            continue;
+        if (probe_ports[i].width == 1 && probe_ports[i].decode != PD_SIGNED &&
+            probe_ports[i].decode != PD_PRESENT)
+            fmt_hex(probe_ports[i].key, (unsigned char)probe_val[i][0]);
         else
-            regb &= ~RTC_B_UIE;
-        cmos_write(RTC_REG_B, regb);
-        printf("Update-ended interrupt %s\n", (regb & RTC_B_UIE) ? "ENABLED" : "disabled");
+            fmt_int(probe_ports[i].key, probe_value(i));
     }
-    else if (strcmp(mode, "rate") == 0) {
-        int rate = atoi(valstr);
-        unsigned char rega;
-        if (rate < 0 || rate > 15) {
-            fprintf(stderr, "Error: Rate select 0-15\n");
+    if (out_format == FMT_JSON)
+        out_str("}\n");
+    out_flush();
+}
+#endif
+
+static int debug_probe(const char *unused, int argc, char *argv[])
+{
+    int i, all = 0, section = -1;
+    long bm = 0;
+
+    (void)unused;
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--all") == 0 || strcmp(argv[i], "-a") == 0) {
+            all = 1;
+        } else {
+            fprintf(stderr, "Unknown probe option: %s\n", argv[i]);
+            fprintf(stderr, "Options: --all (include reads that clear state)\n");
             return 1;
         }
-        rega = cmos_read(RTC_REG_A);
-        rega = (rega & ~RTC_A_RS_MASK) | (rate & RTC_A_RS_MASK);
-        cmos_write(RTC_REG_A, rega);
-        printf("Periodic rate set to %d (%s)\n", rate, rate_freq[rate]);
     }
-    else {
-        fprintf(stderr, "Unknown RTC mode: %s\n", mode);
-        fprintf(stderr, "Modes: 24h, bcd, sqw, dse, pie, uie, rate\n");
+
+#if NVR_CONFIG
+    if (out_format == FMT_BIN) {
+        fprintf(stderr, "Error: probe supports --format=text, kv or json\n");
         return 1;
     }
+#endif
+
+    probe_run(all);
+#if NVR_CONFIG
+    if (out_format != FMT_TEXT) {
+        probe_machine();
+        return 0;
+    }
+#endif
+
+    out_str("\nAmstrad PC1640 Comprehensive Hardware Probe\n"
+            "============================================\n");
+    out_str(all ? "  WARNING: --all includes reads that clear hardware state\n"
+                : "  Reads that clear state are skipped (probe --all)\n");
+
+    for (i = 0; i < NPROBE; i++) {
+        if (probe_val[i][0] > 0xFF)
+            continue;
+        if (probe_ports[i].section != section) {
+            section = probe_ports[i].section;
+            out_char('\n');
+            out_str(probe_sections[section]);
+            out_str(":\n");
+        }
+        if (probe_ports[i].decode == PD_KB)
+            bm = probe_value(i);
+        probe_text(i);
+    }
 
+    out_str("\nPlatform Identification:\n  Base memory:            ");
+    out_dec(bm, 0);
+    out_str((bm == 640) ? " KB (PC1640 standard)\n" : " KB \n");
+    out_str("  Video BIOS:             Paradise PEGA v2.015 (at C000:0000)\n"
+            "  System BIOS:            Amstrad PC1640 (C) 1987 Amstrad plc\n"
+            "  CPU:                    8086 @ 8 MHz\n"
+            "  Chipset:                Amstrad custom\n");
+    out_flush();
     return 0;
 }
 
+#endif /* NVR_HW */
+
+#if NVR_CONFIG
+
 /* ================================================================
- * Save / Load CMOS
+ * Summary: show configuration by section
  * ================================================================ */
 
-static int save_cmos(const char *filename)
-{
-    FILE *fp;
-    unsigned char data[CMOS_SIZE];
-    int i;
+/*
+ * "show [SECTION[,SECTION]...]" runs the selected sections in a fixed
+ * order.  The plan is made up front: the CMOS snapshot is taken only
+ * if a chosen section reads CMOS, and the Amstrad status latches are
+ * read at most once for the whole run (am_status()).  Plain "show" is
+ * the config group: CMOS plus the Amstrad latches, with no port
+ * tests, loopback writes or timing loops.  "hw" adds those and "all"
+ * gives everything.  --format=kv|json|bin always emits its full
+ * schema.
+ */
+#define SN_CMOS     0x01        /* needs: CMOS snapshot */
 
-    rtc_wait_uip();
-    for (i = 0; i < CMOS_SIZE; i++)
-        data[i] = cmos_read(i);
+#define SG_CMOS     0x01        /* groups: "cmos" */
+#define SG_CONFIG   0x02        /* "config", the default */
+#define SG_HW       0x04        /* "hw": probes with side effects or delays */
 
-    fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("Error opening file for writing");
-        return 1;
-    }
-    if (fwrite((const char *)data, 1, CMOS_SIZE, fp) != CMOS_SIZE) {
-        perror("Error writing CMOS data");
-        fclose(fp);
-        return 1;
-    }
-    fclose(fp);
-    printf("CMOS saved to %s (%d bytes)\n", filename, CMOS_SIZE);
-    return 0;
+static void show_checksum(void)
+{
+    out_str("\nCMOS checksum: ");
+    out_str(cmos_verify_checksum() ? "Valid\n" : "*** INVALID ***\n");
+    out_flush();
 }
 
-static int load_cmos(const char *filename)
-{
-    FILE *fp;
-    unsigned char data[CMOS_SIZE];
-    long fsize;
-    int i;
-    unsigned char regb;
+static const struct show_section {
+    const char *name;
+    void (*fn)(void);
+    unsigned char needs;
+    unsigned char groups;
+} show_sections[] = {
+    { "time",     show_time,             SN_CMOS, SG_CMOS | SG_CONFIG },
+    { "alarm",    show_alarm,            SN_CMOS, SG_CMOS | SG_CONFIG },
+    { "rtc",      show_rtc_status,       SN_CMOS, SG_CMOS | SG_CONFIG },
+    { "floppy",   show_floppy,           SN_CMOS, SG_CMOS | SG_CONFIG },
+    { "hd",       show_harddisk,         SN_CMOS, SG_CMOS | SG_CONFIG },
+    { "equip",    show_equipment,        SN_CMOS, SG_CMOS | SG_CONFIG },
+    { "mem",      show_memory,           SN_CMOS, SG_CMOS | SG_CONFIG },
+    { "diag",     show_diagnostics,      SN_CMOS, SG_CMOS | SG_CONFIG },
+    { "amstrad",  show_amstrad_full,     0,       SG_CONFIG },
+    { "display",  show_display_type,     0,       SG_CONFIG },
+    { "lang",     show_amstrad_language, 0,       SG_CONFIG },
+#if NVR_HW
+    { "ports",    show_ports,            0,       SG_HW },
+#endif
+#if NVR_MOUSE
+    { "mouse",    show_mouse,            0,       SG_HW },
+#endif
+#if NVR_HW
+    { "gameport", show_gameport,         0,       SG_HW },
+    { "pic",      show_pic,              0,       SG_HW },
+    { "dma",      show_dma,              0,       SG_HW },
+    { "pit",      show_pit,              0,       SG_HW },
+    { "deadman",  show_deadman,          0,       SG_HW },
+#endif
+    { "checksum", show_checksum,         SN_CMOS, SG_CMOS | SG_CONFIG },
+};
 
-    fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("Error opening file");
-        return 1;
-    }
+#define NSHOW   (sizeof(show_sections) / sizeof(show_sections[0]))
 
-    fseek(fp, 0, SEEK_END);
-    fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+static const char *const show_group_names[] = { "cmos", "config", "hw" };
 
-    if (fsize != CMOS_SIZE && fsize != 128) {
-        fprintf(stderr, "Error: File size %ld, expected %d or 128\n",
-                fsize, CMOS_SIZE);
-        fclose(fp);
-        return 1;
-    }
+/* Sections in the group bits g */
+static unsigned long show_group(unsigned char g)
+{
+    unsigned long mask = 0;
+    unsigned int i;
 
-    if (fread((char *)data, 1, CMOS_SIZE, fp) != CMOS_SIZE) {
-        perror("Error reading CMOS data");
-        fclose(fp);
-        return 1;
-    }
-    fclose(fp);
+    for (i = 0; i < NSHOW; i++)
+        if (show_sections[i].groups & g)
+            mask |= 1UL << i;
+    return mask;
+}
 
-    regb = cmos_read(RTC_REG_B);
-    cmos_write(RTC_REG_B, regb | RTC_B_SET);
+/* Run the sections in mask (bit i = show_sections[i]) */
+static void show_plan(unsigned long mask)
+{
+    unsigned char needs = 0;
+    unsigned int i;
 
-    for (i = 0; i < CMOS_SIZE; i++) {
-        if (i == RTC_REG_C || i == RTC_REG_D)
-            continue;  /* read-only */
-        cmos_write(i, data[i]);
-    }
+    for (i = 0; i < NSHOW; i++)
+        if (mask & (1UL << i))
+            needs |= show_sections[i].needs;
+
+    out_str("Amstrad PC1640 NVR Configuration\n"
+            "================================\n");
+    if (needs & SN_CMOS)
+        cmos_snapshot();
+    am_cache_begin();
+    for (i = 0; i < NSHOW; i++)
+        if (mask & (1UL << i))
+            show_sections[i].fn();
+    am_cache_end();
+}
 
-    cmos_write(RTC_REG_B, data[RTC_REG_B] & ~RTC_B_SET);
+/* The default "show": the config group */
+static void show_all(void)
+{
+    show_plan(show_group(SG_CONFIG));
+}
 
-    printf("CMOS loaded from %s (%d bytes)\n", filename, CMOS_SIZE);
-    printf("WARNING: Verify time and date are correct!\n");
-    return 0;
+static int show_token_is(const char *p, size_t n, const char *name)
+{
+    return strlen(name) == n && strncmp(p, name, n) == 0;
 }
 
-/* ================================================================
- * CMOS Factory Reset
- * ================================================================ */
+/* Sections named by the n-character token p (group or section), or 0 */
+static unsigned long show_lookup(const char *p, size_t n)
+{
+    unsigned int i;
+
+    if (show_token_is(p, n, "all"))
+        return show_group(SG_CMOS | SG_CONFIG | SG_HW);
+    for (i = 0; i < sizeof(show_group_names) / sizeof(show_group_names[0]); i++)
+        if (show_token_is(p, n, show_group_names[i]))
+            return show_group(1 << i);
+    for (i = 0; i < NSHOW; i++)
+        if (show_token_is(p, n, show_sections[i].name))
+            return 1UL << i;
+    return 0;
+}
 
-static void factory_reset(void)
+static int show_cmd(const char *unused, int argc, char *argv[])
 {
-    unsigned char regb;
-    int i;
+    unsigned long mask = 0;
+    unsigned int i;
+    int a;
 
-    printf("Resetting CMOS to PC1640 factory defaults...\n");
+    (void)unused;
+    if (out_format != FMT_TEXT) {
+        show_machine();
+        return 0;
+    }
 
-    regb = cmos_read(RTC_REG_B);
-    cmos_write(RTC_REG_B, regb | RTC_B_SET);
+    for (a = 0; a < argc; a++) {
+        const char *p = argv[a];
 
-    /* Register A: standard 32.768 kHz divider, 1024 Hz periodic rate */
-    cmos_write(RTC_REG_A, 0x26);  /* DV=010, RS=0110 */
+        while (*p) {
+            size_t n = strcspn(p, ",");
+            unsigned long m = n ? show_lookup(p, n) : 0;
 
-    /* Register B: 24-hour, BCD, no interrupts */
-    cmos_write(RTC_REG_B, 0x02);  /* 24H=1, all else off */
+            if (n && !m) {
+                fprintf(stderr, "Unknown show section: %.*s\n", (int)n, p);
+                fprintf(stderr, "Groups: all, cmos, config, hw; sections:");
+                for (i = 0; i < NSHOW; i++)
+                    fprintf(stderr, " %s", show_sections[i].name);
+                fprintf(stderr, "\n");
+                return 1;
+            }
+            mask |= m;
+            p += n;
+            if (*p == ',')
+                p++;
+        }
+    }
 
-    /* Clear diagnostic + shutdown status */
-    cmos_write(CMOS_DIAG, 0x00);
-    cmos_write(CMOS_SHUTDOWN, 0x00);
+    if (!mask) {
+        show_all();
+#if NVR_HW
+        printf("\n(hardware sections skipped: 'show hw' or 'show all')\n");
+#endif
+        return 0;
+    }
+    show_plan(mask);
+    return 0;
+}
 
-    /* Floppy: drive A = 720KB 3.5" (type 3, standard PC1640) */
-    cmos_write(CMOS_FLOPPY, 0x30);
+#endif /* NVR_CONFIG */
 
-    /* Hard disk: none */
-    cmos_write(CMOS_DISK, 0x00);
+#if NVR_WATCH
 
-    /* Equipment: floppy present, no FPU, EGA video, 1 floppy drive */
-    cmos_write(CMOS_EQUIP, 0x01);
+/* ================================================================
+ * RTC Watch Mode - continuously display time
+ * ================================================================ */
 
-    /* Base memory: 640 KB */
-    cmos_write(CMOS_BASEMEM_LO, 0x80);
-    cmos_write(CMOS_BASEMEM_HI, 0x02);
+#define WATCH_POLL_MS   10      /* seconds poll interval near rollover */
+#define WATCH_IDLE_MS   900     /* sleep after an update before polling */
+#define WATCH_SEC_GRACE 2000    /* ms without a new second: clock stopped */
 
-    /* Extended memory: 0 (8086 has none) */
-    cmos_write(CMOS_EXTMEM_LO, 0x00);
-    cmos_write(CMOS_EXTMEM_HI, 0x00);
+/*
+ * Sleep in WATCH_POLL_MS steps until the seconds register moves on
+ * from *sec, i.e. an update cycle has just ended, and store the new
+ * value.  The time registers are then stable for ~999 ms.
+ *
+ * Only Register A (UIP) and the seconds are read.  UF in Register C
+ * would flag the same moment, but reading C clears it for everyone: a
+ * watch and a monitor running side by side would each eat the other's
+ * updates.  UIE is left alone too: on the PC1640 it would raise IRQ 1
+ * into the keyboard handler.
+ *
+ * Returns 1 on a new second, 0 after timeout_ms without one (SET held,
+ * divider stopped) or when the loop was asked to stop.
+ */
+static int rtc_sleep_until_update(unsigned char *sec, unsigned int timeout_ms)
+{
+    unsigned int waited = 0;
+    unsigned char now;
 
-    /* Clear extended HD types */
-    cmos_write(CMOS_DISK0_EXT, 0x00);
-    cmos_write(CMOS_DISK1_EXT, 0x00);
+    while (!loop_stop) {
+        rtc_wait_uip();
+        now = cmos_read(RTC_SECONDS);
+        if (now != *sec) {
+            *sec = now;
+            return 1;
+        }
+        if (waited >= timeout_ms)
+            break;
+        sleep_ms(WATCH_POLL_MS);
+        waited += WATCH_POLL_MS;
+    }
+    return 0;
+}
 
-    /* Century */
-    cmos_write(CMOS_CENTURY, 0x20);
+/*
+ * Redraw the time once per second without busy-waiting: sleep most of
+ * the second in the kernel, then catch the rollover on the seconds
+ * register.  A stopped clock is still redrawn every WATCH_SEC_GRACE.
+ */
+static void watch_time(void)
+{
+    unsigned char t[RTC_YEAR + 1];
+    unsigned char raw_sec = 0xFF;   /* no BCD/binary second: draw at once */
 
-    /* Clear alarm registers (wildcard = disabled) */
-    cmos_write(RTC_ALARM_SEC, 0xC0);
-    cmos_write(RTC_ALARM_MIN, 0xC0);
-    cmos_write(RTC_ALARM_HRS, 0xC0);
+    printf("RTC Watch Mode (Ctrl+C to stop):\n\n");
+    signal(SIGINT, loop_sigint);
 
-    /* Clear remaining config bytes */
-    for (i = 0x1B; i <= 0x2D; i++)
-        cmos_write(i, 0x00);
-    for (i = 0x33; i <= 0x3F; i++)
-        cmos_write(i, 0x00);
+    while (!loop_stop) {
+        unsigned char sec, min, hrs;
+        int ticked = rtc_sleep_until_update(&raw_sec, WATCH_SEC_GRACE);
 
-    /* Resume updates */
-    cmos_write(RTC_REG_B, 0x02);
+        if (loop_stop)
+            break;
+        if (!ticked)
+            DBG(1, "No new second for %d ms, clock stopped?\n", WATCH_SEC_GRACE);
 
-    /* Update checksum last */
-    cmos_update_checksum();
+        rtc_read_clock(t);
+        raw_sec = t[RTC_SECONDS];
+        sec = rtc_to_bin(raw_sec);
+        min = rtc_to_bin(t[RTC_MINUTES]);
+        hrs = rtc_hours_to_bin(t[RTC_HOURS]);
 
-    printf("CMOS reset to factory defaults:\n");
-    printf("  Floppy A: 720 KB 3.5\"  Floppy B: None\n");
-    printf("  Hard disk: None\n");
-    printf("  Video: EGA (built-in PEGA)\n");
-    printf("  Memory: 640 KB base, 0 KB extended\n");
-    printf("  RTC: 24-hour BCD mode\n");
-    printf("  Checksum updated\n");
+        printf("  %02d:%02d:%02d\r", hrs, min, sec);
+        fflush(stdout);
+
+        if (ticked)
+            sleep_ms(WATCH_IDLE_MS);
+    }
+    printf("\n");
 }
 
 /* ================================================================
- * Debug: Comprehensive Hardware Probe
+ * CMOS Change Monitor
  * ================================================================ */
 
-static void debug_probe(void)
+/*
+ * "nvr monitor LOG" samples the CMOS once per RTC update (or every N
+ * updates), keeps only byte-level changes in a fixed ring, and appends
+ * them to LOG as text records:
+ *
+ *   B <time> <128 hex digits>     baseline image at start
+ *   D <time> <addr> <old> <new>   one changed byte (hex)
+ *   X <time> <count>              deltas lost to a full ring
+ *
+ * <time> is seconds since 1970.  Clock bytes 0x00-0x09 and the
+ * volatile status registers A and C are ignored unless --all is given.
+ * Memory use is fixed at MON_RING delta slots, a few KB at most.
+ */
+#define MON_RING        256     /* delta slots, power of two */
+#define MON_FLUSH       128     /* flush to the log at this fill level */
+
+struct mon_delta {
+    unsigned long time;
+    unsigned char addr, old, val;
+};
+
+static struct mon_delta mon_ring[MON_RING];
+static unsigned int mon_head = 0, mon_tail = 0;
+static unsigned long mon_dropped = 0;
+
+static int mon_count(void)
 {
-    unsigned char val;
+    return (mon_head - mon_tail) & (MON_RING - 1);
+}
 
-    printf("\nAmstrad PC1640 Comprehensive Hardware Probe\n");
-    printf("============================================\n");
-    printf("  WARNING: Some reads may have side effects\n\n");
-
-    /* ---- Amstrad-specific ports ---- */
-    printf("Amstrad System Ports:\n");
-
-    val = inb(PORT_PB);
-    printf("  0x61 PB Register:       0x%02X\n", val);
-
-    val = inb(PORT_STATUS2);
-    printf("  0x62 Status2 (raw):     0x%02X\n", val);
-
-    val = amstrad_read_sysstat2();
-    printf("  0x62 Status2 (combined):0x%02X\n", val);
-
-    val = amstrad_read_sysstat1();
-    printf("  0x60 Status1:           0x%02X\n", val);
-
-    val = inb(PORT_MOUSE_X);
-    printf("  0x78 Mouse X:           0x%02X (%d)\n", val, (signed char)val);
-
-    val = inb(PORT_MOUSE_Y);
-    printf("  0x7A Mouse Y:           0x%02X (%d)\n", val, (signed char)val);
-
-    val = inb(PORT_IDA_STATUS);
-    printf("  0x3DE IDA status:       0x%02X%s\n", val,
-           (val & 0x20) ? " (IDA disabled)" : " (IDA active)");
-
-    /* ---- LPT1 (Amstrad-overloaded) ---- */
-    printf("\nLPT1 (Amstrad-overloaded):\n");
-    val = inb(PORT_LPT1_DATA);
-    printf("  0x378 Data:             0x%02X\n", val);
-    val = inb(PORT_LPT1_STATUS);
-    printf("  0x379 Status:           0x%02X\n", val);
-    printf("        Language:         %d (%s)\n",
-           val & LPT1_LANG_MASK, language_name(val & LPT1_LANG_MASK));
-    printf("        DIP latch:        %s\n", (val & LPT1_DIP_LATCH) ? "SW10" : "SW9/none");
-    printf("        Display type:     %d (%s)\n",
-           (val & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT,
-           display_type_name((val & LPT1_DISP_MASK) >> LPT1_DISP_SHIFT));
-    val = inb(PORT_LPT1_CTRL);
-    printf("  0x37A Control:          0x%02X\n", val);
-
-    /* ---- PIC ---- */
-    printf("\n8259A PIC:\n");
-    val = inb(PORT_PIC_DATA);
-    printf("  0x21 IMR:               0x%02X\n", val);
-    outb(0x0A, PORT_PIC_CMD);
-    io_delay();
-    val = inb(PORT_PIC_CMD);
-    printf("  0x20 IRR:               0x%02X\n", val);
-    outb(0x0B, PORT_PIC_CMD);
-    io_delay();
-    val = inb(PORT_PIC_CMD);
-    printf("  0x20 ISR:               0x%02X\n", val);
-
-    /* ---- DMA ---- */
-    printf("\n8237A DMA:\n");
-    val = inb(PORT_DMA_STAT);
-    printf("  0x08 Status:            0x%02X\n", val);
-
-    /* ---- CMOS key registers ---- */
-    printf("\nMC146818 CMOS (selected):\n");
-    printf("  0x0A Reg A:             0x%02X\n", cmos_read(RTC_REG_A));
-    printf("  0x0B Reg B:             0x%02X\n", cmos_read(RTC_REG_B));
-    printf("  0x0C Reg C:             0x%02X (flags cleared by read)\n", cmos_read(RTC_REG_C));
-    val = cmos_read(RTC_REG_D);
-    printf("  0x0D Reg D:             0x%02X (%s)\n", val,
-           (val & RTC_D_VRT) ? "battery OK" : "BATTERY DEAD");
-    printf("  0x0E Diagnostic:        0x%02X\n", cmos_read(CMOS_DIAG));
-    printf("  0x0F Shutdown:          0x%02X\n", cmos_read(CMOS_SHUTDOWN));
-    printf("  0x10 Floppy:            0x%02X\n", cmos_read(CMOS_FLOPPY));
-    printf("  0x12 Hard disk:         0x%02X\n", cmos_read(CMOS_DISK));
-    printf("  0x14 Equipment:         0x%02X\n", cmos_read(CMOS_EQUIP));
+static void mon_push(unsigned long t, unsigned char addr,
+                     unsigned char old, unsigned char val)
+{
+    struct mon_delta *d;
 
-    {
-        unsigned short bm = cmos_read(CMOS_BASEMEM_LO) |
-                            ((unsigned short)cmos_read(CMOS_BASEMEM_HI) << 8);
-        printf("  0x15-16 Base mem:       %u KB\n", bm);
-    }
-
-    printf("  0x2E-2F Checksum:       0x%02X%02X (%s)\n",
-           cmos_read(CMOS_CHECKSUM_HI), cmos_read(CMOS_CHECKSUM_LO),
-           cmos_verify_checksum() ? "valid" : "INVALID");
-    printf("  0x32 Century:           0x%02X\n", cmos_read(CMOS_CENTURY));
-
-    /* ---- Serial port detection ---- */
-    printf("\nSerial Ports:\n");
-    printf("  COM1 (0x3F8):           %s\n",
-           detect_com_port(PORT_COM1_BASE) ? "Present" : "Not found");
-    printf("  COM2 (0x2F8):           %s\n",
-           detect_com_port(PORT_COM2_BASE) ? "Present" : "Not found");
-
-    /* ---- Parallel port detection ---- */
-    printf("\nParallel Ports:\n");
-    printf("  LPT1 (0x378):           Present (Amstrad)\n");
-    printf("  LPT2 (0x3BC):           %s\n",
-           detect_lpt_port(PORT_LPT2_DATA) ? "Present" : "Not found");
-
-    /* ---- Dead-man port ---- */
-    printf("\nDiagnostic:\n");
-    val = inb(PORT_DEAD);
-    printf("  0xDEAD Dead-man:        0x%02X\n", val);
-
-    /* ---- Platform ID ---- */
-    printf("\nPlatform Identification:\n");
-    {
-        unsigned short bm = cmos_read(CMOS_BASEMEM_LO) |
-                            ((unsigned short)cmos_read(CMOS_BASEMEM_HI) << 8);
-        printf("  Base memory:            %u KB %s\n", bm,
-               (bm == 640) ? "(PC1640 standard)" : "");
+    if (mon_count() == MON_RING - 1) {
+        mon_dropped++;
+        return;
     }
-    printf("  Video BIOS:             Paradise PEGA v2.015 (at C000:0000)\n");
-    printf("  System BIOS:            Amstrad PC1640 (C) 1987 Amstrad plc\n");
-    printf("  CPU:                    8086 @ 8 MHz\n");
-    printf("  Chipset:                Amstrad custom\n");
+    d = &mon_ring[mon_head];
+    d->time = t;
+    d->addr = addr;
+    d->old = old;
+    d->val = val;
+    mon_head = (mon_head + 1) & (MON_RING - 1);
 }
 
-/* ================================================================
- * Debug: NVR Protocol Trace
- * ================================================================ */
-
-static void debug_nvr_trace(void)
+static void mon_flush(FILE *log)
 {
-    int i;
+    while (mon_tail != mon_head) {
+        const struct mon_delta *d = &mon_ring[mon_tail];
+        fprintf(log, "D %lu %02X %02X %02X\n", d->time, d->addr, d->old, d->val);
+        mon_tail = (mon_tail + 1) & (MON_RING - 1);
+    }
+    if (mon_dropped) {
+        fprintf(log, "X %lu %lu\n", (unsigned long)time(NULL), mon_dropped);
+        mon_dropped = 0;
+    }
+    fflush(log);
+}
 
-    printf("\nNVR Protocol Trace (port 0x65 -> port 0x62):\n");
-    printf("  Addr  Wr65  Rd62(hi)  Rd62(lo)  Combined\n");
-    printf("  ----  ----  --------  --------  --------\n");
+static int mon_ignored(int addr, int all)
+{
+    if (addr == RTC_REG_C)
+        return 1;           /* never swept: reading it eats UF */
+    if (all)
+        return 0;
+    return addr <= RTC_YEAR || addr == RTC_REG_A;
+}
 
-    for (i = 0; i < 16; i++) {
-        unsigned char hi_nib, lo_nib, pb;
+static int monitor_cmos(const char *logname, int argc, char *argv[])
+{
+    FILE *log;
+    unsigned char prev[CMOS_SIZE];
+    unsigned long samples = 0, changes = 0;
+    unsigned char sec;
+    int i, interval = 1, all = 0, ticks = 0;
+
+    for (i = 0; i < argc; i++) {
+        if ((strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--interval") == 0) &&
+            i + 1 < argc) {
+            interval = atoi(argv[++i]);
+            if (interval < 1)
+                interval = 1;
+        } else if (strcmp(argv[i], "--all") == 0) {
+            all = 1;
+        } else {
+            fprintf(stderr, "Unknown monitor option: %s\n", argv[i]);
+            fprintf(stderr, "Options: -i SECONDS, --all\n");
+            return 1;
+        }
+    }
 
-        outb((unsigned char)i, PORT_SYSSTAT2_WR);
-        io_delay();
+    log = fopen(logname, "a");
+    if (!log) {
+        perror("Error opening log file");
+        return 1;
+    }
 
-        pb = inb(PORT_PB);
+    cmos_snapshot();
+    memcpy(prev, cmos_image, CMOS_SIZE);
+    sec = prev[RTC_SECONDS];
+    fprintf(log, "B %lu ", (unsigned long)time(NULL));
+    for (i = 0; i < CMOS_SIZE; i++)
+        fprintf(log, "%02X", prev[i]);
+    fprintf(log, "\n");
+    fflush(log);
+
+    printf("Monitoring CMOS every %d s into %s (Ctrl+C to stop)\n",
+           interval, logname);
+    signal(SIGINT, loop_sigint);
+    signal(SIGTERM, loop_sigint);
+
+    while (!loop_stop) {
+        unsigned long now;
+
+        if (!rtc_sleep_until_update(&sec, WATCH_SEC_GRACE) && loop_stop)
+            break;              /* else stopped clock: sample anyway */
+        if (++ticks < interval) {
+            sleep_ms(WATCH_IDLE_MS);
+            continue;
+        }
+        ticks = 0;
+
+        now = (unsigned long)time(NULL);
+        samples++;
+        for (i = 0; i < CMOS_SIZE; i++) {
+            unsigned char val;
+
+            if (mon_ignored(i, all))
+                continue;
+            val = cmos_read(i);
+            if (val != prev[i]) {
+                mon_push(now, i, prev[i], val);
+                prev[i] = val;
+                changes++;
+            }
+        }
+        if (mon_count() >= MON_FLUSH || mon_dropped)
+            mon_flush(log);
 
-        outb(pb & ~PB_NIBBLE_SEL, PORT_PB);
-        io_delay();
-        hi_nib = inb(PORT_STATUS2) & 0x0F;
+        sleep_ms(WATCH_IDLE_MS);
+    }
 
-        outb(pb | PB_NIBBLE_SEL, PORT_PB);
-        io_delay();
-        lo_nib = inb(PORT_STATUS2) & 0x0F;
+    mon_flush(log);
+    fclose(log);
+    printf("\nMonitor stopped: %lu sample(s), %lu change(s) logged\n",
+           samples, changes);
+    return 0;
+}
 
-        outb(pb, PORT_PB);
+#endif /* NVR_WATCH */
 
-        printf("  0x%02X  0x%02X    0x%X       0x%X      0x%02X\n",
-               i, i, hi_nib, lo_nib, (hi_nib << 4) | lo_nib);
-    }
-}
+#if NVR_HW
 
 /* ================================================================
- * Debug: Port Read/Write
+ * RTC Periodic Interrupt Profiler
  * ================================================================ */
 
-static int port_read(const char *portstr)
+/*
+ * "nvr profile-timer" programs the Register A rate select, then polls
+ * Register C for PF and timestamps each edge against PIT channel 0
+ * (summing successive latched deltas, so its 55 ms wrap is harmless
+ * while we poll).  The chip sets PF at the selected rate whether or
+ * not PIE is on, so by default PIE is left off, for the same reason
+ * watch never sets UIE: on the PC1640 the RTC interrupt lands on
+ * IRQ 1, in the keyboard handler.  --pie sets it anyway, to see the
+ * rate with the interrupt line active.  Registers A and B are put
+ * back afterwards, also on Ctrl+C.  These temporary writes go straight
+ * to the chip with cmos_write_port(): in a batch script the open
+ * transaction would only stage them and the old rate would be timed.
+ *
+ * Intervals are rounded to whole periods: each extra period is a
+ * missed tick.  Jitter is the interval's deviation from nominal and
+ * includes one poll of detection error, so the poll period is shown
+ * alongside; if it exceeds the RTC period the poller, not the chip,
+ * is what is being measured.
+ */
+#define PROF_DEFAULT_HZ     1024
+#define PROF_MAX_SECONDS    60
+
+/* Register A rate select code for hz (3-15), or 0 if not a chip rate */
+static unsigned char prof_rate_code(unsigned long hz)
 {
-    unsigned int port = (unsigned int)strtol(portstr, NULL, 0);
-    unsigned char val;
+    unsigned char rs;
 
-    if (port > 0xFFFF) {
-        fprintf(stderr, "Error: Port must be 0x0000-0xFFFF\n");
+    for (rs = 3; rs <= 15; rs++)
+        if ((65536UL >> rs) == hz)
+            return rs;
+    return 0;
+}
+
+static int profile_timer(const char *unused, int argc, char *argv[])
+{
+    unsigned long hz = PROF_DEFAULT_HZ, nominal, now = 0, end, last_pf = 0, ms;
+    unsigned long events = 0, intervals = 0, missed = 0, polls = 0;
+    unsigned long iv_min = 0xFFFFFFFFUL, iv_max = 0, dev_sum = 0, dev_max = 0;
+    unsigned int seconds = 2;
+    unsigned short cnt, last;
+    unsigned char rega, regb, rs;
+    int i, pie = 0;
+
+    (void)unused;
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            hz = (unsigned long)atol(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = (unsigned int)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pie") == 0) {
+            pie = 1;
+        } else {
+            fprintf(stderr, "Unknown profile-timer option: %s\n", argv[i]);
+            fprintf(stderr, "Options: -r HZ, -t SECONDS, --pie\n");
+            return 1;
+        }
+    }
+    rs = prof_rate_code(hz);
+    if (!rs) {
+        fprintf(stderr, "Error: rate must be a power of two from 2 to 8192 Hz\n");
+        return 1;
+    }
+    if (seconds < 1 || seconds > PROF_MAX_SECONDS) {
+        fprintf(stderr, "Error: -t must be 1-%d seconds\n", PROF_MAX_SECONDS);
         return 1;
     }
 
-    val = inb(port);
-    printf("IN  port 0x%04X = 0x%02X (%u)\n", port, val, val);
+    printf("\nRTC Periodic Interrupt Profile (%lu Hz, %u s%s):\n",
+           hz, seconds, pie ? ", PIE on" : "");
+    fflush(stdout);
+
+    nominal = PIT_HZ / hz;
+    end = (unsigned long)seconds * PIT_HZ;
+    rega = cmos_read(RTC_REG_A);
+    regb = cmos_read(RTC_REG_B);
+    loop_stop = 0;
+    signal(SIGINT, loop_sigint);
+
+    cmos_write_port(RTC_REG_A, (rega & ~RTC_A_RS_MASK) | rs);
+    if (pie)
+        cmos_write_port(RTC_REG_B, regb | RTC_B_PIE);
+    (void)cmos_read(RTC_REG_C);     /* drop a stale PF */
+    last = pit0_read();
+
+    while (now < end && !loop_stop) {
+        unsigned char regc = cmos_read(RTC_REG_C);
+
+        cnt = pit0_read();
+        now += (unsigned short)(last - cnt);
+        last = cnt;
+        polls++;
+        if (!(regc & RTC_C_PF))
+            continue;
+        if (events++) {
+            unsigned long iv = now - last_pf, dev, periods;
+
+            periods = (iv + nominal / 2) / nominal;
+            if (periods > 1)
+                missed += periods - 1;
+            if (iv < iv_min)
+                iv_min = iv;
+            if (iv > iv_max)
+                iv_max = iv;
+            if (periods <= 1) {
+                dev = iv > nominal ? iv - nominal : nominal - iv;
+                dev_sum += dev;
+                if (dev > dev_max)
+                    dev_max = dev;
+                intervals++;
+            }
+        }
+        last_pf = now;
+    }
+
+    if (pie) {
+        cmos_write_port(RTC_REG_B, regb);
+        rtc_regb_valid = 0;     /* back to a staged Register B, if any */
+    }
+    cmos_write_port(RTC_REG_A, rega);
+    (void)cmos_read(RTC_REG_C);
+    signal(SIGINT, SIG_DFL);
+
+    ms = pit_ticks_us(now) / 1000;
+    printf("  Window:           %lu ms%s\n", ms, loop_stop ? " (interrupted)" : "");
+    printf("  PF edges seen:    %lu (expected %lu)\n", events, ms * hz / 1000);
+    if (ms)
+        printf("  Achieved rate:    %lu Hz\n", events * 1000UL / ms);
+    printf("  Missed ticks:     %lu\n", missed);
+    if (events > 1) {
+        printf("  Interval:         min %lu us, max %lu us (nominal %lu us)\n",
+               pit_ticks_us(iv_min), pit_ticks_us(iv_max), pit_ticks_us(nominal));
+        printf("  Jitter:           avg %lu us, max %lu us\n",
+               intervals ? pit_ticks_us(dev_sum / intervals) : 0,
+               pit_ticks_us(dev_max));
+    }
+    printf("  Poll period:      %lu us avg (%lu polls)\n",
+           polls ? pit_ticks_us(now / polls) : 0, polls);
+    if (polls && now / polls > nominal)
+        printf("  Note: polling is slower than the RTC rate; missed ticks "
+               "are the poller's\n");
+    if (!events)
+        printf("  No PF seen: divider stopped (Register A DV) or RTC absent?\n");
     return 0;
 }
 
-static int port_write(const char *portstr, const char *valstr)
+#endif /* NVR_HW */
+
+/* ================================================================
+ * CMOS Fill Range
+ * ================================================================ */
+
+static int fill_cmos(const char *startstr, const char *endstr, const char *valstr)
 {
-    unsigned int port = (unsigned int)strtol(portstr, NULL, 0);
+    unsigned int start = (unsigned int)strtol(startstr, NULL, 0);
+    unsigned int end = (unsigned int)strtol(endstr, NULL, 0);
     unsigned int val = (unsigned int)strtol(valstr, NULL, 0);
+    unsigned int i;
 
-    if (port > 0xFFFF) {
-        fprintf(stderr, "Error: Port must be 0x0000-0xFFFF\n");
+    if (start >= CMOS_SIZE || end >= CMOS_SIZE || start > end) {
+        fprintf(stderr, "Error: Range must be within 0x00-0x3F\n");
         return 1;
     }
     if (val > 0xFF) {
@@ -2010,187 +6254,741 @@ static int port_write(const char *portstr, const char *valstr)
         return 1;
     }
 
-    outb(val, port);
-    printf("OUT port 0x%04X = 0x%02X\n", port, val);
-    return 0;
+    stage_begin();
+    for (i = start; i <= end; i++) {
+        if (i == RTC_REG_C || i == RTC_REG_D)
+            continue;
+        cmos_write(i, val);
+    }
+
+    cmos_update_checksum();
+    printf("CMOS 0x%02X-0x%02X filled with 0x%02X\n", start, end, val);
+    return stage_commit();
 }
 
+#if NVR_CONFIG
+
 /* ================================================================
- * Dead-Man Diagnostic Port
+ * Battery Health Reporting
  * ================================================================ */
 
-static void show_deadman(void)
+static void show_battery(void)
 {
-    unsigned char val = inb(PORT_DEAD);
-    printf("\nDead-Man Diagnostic Port (0xDEAD): 0x%02X\n", val);
-    printf("  This port stores the last POST progress code.\n");
-    printf("  If the system hangs during POST, this value\n");
-    printf("  indicates which test stage failed.\n");
+    unsigned char regd, diag;
+
+    regd = cmos_get(RTC_REG_D);
+    diag = cmos_get(CMOS_DIAG);
+
+    out_str("\nBattery Status:\n");
+    out_flag("  Register D VRT flag: ", regd & RTC_D_VRT,
+             "SET (battery OK, RAM valid)", "CLEAR (battery dead!)");
+    out_flag("  Diagnostic bit 7:   ", diag & 0x80,
+             "SET (power was lost)", "CLEAR (continuous power)");
+
+    if (!(regd & RTC_D_VRT)) {
+        out_str("\n  *** WARNING: Battery is dead or disconnected! ***\n"
+                "  All CMOS settings will be lost on power-off.\n"
+                "  Replace the 4x AA batteries in the monitor base.\n");
+    } else if (diag & 0x80) {
+        out_str("\n  Battery was previously depleted or disconnected.\n"
+                "  CMOS may contain incorrect settings.\n"
+                "  Use 'nvr factory-reset' to restore defaults.\n");
+    } else {
+        out_str("\n  Battery and CMOS RAM are healthy.\n");
+    }
+    out_flush();
 }
 
+#endif /* NVR_CONFIG */
+
 /* ================================================================
- * Soft Reset
+ * Boot Check (rc scripts)
  * ================================================================ */
 
-static void soft_reset(void)
+/*
+ * "nvr boot-check GOLDEN" is the whole boot-time health check in one
+ * pass.  One snapshot is taken and VRT, diagnostic bit 7 (power lost)
+ * and the checksum are tested from it.  If all three are good nothing
+ * else happens: no output, no file access, exit 0.
+ *
+ * Otherwise the problems are printed on stderr and the configuration
+ * region (0x0E-0x3F, century excluded) is restored from GOLDEN
+ * through the staging engine.  Only bytes that differ are written,
+ * the checksum is recomputed, and a partial NVRI record restores just
+ * the bytes it holds.  The clock and Registers A-D are left alone.
+ *
+ * Exit status: 0 healthy, 1 error (nothing written), 2 restored,
+ * 3 restored but VRT is clear (battery failing: expect it again).
+ * With --beep the status is also played on the speaker, for units
+ * without a console: one short chirp (0), a long falling tone (1), a
+ * rising triad (2) or three low pulses (3) (builds without the
+ * speaker code accept --beep and stay silent).
+ */
+#define BOOT_OK         0
+#define BOOT_ERROR      1
+#define BOOT_RESTORED   2
+#define BOOT_BATTERY    3
+
+#define DIAG_POWER_LOST 0x80    /* diagnostic bit 7 */
+
+#if NVR_SOUND
+static const struct tone boot_tune_ok[] = {
+    { TONE_DIV(1046502UL), 80 },                                /* C6 */
+};
+static const struct tone boot_tune_error[] = {
+    { TONE_DIV(329628UL), 300 }, { TONE_DIV(220000UL), 600 },   /* E4 A3 */
+};
+static const struct tone boot_tune_restored[] = {
+    { TONE_DIV(523251UL), 120 }, { TONE_DIV(659255UL), 120 },   /* C5 E5 G5 */
+    { TONE_DIV(783991UL), 240 },
+};
+static const struct tone boot_tune_battery[] = {
+    { TONE_DIV(391995UL), 150 }, { 0, 100 },                    /* G4 x3 */
+    { TONE_DIV(391995UL), 150 }, { 0, 100 },
+    { TONE_DIV(391995UL), 150 },
+};
+
+#define TUNE(t)  { t, sizeof(t) / sizeof(t[0]) }
+
+/* Indexed by BOOT_* status */
+static const struct {
+    const struct tone *seq;
+    int n;
+} boot_tunes[] = {
+    TUNE(boot_tune_ok), TUNE(boot_tune_error),
+    TUNE(boot_tune_restored), TUNE(boot_tune_battery),
+};
+#endif
+
+static int boot_check_run(const char *golden)
 {
-    printf("Triggering soft reset via port 0x66...\n");
-    printf("System will reboot NOW!\n");
-    outb(0x00, PORT_SOFT_RESET);
-    /* Should not reach here */
-    printf("ERROR: Soft reset failed!\n");
+    struct nvr_image img;
+    int vrt, lost, cksum, i, n = 0;
+
+    cmos_snapshot();
+    vrt = (cmos_get(RTC_REG_D) & RTC_D_VRT) != 0;
+    lost = (cmos_get(CMOS_DIAG) & DIAG_POWER_LOST) != 0;
+    cksum = cmos_verify_checksum();
+    DBG(1, "boot-check: VRT %d, power lost %d, checksum %s\n",
+        vrt, lost, cksum ? "ok" : "bad");
+    if (vrt && !lost && cksum)
+        return BOOT_OK;
+
+    fprintf(stderr, "nvr boot-check: ");
+    if (!vrt)
+        fprintf(stderr, "battery failing (VRT clear)%s", (lost || !cksum) ? ", " : "");
+    if (lost)
+        fprintf(stderr, "RTC lost power%s", cksum ? "" : ", ");
+    if (!cksum)
+        fprintf(stderr, "CMOS checksum bad");
+    fprintf(stderr, "\n");
+
+    if (image_read(golden, -1, &img) != 0) {
+        fprintf(stderr, "nvr boot-check: %s unusable, CMOS not restored\n",
+                golden);
+        return BOOT_ERROR;
+    }
+
+    stage_begin();
+    for (i = CMOS_DIAG; i < CMOS_SIZE; i++) {
+        if (i == CMOS_CENTURY || !BIT_TEST(img.mask, i) ||
+            cmos_get(i) == img.data[i])
+            continue;
+        cmos_write(i, img.data[i]);
+        n++;
+    }
+    cmos_update_checksum();
+    if (stage_commit() != 0)
+        return BOOT_ERROR;
+
+    fprintf(stderr, "nvr boot-check: restored %d byte(s) from %s\n",
+            n, golden);
+    return vrt ? BOOT_RESTORED : BOOT_BATTERY;
+}
+
+static int boot_check(const char *golden, int argc, char *argv[])
+{
+    int a, rc, beep = 0;
+
+    for (a = 0; a < argc; a++) {
+        if (strcmp(argv[a], "--beep") != 0) {
+            fprintf(stderr, "Unknown boot-check option: %s\n", argv[a]);
+            return BOOT_ERROR;
+        }
+        beep = 1;
+    }
+
+    rc = boot_check_run(golden);
+#if NVR_SOUND
+    if (beep)
+        tone_play(boot_tunes[rc].seq, boot_tunes[rc].n);
+#else
+    (void)beep;                 /* accepted so rc scripts work on any build */
+#endif
+    return rc;
 }
 
 /* ================================================================
- * Game Port Detection
+ * I/O Statistics (--stats)
  * ================================================================ */
 
-static void show_gameport(void)
+/*
+ * Elapsed time comes from PIT channel 0, which every PC BIOS leaves
+ * free-running with a full 65536 count: its latch gives sub-tick
+ * resolution and gettimeofday() supplies the number of wraps.  Cycle
+ * figures assume the PC1640's 8 MHz clock.
+ */
+static struct timeval stats_tv;
+static unsigned short stats_pit0;
+
+/*
+ * PIT ticks in a span of ms wall-clock milliseconds that moved channel
+ * 0 by delta: whole wraps from the wall clock, the rest from the latch.
+ * Exact for spans under a minute.
+ */
+static unsigned long pit0_span(unsigned long ms, unsigned short delta)
 {
-    unsigned char val;
+    unsigned long wraps = ms * 1193UL;
 
-    printf("\nGame Port (Joystick):\n");
-    printf("  Port: 0x201\n");
+    wraps = (wraps + 32768UL > delta) ? (wraps + 32768UL - delta) / 65536UL : 0;
+    return wraps * 65536UL + delta;
+}
 
-    val = inb(PORT_GAME);
-    printf("  Raw read: 0x%02X\n", val);
-    printf("    Button 1: %s\n", (val & 0x10) ? "Released" : "PRESSED");
-    printf("    Button 2: %s\n", (val & 0x20) ? "Released" : "PRESSED");
-    printf("    Button 3: %s\n", (val & 0x40) ? "Released" : "PRESSED");
-    printf("    Button 4: %s\n", (val & 0x80) ? "Released" : "PRESSED");
-    printf("    Axis bits: 0x%X (timing-based, snapshot only)\n", val & 0x0F);
+static void io_stats_start(void)
+{
+    stats_enabled = 1;
+    gettimeofday(&stats_tv, NULL);
+    stats_pit0 = pit0_read();
+}
+
+static void io_stats_report(void)
+{
+    unsigned short pit0 = pit0_read();
+    unsigned short delta = stats_pit0 - pit0;   /* channel 0 counts down */
+    unsigned long reads = io_stats.hi_reads, writes = io_stats.hi_writes;
+    unsigned long ms, ticks;
+    struct timeval tv;
+    unsigned int port;
+
+    gettimeofday(&tv, NULL);
+    ms = (unsigned long)(tv.tv_sec - stats_tv.tv_sec) * 1000UL
+       + (tv.tv_usec - stats_tv.tv_usec) / 1000;
+
+    fprintf(stderr, "\nI/O statistics:\n");
+    fprintf(stderr, "  Port       Reads    Writes\n");
+    for (port = 0; port < 256; port++) {
+        if (!io_reads[port] && !io_writes[port])
+            continue;
+        fprintf(stderr, "  0x%02X  %10lu %9lu\n",
+                port, io_reads[port], io_writes[port]);
+        reads += io_reads[port];
+        writes += io_writes[port];
+    }
+    if (io_stats.hi_reads || io_stats.hi_writes)
+        fprintf(stderr, "  >0xFF %10lu %9lu\n",
+                io_stats.hi_reads, io_stats.hi_writes);
+    fprintf(stderr, "  Total %10lu %9lu\n", reads, writes);
+    fprintf(stderr, "  io_delay calls:  %lu\n", io_stats.delays);
+    fprintf(stderr, "  UIP waits:       %lu (%lu spin(s), %lu timeout(s))\n",
+            io_stats.uip_waits, io_stats.uip_spins, io_stats.uip_timeouts);
+    fprintf(stderr, "  Longest wait:    %u poll(s), %lu us\n",
+            io_stats.uip_max_spins,
+            (unsigned long)io_stats.uip_max_ticks * 1000UL / 1193UL);
+    fprintf(stderr, "  Clock re-reads:  %lu (%lu failed)\n",
+            io_stats.clock_retries, io_stats.clock_failures);
+
+    if (ms >= 60000UL) {
+        fprintf(stderr, "  Elapsed:         %lu s\n", ms / 1000);
+        return;
+    }
+    ticks = pit0_span(ms, delta);
+    fprintf(stderr, "  Elapsed:         %lu PIT ticks (%lu us, ~%lu cycles @ 8 MHz)\n",
+            ticks, ticks * 1000UL / 1193UL, ticks * 6 + ticks * 7 / 10);
+    if (reads + writes)
+        fprintf(stderr, "  Per access:      ~%lu cycles\n",
+                (ticks * 6 + ticks * 7 / 10) / (reads + writes));
 }
 
+#if NVR_HW
+
 /* ================================================================
- * Summary: show all configuration at once
+ * Benchmarks
  * ================================================================ */
 
-static void show_all(void)
+/*
+ * "nvr bench" times the access primitives and whole command paths on
+ * this machine and backend, to compare CPUs (8086, V30), ELKS kernels
+ * and nvr versions.  Each case runs back to back between two channel 0
+ * marks (see pit0_span()), so the timer read is paid once per run, not
+ * per operation.  Command paths start every iteration cold, as a new
+ * process would, with no snapshot and no cached Register B, and their
+ * output goes to /dev/null while they run.
+ *
+ * Nothing on the chip changes: cmos-write puts back the value scratch
+ * byte 0x3F already holds, checksum only verifies, and load restores
+ * (with --keep-time) the image that was saved just before.  That image
+ * lives in a file bench creates itself with O_EXCL (mode 0600), so a
+ * name planted in /tmp is never followed.
+ */
+#define BENCH_DEFAULT_N 1000UL
+#define BENCH_MAX_N     50000UL
+#define BENCH_CMD_DIV   100     /* command paths run n / 100 times */
+#define BENCH_SCRATCH   0x3F
+#define BENCH_FILE      "/tmp/nvr-bench"
+#define BENCH_TRIES     16
+
+#define BENCH_CMD       0x01    /* cold start, BENCH_CMD_DIV fewer runs */
+#define BENCH_QUIET     0x02    /* prints: stdout to /dev/null */
+
+static unsigned char bench_byte;
+static char bench_file[sizeof(BENCH_FILE) + 12];
+static char bench_keep_time[] = "--keep-time";
+static char *bench_load_argv[] = { bench_keep_time };
+
+/* Create a fresh private file for the save/load cases */
+static int bench_file_create(void)
 {
-    printf("Amstrad PC1640 NVR Full Configuration\n");
-    printf("======================================\n");
-    show_time();
-    show_alarm();
-    show_rtc_status();
-    show_floppy();
-    show_harddisk();
-    show_equipment();
-    show_memory();
-    show_diagnostics();
-    show_amstrad_full();
-    show_display_type();
-    show_amstrad_language();
-    show_ports();
-    show_mouse();
-    show_gameport();
-    show_pic();
-    show_dma();
-    show_pit();
-    show_deadman();
-    printf("\nCMOS checksum: %s\n",
-           cmos_verify_checksum() ? "Valid" : "*** INVALID ***");
+    int i, fd;
+
+    for (i = 0; i < BENCH_TRIES; i++) {
+        sprintf(bench_file, "%s.%d.%d", BENCH_FILE, (int)getpid(), i);
+        fd = open(bench_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            close(fd);
+            return 0;
+        }
+        if (errno != EEXIST)
+            break;
+    }
+    perror("Error creating bench image");
+    return 1;
 }
 
-/* ================================================================
- * RTC Watch Mode - continuously display time
- * ================================================================ */
+static void bench_inb(void)      { (void)inb(PORT_PB); }
+static void bench_read(void)     { (void)cmos_read(RTC_REG_A); }
+static void bench_write(void)    { cmos_write(BENCH_SCRATCH, bench_byte); }
+static void bench_sysstat2(void) { (void)amstrad_read_sysstat2(); }
+static void bench_checksum(void) { (void)cmos_verify_checksum(); }
+static void bench_save(void)     { (void)save_cmos(bench_file, 0, NULL); }
+static void bench_load(void)     { (void)load_cmos(bench_file, 1, bench_load_argv); }
 
-static void watch_time(void)
+static void bench_burst(void)
 {
-    printf("RTC Watch Mode (Ctrl+C to stop):\n\n");
+    unsigned char buf[CMOS_SIZE];
 
-    for (;;) {
-        unsigned char sec, min, hrs, regb;
+    cmos_read_burst(0, buf, CMOS_SIZE);
+}
 
-        rtc_wait_uip();
-        sec = cmos_read(RTC_SECONDS);
-        min = cmos_read(RTC_MINUTES);
-        hrs = cmos_read(RTC_HOURS);
-        regb = cmos_read(RTC_REG_B);
-
-        sec = rtc_to_bin(sec);
-        min = rtc_to_bin(min);
-        if (regb & RTC_B_24H) {
-            hrs = rtc_to_bin(hrs);
-        } else {
-            int pm = hrs & 0x80;
-            hrs &= 0x7F;
-            hrs = rtc_to_bin(hrs);
-            if (pm) { if (hrs < 12) hrs += 12; }
-            else    { if (hrs == 12) hrs = 0;  }
-        }
+static const struct bench_case {
+    const char *name;
+    void (*fn)(void);
+    unsigned char flags;
+} bench_cases[] = {
+    { "inb",        bench_inb,      0 },
+    { "cmos-read",  bench_read,     0 },
+    { "cmos-write", bench_write,    0 },
+    { "sysstat2",   bench_sysstat2, 0 },
+    { "uip-wait",   rtc_wait_uip,   0 },
+    { "burst-read", bench_burst,    0 },
+    { "dump",       dump_cmos,      BENCH_CMD | BENCH_QUIET },
+#if NVR_CONFIG
+    { "show",       show_all,       BENCH_CMD | BENCH_QUIET },
+#endif
+    { "save",       bench_save,     BENCH_CMD | BENCH_QUIET },
+    { "load",       bench_load,     BENCH_CMD | BENCH_QUIET },
+    { "checksum",   bench_checksum, BENCH_CMD },
+};
 
-        printf("  %02d:%02d:%02d\r", hrs, min, sec);
+#define NBENCH  (sizeof(bench_cases) / sizeof(bench_cases[0]))
 
-        /* Wait roughly until next second */
-        {
-            unsigned char last_sec = sec;
-            long timeout = 100000L;
-            while (rtc_to_bin(cmos_read(RTC_SECONDS)) == last_sec && --timeout > 0)
-                ;
+/* Every bus access so far, io_delay() writes included */
+static unsigned long io_total(void)
+{
+    unsigned long n = io_stats.hi_reads + io_stats.hi_writes + io_stats.delays;
+    unsigned int port;
+
+    for (port = 0; port < 256; port++)
+        n += io_reads[port] + io_writes[port];
+    return n;
+}
+
+/* Send stdout to /dev/null (on) or back (off) */
+static void bench_quiet(int on)
+{
+    static int saved = -1;
+    int fd;
+
+    out_flush();
+    if (on) {
+        saved = dup(1);
+        fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) {
+            dup2(fd, 1);
+            close(fd);
         }
+    } else if (saved >= 0) {
+        dup2(saved, 1);
+        close(saved);
+        saved = -1;
     }
 }
 
-/* ================================================================
- * CMOS Fill Range
- * ================================================================ */
-
-static int fill_cmos(const char *startstr, const char *endstr, const char *valstr)
+/* Time n runs of case b; returns PIT ticks, bus accesses in *ios */
+static unsigned long bench_time(const struct bench_case *b, unsigned long n,
+                                unsigned long *ios)
 {
-    unsigned int start = (unsigned int)strtol(startstr, NULL, 0);
-    unsigned int end = (unsigned int)strtol(endstr, NULL, 0);
-    unsigned int val = (unsigned int)strtol(valstr, NULL, 0);
-    unsigned int i;
+    struct timeval tv0, tv;
+    unsigned short cnt0, cnt;
+    unsigned long k, io0 = io_total(), ms;
+#if NVR_CONFIG
+    int format = out_format;
+
+    out_format = FMT_TEXT;      /* time the text path of show */
+#endif
+
+    if (b->flags & BENCH_QUIET)
+        bench_quiet(1);
+    gettimeofday(&tv0, NULL);
+    cnt0 = pit0_read();
+    for (k = 0; k < n; k++) {
+        if (b->flags & BENCH_CMD) {
+            cmos_image_valid = 0;
+            rtc_regb_valid = 0;
+        }
+        b->fn();
+    }
+    cnt = pit0_read();
+    gettimeofday(&tv, NULL);
+    if (b->flags & BENCH_QUIET)
+        bench_quiet(0);
+#if NVR_CONFIG
+    out_format = format;
+#endif
+
+    *ios = io_total() - io0;
+    ms = (unsigned long)(tv.tv_sec - tv0.tv_sec) * 1000UL
+       + (tv.tv_usec - tv0.tv_usec) / 1000;
+    return ms >= 60000UL ? ms * 1193UL : pit0_span(ms, cnt0 - cnt);
+}
 
-    if (start >= CMOS_SIZE || end >= CMOS_SIZE || start > end) {
-        fprintf(stderr, "Error: Range must be within 0x00-0x3F\n");
+static int run_bench(const char *unused, int argc, char *argv[])
+{
+    unsigned long n = BENCH_DEFAULT_N, runs[NBENCH], ns[NBENCH], acc[NBENCH];
+    unsigned char sel[NBENCH];
+    int i, named = 0, rc;
+    unsigned int j;
+
+    (void)unused;
+    memset(sel, 0, sizeof(sel));
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n = (unsigned long)atol(argv[++i]);
+            continue;
+        }
+        for (j = 0; j < NBENCH; j++)
+            if (strcmp(argv[i], bench_cases[j].name) == 0)
+                break;
+        if (j == NBENCH) {
+            fprintf(stderr, "Unknown bench option or case: %s\n", argv[i]);
+            fprintf(stderr, "Options: -n N; cases:");
+            for (j = 0; j < NBENCH; j++)
+                fprintf(stderr, " %s", bench_cases[j].name);
+            fprintf(stderr, "\n");
+            return 1;
+        }
+        sel[j] = 1;
+        named = 1;
+    }
+    if (n < 1 || n > BENCH_MAX_N) {
+        fprintf(stderr, "Error: -n must be 1-%lu\n", BENCH_MAX_N);
         return 1;
     }
-    if (val > 0xFF) {
-        fprintf(stderr, "Error: Value must be 0x00-0xFF\n");
+#if NVR_CONFIG
+    if (out_format == FMT_BIN) {
+        fprintf(stderr, "Error: bench supports --format=text, kv or json\n");
         return 1;
     }
+#endif
 
-    for (i = start; i <= end; i++) {
-        if (i == RTC_REG_C || i == RTC_REG_D)
-            continue;
-        cmos_write(i, val);
+    if (bench_file_create() != 0)
+        return 1;
+    bench_byte = cmos_read(BENCH_SCRATCH);
+    bench_quiet(1);
+    rc = save_cmos(bench_file, 0, NULL);    /* what load will restore */
+    bench_quiet(0);
+    if (rc != 0) {
+        unlink(bench_file);
+        return 1;
     }
 
-    cmos_update_checksum();
-    printf("CMOS 0x%02X-0x%02X filled with 0x%02X\n", start, end, val);
+    for (j = 0; j < NBENCH; j++) {
+        unsigned long us;
+
+        if (named && !sel[j])
+            continue;
+        sel[j] = 1;
+        runs[j] = n;
+        if (bench_cases[j].flags & BENCH_CMD)
+            runs[j] = n > BENCH_CMD_DIV ? n / BENCH_CMD_DIV : 1;
+        us = pit_ticks_us(bench_time(&bench_cases[j], runs[j], &acc[j]));
+        ns[j] = us / runs[j] * 1000UL + us % runs[j] * 1000UL / runs[j];
+    }
+    cmos_image_valid = 0;
+    rtc_regb_valid = 0;
+    unlink(bench_file);
+
+#if NVR_CONFIG
+    if (out_format != FMT_TEXT) {
+        char key[24];
+
+        fmt_fields = 0;
+        fmt_int("nvr", FMT_SCHEMA);
+        fmt_str("backend", io->name);
+        fmt_int("n", (long)n);
+        for (j = 0; j < NBENCH; j++) {
+            char *dot;
+
+            if (!sel[j])
+                continue;
+            strcpy(key, bench_cases[j].name);
+            dot = key + strlen(key);
+            strcpy(dot, ".runs");
+            fmt_int(key, (long)runs[j]);
+            strcpy(dot, ".ns");
+            fmt_int(key, (long)ns[j]);
+            strcpy(dot, ".io");
+            fmt_int(key, (long)((acc[j] + runs[j] / 2) / runs[j]));
+        }
+        if (out_format == FMT_JSON)
+            out_str("}\n");
+        out_flush();
+        return 0;
+    }
+#endif
+
+    out_str("\nBenchmark (");
+    out_str(io->name);
+    out_str(" backend, n=");
+    out_dec((long)n, 0);
+    out_str("):\n  Case         Runs      us/op      ops/s   I/O/op\n");
+    for (j = 0; j < NBENCH; j++) {
+        if (!sel[j])
+            continue;
+        out_str("  ");
+        out_str(bench_cases[j].name);
+        out_dec((long)runs[j], 17 - (int)strlen(bench_cases[j].name));
+        out_dec((long)(ns[j] / 1000), 9);
+        out_char('.');
+        out_char('0' + (char)(ns[j] % 1000 / 100));
+        out_dec(ns[j] ? (long)(1000000000UL / ns[j]) : 0, 11);
+        out_dec((long)((acc[j] + runs[j] / 2) / runs[j]), 9);
+        out_char('\n');
+    }
+    out_flush();
     return 0;
 }
 
+#endif /* NVR_HW */
+
 /* ================================================================
- * Battery Health Reporting
+ * Command Table
  * ================================================================ */
 
-static void show_battery(void)
-{
-    unsigned char regd, diag;
+/*
+ * Every command is one row: name, argument synopsis, help text,
+ * required argument count, usage group and handler.  Aliases are rows
+ * of their own with help set to NULL, so usage() skips them.  The
+ * table is searched by binary search and MUST stay sorted in strcmp()
+ * order ('-' sorts before letters).
+ *
+ * Handlers keep their natural prototypes and are stored as cmd_fn;
+ * run_command() casts back by argument count.  CMD_OPTS handlers get
+ * their required argument (NULL if none) plus the rest of argv for
+ * option parsing; CMD_RC marks a no-argument handler whose int
+ * result is the exit status.
+ */
 
-    regd = cmos_read(RTC_REG_D);
-    diag = cmos_read(CMOS_DIAG);
+typedef void (*cmd_fn)(void);
+typedef int (*cmd_fn0)(void);
+typedef int (*cmd_fn1)(const char *);
+typedef int (*cmd_fn2)(const char *, const char *);
+typedef int (*cmd_fn3)(const char *, const char *, const char *);
+typedef int (*cmd_fnv)(const char *, int, char *[]);
 
-    printf("\nBattery Status:\n");
-    printf("  Register D VRT flag: %s\n",
-           (regd & RTC_D_VRT) ? "SET (battery OK, RAM valid)" : "CLEAR (battery dead!)");
-    printf("  Diagnostic bit 7:   %s\n",
-           (diag & 0x80) ? "SET (power was lost)" : "CLEAR (continuous power)");
+#define CMD_OPTS    0x01        /* handler is cmd_fnv */
+#define CMD_LOCK    0x02        /* writes CMOS: run under nvr_lock() */
+#define CMD_RC      0x04        /* no-argument handler is cmd_fn0 */
 
-    if (!(regd & RTC_D_VRT)) {
-        printf("\n  *** WARNING: Battery is dead or disconnected! ***\n");
-        printf("  All CMOS settings will be lost on power-off.\n");
-        printf("  Replace the 4x AA batteries in the monitor base.\n");
-    } else if (diag & 0x80) {
-        printf("\n  Battery was previously depleted or disconnected.\n");
-        printf("  CMOS may contain incorrect settings.\n");
-        printf("  Use 'nvr factory-reset' to restore defaults.\n");
-    } else {
-        printf("\n  Battery and CMOS RAM are healthy.\n");
+enum {
+    G_DISPLAY, G_AMSTRAD, G_HARDWARE, G_TIME, G_DRIVE,
+    G_EQUIP, G_RTC, G_CMOS, G_DEBUG, G_COUNT
+};
+
+static const char *const group_names[G_COUNT] = {
+    "Configuration Display", "Amstrad-Specific", "Hardware Diagnostics",
+    "Time/Date Setting", "Drive Configuration", "Equipment Configuration",
+    "RTC Mode Configuration", "CMOS Operations", "Debug"
+};
+
+struct command {
+    const char *name;
+    const char *args;           /* synopsis, or NULL */
+    const char *help;           /* NULL for alias rows */
+    unsigned char nargs;        /* required arguments */
+    unsigned char group;
+    unsigned char flags;
+    cmd_fn fn;
+};
+
+#define H(fn)   ((cmd_fn)(fn))
+#define CONT    "\n                       "
+
+#if NVR_HELP
+#define HELP(s) s
+#else
+#define HELP(s) ""
+#endif
+
+/* Rows for compiled-out subsystems vanish from the table */
+#define CMD(...)            { __VA_ARGS__ },
+#if NVR_CONFIG
+#define CMD_CONFIG(...)     { __VA_ARGS__ },
+#else
+#define CMD_CONFIG(...)
+#endif
+#if NVR_HW
+#define CMD_HW(...)         { __VA_ARGS__ },
+#else
+#define CMD_HW(...)
+#endif
+#if NVR_SOUND
+#define CMD_SOUND(...)      { __VA_ARGS__ },
+#else
+#define CMD_SOUND(...)
+#endif
+#if NVR_MOUSE
+#define CMD_MOUSE(...)      { __VA_ARGS__ },
+#else
+#define CMD_MOUSE(...)
+#endif
+#if NVR_WATCH
+#define CMD_WATCH(...)      { __VA_ARGS__ },
+#else
+#define CMD_WATCH(...)
+#endif
+
+static const struct command commands[] = {
+    CMD_CONFIG("alarm", NULL, HELP("Show alarm settings"), 0, G_DISPLAY, 0, H(show_alarm))
+    CMD_CONFIG("alarm-disable", NULL, HELP("Disable alarm interrupt"), 0, G_TIME, CMD_LOCK | CMD_RC, H(alarm_off))
+    CMD_CONFIG("alarm-enable", NULL, HELP("Enable alarm interrupt"), 0, G_TIME, CMD_LOCK | CMD_RC, H(alarm_on))
+    CMD_CONFIG("amstrad", NULL, HELP("Show all Amstrad system status (ports/latches)"), 0, G_AMSTRAD, 0, H(show_amstrad_full))
+    CMD_CONFIG("bat", NULL, NULL, 0, G_DISPLAY, 0, H(show_battery))
+    CMD_CONFIG("battery", NULL, HELP("Show battery health"), 0, G_DISPLAY, 0, H(show_battery))
+    CMD_SOUND("beep", "FREQ", HELP("Play tone at FREQ Hz (20-20000)"), 1, G_HARDWARE, 0, H(speaker_beep))
+    CMD_HW("bench", "[OPTS] [CASE...]", HELP("Time I/O primitives and command paths"
+      CONT "-n N (1000; command paths N/100)"), 0, G_DEBUG, CMD_OPTS | CMD_LOCK, H(run_bench))
+    CMD("boot-check", "GOLDEN [--beep]", HELP("Silent boot check; restore config from GOLDEN"
+      CONT "if the battery, power-loss bit or checksum is bad"), 1, G_CMOS, CMD_OPTS | CMD_LOCK, H(boot_check))
+    CMD("checksum", NULL, HELP("Verify/recalculate CMOS checksum"), 0, G_CMOS, CMD_LOCK, H(checksum_repair))
+    CMD_CONFIG("clear-diag", NULL, HELP("Clear diagnostic status byte"), 0, G_CMOS, CMD_LOCK, H(clear_diagnostics))
+    CMD("compare", "FILE [-r N]", HELP("Compare live CMOS vs saved file"), 1, G_CMOS, CMD_OPTS, H(compare_cmos))
+    CMD_HW("dead", NULL, NULL, 0, G_HARDWARE, 0, H(show_deadman))
+    CMD_HW("deadman", NULL, HELP("Read dead-man diagnostic port (0xDEAD)"), 0, G_HARDWARE, 0, H(show_deadman))
+    CMD_HW("deadman-capture", "[OPTS]", HELP("Record 0xDEAD code changes with PIT times"
+      CONT "-t SECONDS (10), -s: also sysstat2"), 0, G_HARDWARE, CMD_OPTS, H(deadman_capture))
+    CMD_CONFIG("diag", NULL, HELP("Show diagnostic & shutdown status"), 0, G_DISPLAY, 0, H(show_diagnostics))
+    CMD("diff", "FILE [-r N]", NULL, 1, G_CMOS, CMD_OPTS, H(compare_cmos))
+    CMD("diff-many", "BASE IMAGE...", HELP("Compare many images against BASE, field by field"), 1, G_CMOS, CMD_OPTS, H(diff_many))
+    CMD_CONFIG("display", NULL, HELP("Show display type detection"), 0, G_AMSTRAD, 0, H(show_display_type))
+    CMD_HW("dma", NULL, HELP("Show 8237A DMA status"), 0, G_HARDWARE, 0, H(show_dma))
+    CMD("dump", NULL, HELP("Hex dump of all 64 CMOS bytes"), 0, G_CMOS, 0, H(dump_cmos))
+    CMD_CONFIG("equip", NULL, NULL, 0, G_DISPLAY, 0, H(show_equipment))
+    CMD_CONFIG("equipment", NULL, HELP("Show equipment byte breakdown"), 0, G_DISPLAY, 0, H(show_equipment))
+    CMD("factory-reset", NULL, HELP("Reset CMOS to PC1640 factory defaults"), 0, G_CMOS, CMD_LOCK | CMD_RC, H(factory_reset))
+    CMD("fill", "START END VAL", HELP("Fill CMOS range with value"), 3, G_CMOS, CMD_LOCK, H(fill_cmos))
+    CMD_CONFIG("floppy", NULL, HELP("Show floppy drive configuration"), 0, G_DISPLAY, 0, H(show_floppy))
+    CMD_HW("gameport", NULL, HELP("Show game/joystick port status"), 0, G_HARDWARE, 0, H(show_gameport))
+    CMD_HW("gameport-sample", "[OPTS]", HELP("Time joystick axes repeatedly"
+      CONT "-n SAMPLES (50), -r HZ (10, max 200)"), 0, G_HARDWARE, CMD_OPTS, H(gameport_sample))
+    CMD_CONFIG("harddisk", NULL, HELP("Show hard disk configuration"), 0, G_DISPLAY, 0, H(show_harddisk))
+    CMD_CONFIG("hd", NULL, NULL, 0, G_DISPLAY, 0, H(show_harddisk))
+    CMD_HW("inb", "PORT", HELP("Read I/O port (hex)"), 1, G_DEBUG, 0, H(port_read))
+    CMD("info", "FILE", HELP("List the records in an image file"), 1, G_CMOS, 0, H(image_info))
+    CMD_HW("joystick", NULL, NULL, 0, G_HARDWARE, 0, H(show_gameport))
+    CMD_CONFIG("lang", NULL, NULL, 0, G_AMSTRAD, 0, H(show_amstrad_language))
+    CMD_CONFIG("language", NULL, HELP("Show language selection (DIP switches)"), 0, G_AMSTRAD, 0, H(show_amstrad_language))
+    CMD("load", "FILE [OPTS]", HELP("Load CMOS from binary file (changed bytes only)"
+      CONT "--keep-time: skip clock, --verify: read back"
+      CONT "-r N: use record N of an NVRI file"), 1, G_CMOS, CMD_OPTS | CMD_LOCK, H(load_cmos))
+    CMD_CONFIG("mem", NULL, NULL, 0, G_DISPLAY, 0, H(show_memory))
+    CMD_CONFIG("memory", NULL, HELP("Show memory configuration"), 0, G_DISPLAY, 0, H(show_memory))
+    CMD_WATCH("monitor", "LOG [OPTS]", HELP("Log CMOS changes until Ctrl+C"
+      CONT "-i SECONDS: sample interval, --all: clock too"), 1, G_CMOS, CMD_OPTS, H(monitor_cmos))
+    CMD_MOUSE("mouse", NULL, HELP("Show Amstrad mouse port status"), 0, G_AMSTRAD, 0, H(show_mouse))
+    CMD_MOUSE("mouse-reset", NULL, HELP("Reset mouse counters to 0"), 0, G_AMSTRAD, 0, H(mouse_reset))
+    CMD_MOUSE("mouse-sample", "[OPTS]", HELP("Poll mouse counters/buttons and report timing"
+      CONT "-t SECONDS (5), -r HZ (500), -v: event timeline"), 0, G_AMSTRAD, CMD_OPTS, H(mouse_sample))
+    CMD_MOUSE("mouse-test", NULL, HELP("Interactive mouse movement test (5 sec)"), 0, G_AMSTRAD, 0, H(mouse_test))
+    CMD_HW("outb", "PORT VAL", HELP("Write I/O port (hex)"), 2, G_DEBUG, 0, H(port_write))
+    CMD_HW("pic", NULL, HELP("Show 8259A PIC status (IRQ mask/request)"), 0, G_HARDWARE, 0, H(show_pic))
+    CMD_HW("pit", NULL, HELP("Show 8253 PIT timer status"), 0, G_HARDWARE, 0, H(show_pit))
+    CMD_SOUND("play", "NOTES...", HELP("Play a tune, e.g. \"C4:100 E4:100 G4:200 R:50\""),
+      1, G_HARDWARE, CMD_OPTS, H(play_cmd))
+    CMD_HW("ports", NULL, HELP("Detect serial/parallel ports"), 0, G_HARDWARE, 0, H(show_ports))
+    CMD_HW("probe", "[--all]", HELP("Full hardware port probe"
+      CONT "--all: include reads that clear state"), 0, G_DEBUG, CMD_OPTS, H(debug_probe))
+    CMD_HW("profile-timer", "[OPTS]", HELP("Measure the RTC periodic rate against the PIT"
+      CONT "-r HZ (1024), -t SECONDS (2), --pie"), 0, G_RTC, CMD_OPTS | CMD_LOCK, H(profile_timer))
+    CMD("read", "ADDR", HELP("Read single CMOS byte (0x00-0x3F)"), 1, G_CMOS, 0, H(raw_read))
+    CMD_HW("reboot", NULL, NULL, 0, G_DEBUG, 0, H(soft_reset))
+    CMD("save", "FILE [OPTS]", HELP("Save CMOS to binary file (raw 64 bytes)"
+      CONT "--image, --append, --tag NAME: NVRI record"), 1, G_CMOS, CMD_OPTS, H(save_cmos))
+    CMD_CONFIG("set-alarm", "HH:MM:SS", HELP("Set alarm time (-1 for wildcard)"), 1, G_TIME, CMD_LOCK, H(set_alarm))
+    CMD_CONFIG("set-basemem", "KB", HELP("Set base memory (64-640)"), 1, G_EQUIP, CMD_LOCK, H(set_basemem))
+    CMD("set-date", "DD/MM/YYYY", HELP("Set the RTC date"), 1, G_TIME, CMD_LOCK, H(set_date))
+    CMD("set-dow", "N", HELP("Set day of week (1=Sun - 7=Sat)"), 1, G_TIME, CMD_LOCK, H(set_dow))
+    CMD_CONFIG("set-equip", "FIELD VAL", HELP("Set equipment field:"
+      CONT "fpu 0|1, video 0-3, floppy-count 0-4"), 2, G_EQUIP, CMD_LOCK, H(set_equipment))
+    CMD_CONFIG("set-floppy", "A|B TYPE", HELP("Set floppy type (0-4)"), 2, G_DRIVE, CMD_LOCK, H(set_floppy))
+    CMD_CONFIG("set-harddisk", "0|1 TYPE", HELP("Set hard disk type (0-15)"), 2, G_DRIVE, CMD_LOCK, H(set_harddisk))
+    CMD_CONFIG("set-hd", "0|1 TYPE", NULL, 2, G_DRIVE, CMD_LOCK, H(set_harddisk))
+    CMD_CONFIG("set-rtc", "MODE VAL", HELP("Set RTC mode:"
+      CONT "24h 0|1, bcd 0|1, sqw 0|1,"
+      CONT "dse 0|1, pie 0|1, uie 0|1,"
+      CONT "rate 0-15"), 2, G_RTC, CMD_LOCK, H(set_rtc_mode))
+    CMD("set-time", "HH:MM:SS", HELP("Set the RTC time"), 1, G_TIME, CMD_LOCK, H(set_time))
+    CMD_CONFIG("show", "[SECTIONS]", HELP("Show system configuration (default)"
+      CONT "SECTIONS: all, cmos, config (default), hw"
+      CONT "or section names, comma-separated"), 0, G_DISPLAY, CMD_OPTS, H(show_cmd))
+    CMD_HW("soft-reset", NULL, HELP("Trigger soft reset via port 0x66"), 0, G_DEBUG, 0, H(soft_reset))
+    CMD_SOUND("speaker-test", NULL, HELP("Play test tones through PC speaker"), 0, G_HARDWARE, 0, H(speaker_test))
+    CMD_CONFIG("status", NULL, HELP("Show RTC status registers (detailed)"), 0, G_DISPLAY, 0, H(show_rtc_status))
+    CMD("time", NULL, HELP("Show current date and time"), 0, G_DISPLAY, 0, H(show_time))
+    CMD_HW("timer", NULL, NULL, 0, G_HARDWARE, 0, H(show_pit))
+    CMD_HW("trace", NULL, HELP("NVR port protocol trace"), 0, G_DEBUG, 0, H(debug_nvr_trace))
+    CMD_CONFIG("video", NULL, NULL, 0, G_AMSTRAD, 0, H(show_display_type))
+    CMD_WATCH("watch", NULL, HELP("Continuously display time (Ctrl+C to stop)"), 0, G_TIME, 0, H(watch_time))
+    CMD("write", "ADDR VAL", HELP("Write single CMOS byte"), 2, G_CMOS, CMD_LOCK, H(raw_write))
+};
+
+#define NCOMMANDS   (sizeof(commands) / sizeof(commands[0]))
+
+static const struct command *cmd_lookup(const char *name)
+{
+    int lo = 0, hi = (int)NCOMMANDS - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(name, commands[mid].name);
+
+        if (c == 0)
+            return &commands[mid];
+        if (c < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
     }
+    return NULL;
 }
 
 /* ================================================================
@@ -2199,88 +6997,60 @@ static void show_battery(void)
 
 static void usage(const char *prog)
 {
+    unsigned int g, i, shown;
+    char synopsis[32];
+
     printf(
+#if NVR_HELP
         "Amstrad PC1640 NVR Configuration Utility - Comprehensive Edition\n"
         "For use with ELKS on original PC1640 hardware\n"
         "\n"
+#endif
         "Usage: %s [options] <command> [args...]\n"
         "\n"
         "Options:\n"
+#if NVR_EMU
+        "  -b, --backend NAME   Hardware backend: ports (default), emu,\n"
+        "                       or file:PATH (emulated, CMOS kept in PATH)\n"
+#endif
         "  -d, --debug          Increase debug verbosity (repeat for more)\n"
-        "  -h, --help           Show this help\n"
-        "\n"
-        "=== Configuration Display ===\n"
-        "  show                 Show full system configuration (default)\n"
-        "  time                 Show current date and time\n"
-        "  alarm                Show alarm settings\n"
-        "  floppy               Show floppy drive configuration\n"
-        "  harddisk             Show hard disk configuration\n"
-        "  equipment            Show equipment byte breakdown\n"
-        "  memory               Show memory configuration\n"
-        "  status               Show RTC status registers (detailed)\n"
-        "  diag                 Show diagnostic & shutdown status\n"
-        "  battery              Show battery health\n"
-        "\n"
-        "=== Amstrad-Specific ===\n"
-        "  amstrad              Show all Amstrad system status (ports/latches)\n"
-        "  language             Show language selection (DIP switches)\n"
-        "  display              Show display type detection\n"
-        "  mouse                Show Amstrad mouse port status\n"
-        "  mouse-test           Interactive mouse movement test (5 sec)\n"
-        "  mouse-reset          Reset mouse counters to 0\n"
-        "\n"
-        "=== Hardware Diagnostics ===\n"
-        "  ports                Detect serial/parallel ports\n"
-        "  gameport             Show game/joystick port status\n"
-        "  pic                  Show 8259A PIC status (IRQ mask/request)\n"
-        "  dma                  Show 8237A DMA status\n"
-        "  pit                  Show 8253 PIT timer status\n"
-        "  deadman              Read dead-man diagnostic port (0xDEAD)\n"
-        "  speaker-test         Play test tones through PC speaker\n"
-        "  beep FREQ            Play tone at FREQ Hz (20-20000)\n"
-        "\n"
-        "=== Time/Date Setting ===\n"
-        "  set-time HH:MM:SS   Set the RTC time\n"
-        "  set-date DD/MM/YYYY Set the RTC date\n"
-        "  set-dow N            Set day of week (1=Sun - 7=Sat)\n"
-        "  set-alarm HH:MM:SS  Set alarm time (-1 for wildcard)\n"
-        "  alarm-enable         Enable alarm interrupt\n"
-        "  alarm-disable        Disable alarm interrupt\n"
-        "  watch                Continuously display time (Ctrl+C to stop)\n"
-        "\n"
-        "=== Drive Configuration ===\n"
-        "  set-floppy A|B TYPE  Set floppy type (0-4)\n"
-        "  set-harddisk 0|1 TYPE Set hard disk type (0-15)\n"
-        "\n"
-        "=== Equipment Configuration ===\n"
-        "  set-equip FIELD VAL  Set equipment field:\n"
-        "                       fpu 0|1, video 0-3, floppy-count 0-4\n"
-        "  set-basemem KB       Set base memory (64-640)\n"
-        "\n"
-        "=== RTC Mode Configuration ===\n"
-        "  set-rtc MODE VAL     Set RTC mode:\n"
-        "                       24h 0|1, bcd 0|1, sqw 0|1,\n"
-        "                       dse 0|1, pie 0|1, uie 0|1,\n"
-        "                       rate 0-15\n"
-        "\n"
-        "=== CMOS Operations ===\n"
-        "  dump                 Hex dump of all 64 CMOS bytes\n"
-        "  read ADDR            Read single CMOS byte (0x00-0x3F)\n"
-        "  write ADDR VAL       Write single CMOS byte\n"
-        "  fill START END VAL   Fill CMOS range with value\n"
-        "  checksum             Verify/recalculate CMOS checksum\n"
-        "  save FILE            Save CMOS to binary file\n"
-        "  load FILE            Load CMOS from binary file\n"
-        "  compare FILE         Compare live CMOS vs saved file\n"
-        "  factory-reset        Reset CMOS to PC1640 factory defaults\n"
-        "  clear-diag           Clear diagnostic status byte\n"
-        "\n"
-        "=== Debug ===\n"
-        "  probe                Full hardware port probe\n"
-        "  trace                NVR port protocol trace\n"
-        "  inb PORT             Read I/O port (hex)\n"
-        "  outb PORT VAL        Write I/O port (hex)\n"
-        "  soft-reset           Trigger soft reset via port 0x66\n"
+        "  -f, --file SCRIPT    Run commands from SCRIPT, one per line\n"
+        "                       (- reads stdin; all-or-nothing CMOS commit)\n"
+#if NVR_CONFIG
+        "  --format=FMT         Output of 'show': text, kv, json or bin\n"
+#endif
+        "  -s, --stats          Print port I/O counts and timing at exit\n"
+        "  -h, --help           Show this help\n",
+        prog);
+
+    for (g = 0; g < G_COUNT; g++) {
+        shown = 0;
+        for (i = 0; i < NCOMMANDS; i++) {
+            const struct command *c = &commands[i];
+
+            if (c->group != g || !c->help)
+                continue;
+            if (!shown++)
+                printf("\n=== %s ===\n", group_names[g]);
+            if (c->args)
+                sprintf(synopsis, "%s %s", c->name, c->args);
+            else
+                strcpy(synopsis, c->name);
+            if (*c->help)
+                printf("  %-20s %s\n", synopsis, c->help);
+            else
+                printf("  %s\n", synopsis);
+        }
+    }
+
+    printf("\nAliases:");
+    for (i = 0; i < NCOMMANDS; i++)
+        if (!commands[i].help)
+            printf(" %s", commands[i].name);
+    printf("\n");
+
+#if NVR_HELP
+    printf(
         "\n"
         "Floppy types: 0=None 1=360K 5.25\" 2=1.2M 5.25\" 3=720K 3.5\" 4=1.44M 3.5\"\n"
         "HD types: 0=None 1-14=Standard geometries 15=Extended (CMOS 0x19/0x1A)\n"
@@ -2306,300 +7076,235 @@ static void usage(const char *prog)
         "  %s dump\n"
         "  %s save backup.nvr\n"
         "  %s compare backup.nvr\n"
-        "  %s factory-reset\n"
-        "  %s -ddd probe\n",
-        prog, prog, prog, prog, prog, prog, prog,
-        prog, prog, prog, prog, prog, prog, prog
+        "  %s factory-reset\n",
+        prog, prog, prog, prog, prog, prog,
+        prog, prog, prog, prog, prog, prog
     );
+#endif
+#if NVR_HELP && NVR_HW
+    printf("  %s -ddd probe\n", prog);
+#endif
 }
 
 /* ================================================================
- * Main
+ * Command Dispatch
  * ================================================================ */
 
-int main(int argc, char *argv[])
-{
-    int i;
-    const char *cmd;
+static const char *prog_name = "nvr";
 
-    /* Parse options */
-    for (i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
-            debug_level++;
-        } else if (strncmp(argv[i], "-d", 2) == 0 && argv[i][2] == 'd') {
-            /* Handle -dd, -ddd etc */
-            const char *p = argv[i] + 1;
-            while (*p == 'd') { debug_level++; p++; }
-        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            usage(argv[0]);
-            return 0;
-        } else {
-            break;
-        }
+/* Run one command; argv[0] is the command name */
+static int cmd_dispatch(const struct command *c, int argc, char *argv[])
+{
+    if (c->flags & CMD_OPTS)
+        return ((cmd_fnv)c->fn)(c->nargs ? argv[1] : NULL,
+                                argc - 1 - c->nargs, argv + 1 + c->nargs);
+
+    switch (c->nargs) {
+    case 1:  return ((cmd_fn1)c->fn)(argv[1]);
+    case 2:  return ((cmd_fn2)c->fn)(argv[1], argv[2]);
+    case 3:  return ((cmd_fn3)c->fn)(argv[1], argv[2], argv[3]);
     }
+    if (c->flags & CMD_RC)
+        return ((cmd_fn0)c->fn)();
+    c->fn();
+    return 0;
+}
 
-    if (i >= argc)
-        cmd = "show";
-    else
-        cmd = argv[i];
-
-    DBG(1, "Debug level: %d, Command: %s\n", debug_level, cmd);
+static int run_command(int argc, char *argv[])
+{
+    const struct command *c = cmd_lookup(argv[0]);
+    int rc;
 
-    /* ---- Configuration Display ---- */
-    if (strcmp(cmd, "show") == 0) {
-        show_all();
-    }
-    else if (strcmp(cmd, "time") == 0) {
-        show_time();
-    }
-    else if (strcmp(cmd, "alarm") == 0) {
-        show_alarm();
-    }
-    else if (strcmp(cmd, "floppy") == 0) {
-        show_floppy();
-    }
-    else if (strcmp(cmd, "harddisk") == 0 || strcmp(cmd, "hd") == 0) {
-        show_harddisk();
-    }
-    else if (strcmp(cmd, "equipment") == 0 || strcmp(cmd, "equip") == 0) {
-        show_equipment();
-    }
-    else if (strcmp(cmd, "memory") == 0 || strcmp(cmd, "mem") == 0) {
-        show_memory();
-    }
-    else if (strcmp(cmd, "status") == 0) {
-        show_rtc_status();
-    }
-    else if (strcmp(cmd, "diag") == 0) {
-        show_diagnostics();
+    if (!c) {
+        fprintf(stderr, "Unknown command: %s\n", argv[0]);
+        fprintf(stderr, "Use '%s --help' for usage information\n", prog_name);
+        return 1;
     }
-    else if (strcmp(cmd, "battery") == 0 || strcmp(cmd, "bat") == 0) {
-        show_battery();
+    if (argc - 1 < c->nargs) {
+        fprintf(stderr, "Usage: %s %s\n", c->name, c->args);
+        return 1;
     }
 
-    /* ---- Amstrad-specific ---- */
-    else if (strcmp(cmd, "amstrad") == 0) {
-        show_amstrad_full();
-    }
-    else if (strcmp(cmd, "language") == 0 || strcmp(cmd, "lang") == 0) {
-        show_amstrad_language();
-    }
-    else if (strcmp(cmd, "display") == 0 || strcmp(cmd, "video") == 0) {
-        show_display_type();
-    }
-    else if (strcmp(cmd, "mouse") == 0) {
-        show_mouse();
-    }
-    else if (strcmp(cmd, "mouse-test") == 0) {
-        mouse_test();
-    }
-    else if (strcmp(cmd, "mouse-reset") == 0) {
-        mouse_reset();
-    }
+    DBG(2, "Dispatch: %s -> entry %d\n", c->name, (int)(c - commands));
 
-    /* ---- Hardware diagnostics ---- */
-    else if (strcmp(cmd, "ports") == 0) {
-        show_ports();
-    }
-    else if (strcmp(cmd, "gameport") == 0 || strcmp(cmd, "joystick") == 0) {
-        show_gameport();
-    }
-    else if (strcmp(cmd, "pic") == 0) {
-        show_pic();
-    }
-    else if (strcmp(cmd, "dma") == 0) {
-        show_dma();
-    }
-    else if (strcmp(cmd, "pit") == 0 || strcmp(cmd, "timer") == 0) {
-        show_pit();
-    }
-    else if (strcmp(cmd, "deadman") == 0 || strcmp(cmd, "dead") == 0) {
-        show_deadman();
-    }
-    else if (strcmp(cmd, "speaker-test") == 0) {
-        speaker_test();
-    }
-    else if (strcmp(cmd, "beep") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Error: beep requires frequency argument\n");
+    if (!(c->flags & CMD_LOCK))
+        return cmd_dispatch(c, argc, argv);
+    if (nvr_lock() != 0)
+        return 1;
+    rc = cmd_dispatch(c, argc, argv);
+    nvr_unlock();
+    return rc;
+}
+
+/* ================================================================
+ * Batch / Script Mode
+ * ================================================================ */
+
+#define BATCH_LINE_MAX  128
+#define BATCH_ARGS_MAX  8
+
+/*
+ * Run commands from a script, one per line, in this process.  Blank
+ * lines and lines starting with '#' are skipped, so a script can carry
+ * a "#!/bin/nvr -f" header.  The whole script runs inside one staged
+ * transaction: CMOS writes and the checksum land in a single commit at
+ * the end, and nothing is written if any command fails.  A line longer
+ * than BATCH_LINE_MAX - 2 characters or with more than BATCH_ARGS_MAX
+ * words fails the same way rather than being split or cut short.
+ */
+static int run_batch(const char *filename)
+{
+    FILE *fp;
+    char line[BATCH_LINE_MAX];
+    char *args[BATCH_ARGS_MAX];
+    int lineno = 0, rc = 0;
+
+    if (strcmp(filename, "-") == 0) {
+        fp = stdin;
+    } else {
+        fp = fopen(filename, "r");
+        if (!fp) {
+            perror("Error opening script");
             return 1;
         }
-        return speaker_beep(argv[i + 1]);
     }
 
-    /* ---- Time/date setting ---- */
-    else if (strcmp(cmd, "set-time") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: set-time HH:MM:SS\n");
-            return 1;
-        }
-        return set_time(argv[i + 1]);
+    /* The whole script is one transaction, so it holds the lock too */
+    if (nvr_lock() != 0) {
+        if (fp != stdin)
+            fclose(fp);
+        return 1;
     }
-    else if (strcmp(cmd, "set-date") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: set-date DD/MM/YYYY\n");
-            return 1;
+    stage_begin();
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line;
+        int nargs = 0;
+
+        lineno++;
+        if (!strchr(line, '\n') && getc(fp) != EOF) {
+            fprintf(stderr, "%s:%d: line longer than %d characters\n",
+                    filename, lineno, BATCH_LINE_MAX - 2);
+            rc = 1;
+            break;
         }
-        return set_date(argv[i + 1]);
-    }
-    else if (strcmp(cmd, "set-dow") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: set-dow 1-7 (1=Sunday)\n");
-            return 1;
+        while (nargs < BATCH_ARGS_MAX) {
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+                p++;
+            if (*p == '\0' || *p == '#')
+                break;
+            args[nargs++] = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+                p++;
+            if (*p)
+                *p++ = '\0';
         }
-        return set_dow(argv[i + 1]);
-    }
-    else if (strcmp(cmd, "set-alarm") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: set-alarm HH:MM:SS (-1 for wildcard)\n");
-            return 1;
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            p++;
+        if (*p && *p != '#') {
+            fprintf(stderr, "%s:%d: more than %d words\n",
+                    filename, lineno, BATCH_ARGS_MAX);
+            rc = 1;
+            break;
         }
-        return set_alarm(argv[i + 1]);
-    }
-    else if (strcmp(cmd, "alarm-enable") == 0) {
-        alarm_enable(1);
-    }
-    else if (strcmp(cmd, "alarm-disable") == 0) {
-        alarm_enable(0);
-    }
-    else if (strcmp(cmd, "watch") == 0) {
-        watch_time();
-    }
+        if (nargs == 0)
+            continue;
 
-    /* ---- Drive configuration ---- */
-    else if (strcmp(cmd, "set-floppy") == 0) {
-        if (i + 2 >= argc) {
-            fprintf(stderr, "Usage: set-floppy A|B TYPE\n");
-            return 1;
-        }
-        return set_floppy(argv[i + 1], argv[i + 2]);
-    }
-    else if (strcmp(cmd, "set-harddisk") == 0 || strcmp(cmd, "set-hd") == 0) {
-        if (i + 2 >= argc) {
-            fprintf(stderr, "Usage: set-harddisk 0|1 TYPE\n");
-            return 1;
+        DBG(1, "%s:%d: %s (%d arg(s))\n", filename, lineno, args[0], nargs - 1);
+        rc = run_command(nargs, args);
+        if (rc != 0) {
+            fprintf(stderr, "%s:%d: '%s' failed, stopping\n",
+                    filename, lineno, args[0]);
+            break;
         }
-        return set_harddisk(argv[i + 1], argv[i + 2]);
     }
 
-    /* ---- Equipment configuration ---- */
-    else if (strcmp(cmd, "set-equip") == 0) {
-        if (i + 2 >= argc) {
-            fprintf(stderr, "Usage: set-equip FIELD VAL\n");
-            fprintf(stderr, "Fields: fpu, video, floppy-count\n");
-            return 1;
-        }
-        return set_equipment(argv[i + 1], argv[i + 2]);
-    }
-    else if (strcmp(cmd, "set-basemem") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: set-basemem KB\n");
-            return 1;
-        }
-        return set_basemem(argv[i + 1]);
-    }
+    if (fp != stdin)
+        fclose(fp);
 
-    /* ---- RTC mode configuration ---- */
-    else if (strcmp(cmd, "set-rtc") == 0) {
-        if (i + 2 >= argc) {
-            fprintf(stderr, "Usage: set-rtc MODE VAL\n");
-            fprintf(stderr, "Modes: 24h bcd sqw dse pie uie rate\n");
-            return 1;
-        }
-        return set_rtc_mode(argv[i + 1], argv[i + 2]);
+    if (rc == 0) {
+        rc = stage_commit();
+    } else {
+        stage_abort();
+        fprintf(stderr, "No CMOS changes were written\n");
     }
+    nvr_unlock();
+    return rc;
+}
 
-    /* ---- CMOS operations ---- */
-    else if (strcmp(cmd, "dump") == 0) {
-        dump_cmos();
-    }
-    else if (strcmp(cmd, "read") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: read ADDR\n");
-            return 1;
-        }
-        return raw_read(argv[i + 1]);
-    }
-    else if (strcmp(cmd, "write") == 0) {
-        if (i + 2 >= argc) {
-            fprintf(stderr, "Usage: write ADDR VAL\n");
-            return 1;
-        }
-        return raw_write(argv[i + 1], argv[i + 2]);
-    }
-    else if (strcmp(cmd, "fill") == 0) {
-        if (i + 3 >= argc) {
-            fprintf(stderr, "Usage: fill START END VAL\n");
-            return 1;
-        }
-        return fill_cmos(argv[i + 1], argv[i + 2], argv[i + 3]);
-    }
-    else if (strcmp(cmd, "checksum") == 0) {
-        if (cmos_verify_checksum()) {
-            printf("CMOS checksum is valid\n");
+/* ================================================================
+ * Main
+ * ================================================================ */
+
+int main(int argc, char *argv[])
+{
+    int i, rc;
+    const char *script = NULL;
+    char *def_argv[1];
+
+    prog_name = argv[0];
+#if NVR_TINY_PRINTF
+    atexit(out_flush);              /* printf text sits in out_buf */
+#endif
+
+    /* Parse options */
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
+            debug_level++;
+        } else if (strncmp(argv[i], "-d", 2) == 0 && argv[i][2] == 'd') {
+            /* Handle -dd, -ddd etc */
+            const char *p = argv[i] + 1;
+            while (*p == 'd') { debug_level++; p++; }
+#if NVR_EMU
+        } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--backend") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Usage: -b ports|emu|file:PATH\n");
+                return 1;
+            }
+            if (io_select(argv[++i]) != 0)
+                return 1;
+#endif
+        } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Usage: -f SCRIPT (use - for stdin)\n");
+                return 1;
+            }
+            script = argv[++i];
+#if NVR_CONFIG
+        } else if (strncmp(argv[i], "--format=", 9) == 0) {
+            if (fmt_select(argv[i] + 9) != 0)
+                return 1;
+#endif
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--stats") == 0) {
+            stats_enabled = 1;
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return 0;
         } else {
-            printf("CMOS checksum is INVALID - recalculating...\n");
-            cmos_update_checksum();
-            printf("Checksum updated\n");
-        }
-    }
-    else if (strcmp(cmd, "save") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: save FILE\n");
-            return 1;
-        }
-        return save_cmos(argv[i + 1]);
-    }
-    else if (strcmp(cmd, "load") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: load FILE\n");
-            return 1;
-        }
-        return load_cmos(argv[i + 1]);
-    }
-    else if (strcmp(cmd, "compare") == 0 || strcmp(cmd, "diff") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: compare FILE\n");
-            return 1;
+            break;
         }
-        return compare_cmos(argv[i + 1]);
-    }
-    else if (strcmp(cmd, "factory-reset") == 0) {
-        factory_reset();
-    }
-    else if (strcmp(cmd, "clear-diag") == 0) {
-        clear_diagnostics();
     }
 
-    /* ---- Debug ---- */
-    else if (strcmp(cmd, "probe") == 0) {
-        debug_probe();
-    }
-    else if (strcmp(cmd, "trace") == 0) {
-        debug_nvr_trace();
-    }
-    else if (strcmp(cmd, "inb") == 0) {
-        if (i + 1 >= argc) {
-            fprintf(stderr, "Usage: inb PORT\n");
-            return 1;
-        }
-        return port_read(argv[i + 1]);
-    }
-    else if (strcmp(cmd, "outb") == 0) {
-        if (i + 2 >= argc) {
-            fprintf(stderr, "Usage: outb PORT VAL\n");
-            return 1;
+    if (stats_enabled)
+        io_stats_start();
+
+    if (script) {
+        DBG(1, "Debug level: %d, Script: %s\n", debug_level, script);
+        rc = run_batch(script);
+    } else {
+        DBG(1, "Debug level: %d, Command: %s\n", debug_level,
+            (i < argc) ? argv[i] : NVR_DEFAULT_CMD);
+        if (i >= argc) {
+            def_argv[0] = NVR_DEFAULT_CMD;
+            rc = run_command(1, def_argv);
+        } else {
+            rc = run_command(argc - i, argv + i);
         }
-        return port_write(argv[i + 1], argv[i + 2]);
-    }
-    else if (strcmp(cmd, "soft-reset") == 0 || strcmp(cmd, "reboot") == 0) {
-        soft_reset();
-    }
-    else {
-        fprintf(stderr, "Unknown command: %s\n", cmd);
-        fprintf(stderr, "Use '%s --help' for usage information\n", argv[0]);
-        return 1;
     }
 
-    return 0;
+    if (stats_enabled) {
+        fflush(stdout);
+        io_stats_report();
+    }
+    return rc;
 }